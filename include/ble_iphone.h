@@ -8,14 +8,15 @@
 #include <vector>
 #include <string>
 #include "config.h"
+#include "ble_sync.h"
 
 struct BleIphoneContext {
   NimBLEServer *server = nullptr;
   NimBLECharacteristic *txChar = nullptr; // notify to iPhone
   NimBLECharacteristic *rxChar = nullptr; // writes from iPhone
-  NimBLEAdvertising *advertising = nullptr;
   std::queue<std::string> inbox;
-  bool connected = false;
+  volatile bool connected = false;  // subscribed to txChar
+  uint16_t conn = 0;                // the phone's connection, while connected
 };
 
 namespace BleIphone {
@@ -30,71 +31,98 @@ class RxCallbacks : public NimBLECharacteristicCallbacks {
   }
 };
 
+// The phone is whoever subscribes to the UART TX; the server also
+// carries the controller's sync link on a node
+class TxCallbacks : public NimBLECharacteristicCallbacks {
+ public:
+  void onSubscribe(NimBLECharacteristic *, ble_gap_conn_desc *desc, uint16_t subValue) {
+    if (!g_ctx) return;
+    if (subValue != 0) {
+      g_ctx->conn = desc->conn_handle;
+      g_ctx->connected = true;
+    } else if (desc->conn_handle == g_ctx->conn) {
+      g_ctx->connected = false;
+    }
+  }
+};
+
 class ServerCallbacks : public NimBLEServerCallbacks {
  public:
-  void onConnect(NimBLEServer* pServer) {
+  void onConnect(NimBLEServer* pServer, ble_gap_conn_desc *) {
     Serial.print(F("[BLE iPhone] Client connected. Connected count: "));
     Serial.println(pServer->getConnectedCount());
-    if (g_ctx) g_ctx->connected = true;
   }
-  void onDisconnect(NimBLEServer* pServer) {
+  void onDisconnect(NimBLEServer* pServer, ble_gap_conn_desc *desc) {
     Serial.print(F("[BLE iPhone] Client disconnected. Connected count: "));
     Serial.println(pServer->getConnectedCount());
-    if (g_ctx) g_ctx->connected = false;
+    if (g_ctx && desc->conn_handle == g_ctx->conn) g_ctx->connected = false;
   }
 };
 
 inline void init(BleIphoneContext &ctx) {
   g_ctx = &ctx;
   
-  // Initialize BLE (can coexist with WiFi/ESP-NOW)
+#if !defined(USE_BLE_SYNC)
+  // Initialize BLE (can coexist with WiFi/ESP-NOW); with the BLE sync
+  // link, BleSync::init already has
   NimBLEDevice::init(DEVICE_BLE_NAME);
   NimBLEDevice::setPower(ESP_PWR_LVL_P9); // max power for range
+#endif
   
   Serial.println(F("[BLE iPhone] Initialized"));
 }
 
-inline void start(BleIphoneContext &ctx) {
-  ctx.server = NimBLEDevice::createServer();
-  
-  // Set server callbacks
+// With the BLE sync link, the UART service joins its server and its
+// advertising (BleSync::shareServer(), then BleSync::advertise() once
+// every service is in); otherwise it has NimBLE to itself
+inline void start(BleIphoneContext &ctx, BleSyncContext &sync) {
   static ServerCallbacks serverCallbacks;
+#if defined(USE_BLE_SYNC)
+  ctx.server = BleSync::shareServer(sync, UART_SERVICE_UUID, &serverCallbacks);
+#else
+  (void)sync;
+  ctx.server = NimBLEDevice::createServer();
   ctx.server->setCallbacks(&serverCallbacks);
+#endif
   
   // Create UART service
   auto *service = ctx.server->createService(UART_SERVICE_UUID);
   ctx.txChar = service->createCharacteristic(UART_TX_UUID, NIMBLE_PROPERTY::NOTIFY);
+  static TxCallbacks txCallbacks;
+  ctx.txChar->setCallbacks(&txCallbacks);
   ctx.rxChar = service->createCharacteristic(UART_RX_UUID, NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR);
   static RxCallbacks rxCallbacks;
   ctx.rxChar->setCallbacks(&rxCallbacks);
   service->start();
 
+#if !defined(USE_BLE_SYNC)
   // Configure advertising
-  ctx.advertising = NimBLEDevice::getAdvertising();
-  ctx.advertising->setMinInterval(32); // 20ms in 0.625ms units
-  ctx.advertising->setMaxInterval(160); // 100ms in 0.625ms units
+  NimBLEAdvertising *advertising = NimBLEDevice::getAdvertising();
+  advertising->setMinInterval(32); // 20ms in 0.625ms units
+  advertising->setMaxInterval(160); // 100ms in 0.625ms units
   
   NimBLEAdvertisementData advData;
   advData.setName(DEVICE_BLE_NAME);
   advData.setCompleteServices(NimBLEUUID(UART_SERVICE_UUID));
   
-  ctx.advertising->setAdvertisementData(advData);
-  ctx.advertising->start();
+  advertising->setAdvertisementData(advData);
+  advertising->start();
   
   Serial.print(F("[BLE iPhone] Advertising as '"));
   Serial.print(DEVICE_BLE_NAME);
   Serial.println(F("' with UART service"));
+#endif
   Serial.println(F("[BLE iPhone] Ready for iPhone connection"));
 }
 
 inline bool isConnected(const BleIphoneContext &ctx) {
-  return ctx.connected && ctx.server && ctx.server->getConnectedCount() > 0;
+  return ctx.connected && ctx.server;
 }
 
 inline void write(const BleIphoneContext &ctx, const std::string &payload) {
   if (payload.empty()) return;
   
-  if (ctx.txChar && ctx.server && ctx.server->getConnectedCount() > 0) {
+  if (ctx.txChar && ctx.connected) {
     ctx.txChar->setValue(payload);
     ctx.txChar->notify();
   }
@@ -1,134 +1,587 @@
-// BLE Synchronization for Controller and Node (replaces ESP-NOW)
+// Controller <-> node sync link over ESP-NOW, BLE, or both at once
 #ifndef BLE_SYNC_H
 #define BLE_SYNC_H
 
 #include <Arduino.h>
-#if defined(USE_ESPNOW)
+#include "config.h"
 #include <WiFi.h>
 #include <esp_now.h>
-#else
+#include <esp_wifi.h>
+#if defined(USE_BLE_SYNC)
 #include <NimBLEDevice.h>
+#include <Preferences.h>
 #endif
-#include <queue>
-#include <vector>
-#include "config.h"
+#include "frame_ring.h"
+#include "metrics.h"
 #include "stimulation_sequence.h"
 
-// Packet structures (same as ESP-NOW)
+// Packet structures. The first byte of every packet is its SyncMsgType.
+enum SyncMsgType : uint8_t {
+  MSG_SYNC = 1,       // controller -> node: sequence to play
+  MSG_SYNC_ACK = 2,   // node -> controller: sequence received
+  MSG_TIME_PING = 3,  // controller -> node: clock sync exchange
+  MSG_TIME_ACK = 4,   // node -> controller: clock sync reply
+  MSG_SYNC_SEED = 5,  // controller -> node: sequences as seeds to regenerate
+  MSG_FW_OFFER = 6,   // controller -> node: node firmware available (fw_transfer.h)
+  MSG_FW_REQUEST = 7, // node -> controller: send it, starting here
+  MSG_FW_BLOCK = 8,   // controller -> node: a piece of the image
+  MSG_FW_ACK = 9,     // node -> controller: installed, or failed
+  MSG_FW_POLL = 10,   // controller -> node: which blocks of this window are missing?
+  MSG_FW_NACK = 11,   // node -> controller: these
+  MSG_LINK_PROBE = 12,     // controller -> node, on each transport: measure it
+  MSG_LINK_PROBE_ACK = 13, // node -> controller, on the transport the probe came over
+};
+
 typedef struct {
-  uint32_t t_send_us;    // Controller timestamp
+  uint8_t type;          // MSG_SYNC
+  uint64_t startTimeUs;  // when to start playing, in controller time
   StimulationPeriod stimPeriods[NUM_PERIODS];
-  uint32_t startDelayUs; // how long after receipt the node should start (microseconds)
 } SyncPacket;
 
+// A sequence the node rebuilds locally with StimulationSequence::generate()
+typedef struct {
+  uint32_t seed;
+  uint32_t index;        // controller's running sequence number
+  uint64_t startTimeUs;  // controller time
+} SequenceDescriptor;
+
+typedef struct {
+  uint8_t type;          // MSG_SYNC_SEED
+  uint32_t paramHash;    // StimulationSequence::paramHash() of the sender
+  uint8_t count;
+  SequenceDescriptor desc[SYNC_SEED_MAX];
+} SeedPacket;
+
 typedef struct {
-  uint32_t t_recv_us;
-  uint32_t t_send_us;
+  uint8_t type;          // MSG_SYNC_ACK
+  uint64_t startTimeUs;  // echo of the acknowledged SyncPacket
 } AckPacket;
 
+// Four-timestamp clock exchange (see clock_sync.h). The controller only
+// learns t4 after the ACK arrives, so it reports it in the next ping. One
+// ping goes to every node, so it carries one report per node that answered.
+typedef struct {
+  uint8_t addr[SYNC_ADDR_LEN];  // node the report is for
+  uint8_t seq;                  // ping that node answered
+  uint64_t t4_us;               // controller receive time of its ACK
+} PingReport;
+
+typedef struct {
+  uint8_t type;          // MSG_TIME_PING
+  uint8_t seq;
+  uint64_t t1_us;        // controller send time of this ping
+  uint8_t count;         // reports that follow; only these are sent
+  PingReport prev[SYNC_MAX_NODES];
+} TimePingPacket;
+
+inline size_t timePingSize(uint8_t count) {
+  return offsetof(TimePingPacket, prev) + count * sizeof(PingReport);
+}
+
+typedef struct {
+  uint8_t type;          // MSG_TIME_ACK
+  uint8_t seq;
+  uint64_t t2_us;        // node receive time
+  uint64_t t3_us;        // node send time
+} TimeAckPacket;
+
+// With both transports built in, the controller probes each one and sends
+// on the faster; the link layer answers and consumes these itself
+typedef struct {
+  uint8_t type;          // MSG_LINK_PROBE
+  uint8_t transport;     // SyncTransport it was sent on
+  uint16_t seq;
+  uint32_t t1Us;         // controller send time, low 32 bits
+} LinkProbePacket;
+
+typedef struct {
+  uint8_t type;          // MSG_LINK_PROBE_ACK
+  uint8_t transport;
+  uint16_t seq;
+  uint32_t t1Us;         // echo
+  uint8_t id[SYNC_ADDR_LEN];  // the node's address on every transport (localAddress())
+} LinkProbeAckPacket;
+
+// Receive handler. Runs on the sync task, not the radio task; the frame
+// carries the sender and the time the radio delivered it.
+typedef void (*SyncReceiveCallback)(const SyncFrame &frame);
+
+#if defined(USE_BLE_SYNC)
+// Where the controller's connection manager is (see linkTaskMain)
+enum BleLinkState : uint8_t {
+  LINK_IDLE,          // every slot in use, or waiting to rescan
+  LINK_SCANNING,
+  LINK_CONNECTING,
+  LINK_DISCOVERING,   // looking up the sync service and characteristics
+  LINK_SUBSCRIBING,
+};
+#endif
+
+// What a link negotiated, from BleSync::linkParams()
+struct SyncLinkParams {
+  uint8_t addr[SYNC_ADDR_LEN];  // the node; zeros on a node (its one link is the controller)
+  uint16_t mtu;                 // ATT MTU: a frame goes in one write up to mtu - 3 bytes
+  uint8_t txPhy;                // 1 = 1M, 2 = 2M, 3 = coded
+  uint8_t rxPhy;
+  uint16_t txOctets;            // link-layer payload each way (27 without DLE); 0 if the host never said
+  uint16_t rxOctets;
+};
+
+#if defined(USE_BLE_SYNC)
+// Attribute handles of a node's sync characteristics; 0 while not known
+struct BleHandles {
+  uint16_t tx;       // TX value: the node's notifications
+  uint16_t txCccd;   // TX client configuration: written to subscribe
+  uint16_t rx;       // RX value: frames to the node
+};
+#endif
+
+#if defined(USE_BLE_SYNC)
+// A live BLE connection as its GAP events left it, on either role
+struct BleLink {
+  bool used = false;
+  uint16_t connHandle = 0;
+  SyncLinkParams params;
+};
+#endif
+
+// A node link held by the controller. Over BLE each node is its own
+// connection; ESP-NOW learns nodes from their probe answers (EspNowPeer).
+struct SyncPeer {
+#if defined(USE_BLE_SYNC)
+  NimBLEClient *client = nullptr;
+  uint16_t connHandle = 0;
+  BleHandles handles = {0, 0, 0};
+#endif
+  uint8_t addr[SYNC_ADDR_LEN] = {0};  // BLE address
+  uint8_t id[SYNC_ADDR_LEN] = {0};    // the node's own (localAddress()), from its first probe answer
+  volatile bool idKnown = false;
+  bool connected = false;
+};
+
+// One node's probe answers over one transport
+struct LinkStats {
+  bool used = false;
+  uint8_t id[SYNC_ADDR_LEN] = {0};
+  uint16_t lastSeq = 0;        // newest probe answered
+  uint32_t lastAckMs = 0;
+  uint32_t rttUs = 0;          // smoothed, 1/8 per answer
+  uint16_t lossPermille = 0;   // smoothed, 1/8 per probe
+};
+
+// A unicast ESP-NOW peer: a node on the controller, the controller on a
+// node. Frames to it are acknowledged by its radio and resent if not.
+struct EspNowPeer {
+  bool used = false;
+  uint8_t addr[SYNC_ADDR_LEN] = {0};
+  uint32_t heardMs = 0;        // last frame from it
+};
+
+enum EspNowFrameState : uint8_t {
+  ESPNOW_FREE,
+  ESPNOW_IN_FLIGHT,   // sent, waiting for the send status
+  ESPNOW_RESEND,      // not acknowledged; the sync task sends it again
+};
+
+// A unicast frame kept until its send status says it arrived
+struct EspNowFrame {
+  volatile EspNowFrameState state = ESPNOW_FREE;
+  uint8_t addr[SYNC_ADDR_LEN] = {0};
+  uint8_t attempts = 0;
+  uint32_t order = 0;          // send order; statuses come back in it
+  uint64_t firstUs = 0;        // first attempt, for the delivery latency
+  uint16_t len = 0;
+  uint8_t data[SYNC_FRAME_MAX];
+};
+
 // BLE Context for sync communication
 struct BleSyncContext {
-#if !defined(USE_ESPNOW)
-  NimBLEServer *server = nullptr;
-  NimBLEClient *client = nullptr;
-  NimBLEAdvertisedDevice *peerDevice = nullptr;
+#if defined(USE_BLE_SYNC)
+  NimBLEServer *server = nullptr;       // shared with the phone's UART service (shareServer())
   NimBLECharacteristic *txChar = nullptr;
   NimBLECharacteristic *rxChar = nullptr;
-  NimBLERemoteCharacteristic *remoteTxChar = nullptr;
-  NimBLERemoteCharacteristic *remoteRxChar = nullptr;
+  uint16_t controllerConn = 0;          // node: the connection subscribed to txChar, while up[SYNC_BLE]
+  const char *sharedService = nullptr;  // another service on the server, advertised too
+  NimBLEServerCallbacks *sharedCallbacks = nullptr;  // its connection callbacks, called after ours
+  NimBLEAddress found[SYNC_MAX_NODES];  // matching advertisers waiting to connect
+  uint8_t foundCount = 0;
+  portMUX_TYPE foundMux = portMUX_INITIALIZER_UNLOCKED;
+  TaskHandle_t linkTask = nullptr;
+  volatile BleLinkState linkState = LINK_IDLE;
+  volatile bool rescan = true;          // scan on the next wake rather than at SYNC_RESCAN_MS
+  uint32_t lastScanMs = 0;
+  portMUX_TYPE peerMux = portMUX_INITIALIZER_UNLOCKED;  // peers, links: link task, NimBLE host, sync task
+  BleLink links[SYNC_MAX_NODES + 1];     // under peerMux; one more for a phone (BLUETOOTH)
+  SemaphoreHandle_t gattDone = nullptr;  // link task: a subscription write was answered
+  volatile int gattStatus = 0;
 #endif
-  std::queue<std::vector<uint8_t>> rxBuffer;
-  bool connected = false;
-  bool scanning = false;
+  SyncPeer peers[SYNC_MAX_NODES];
+  FrameRing rxRing[SYNC_TRANSPORTS];  // radio task -> sync task, one producer each
+  TaskHandle_t rxTask = nullptr;
+  volatile bool up[SYNC_TRANSPORTS] = {false};   // a frame can get through on it
+  volatile SyncTransport active = SYNC_ESPNOW;   // send() uses this one
+  uint8_t selfId[SYNC_ADDR_LEN] = {0};
+  LinkStats stats[SYNC_TRANSPORTS][SYNC_MAX_NODES];   // controller
+  portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+  uint16_t probeSeq = 0;
+  uint32_t lastProbeMs = 0;
+  uint32_t switchedMs = 0;
+  volatile bool scanning = false;
+  uint32_t joins = 0;    // links established; lets the app notice a new node
+  uint8_t channel = SYNC_ESPNOW_CHANNEL;
+  EspNowPeer unicast[SYNC_MAX_NODES];
+  EspNowFrame inFlight[SYNC_ESPNOW_INFLIGHT];
+  portMUX_TYPE inFlightMux = portMUX_INITIALIZER_UNLOCKED;
+  uint32_t sendOrder = 0;
+  volatile bool resendDue = false;
+  SemaphoreHandle_t sendLock = nullptr;  // one sender at a time, so statuses match their frames
+  uint32_t probeHeardMs = 0;   // node: last probe from the controller
+  uint32_t hopMs = 0;          // node: last channel change
 };
 
 namespace BleSync {
 static BleSyncContext *g_ctx = nullptr;
-static void (*g_onReceiveCallback)(const uint8_t*, size_t) = nullptr;
+static SyncReceiveCallback g_onReceiveCallback = nullptr;
+static const uint8_t g_noAddr[SYNC_ADDR_LEN] = {0};
+
+// Runs on the radio task: the radio callbacks only timestamp the frame,
+// copy it into the ring and wake the sync task. Parsing, replies and
+// logging all happen there, so they neither block the radio stack nor add
+// their own latency to the timestamps.
+static void deliver(const uint8_t *addr, const uint8_t *data, size_t len, uint64_t rxUs, SyncTransport transport) {
+  if (!g_ctx->rxRing[transport].push(addr, data, len, rxUs, transport)) {
+    Metrics::count(METRIC_RX_DROPPED);
+    return;
+  }
+  Metrics::count(METRIC_PACKETS_RECEIVED);
+  if (g_ctx->rxTask) xTaskNotifyGive(g_ctx->rxTask);
+}
+
+inline bool onLinkFrame(BleSyncContext &ctx, const SyncFrame &frame);
+namespace EspNow {
+inline void resendFailed(BleSyncContext &ctx);
+}
+
+// Drains the ring into the receive callback, after the link layer has
+// taken its own frames. Without a callback, frames stay in the ring for
+// receive(). Also resends the ESP-NOW frames a peer didn't acknowledge.
+static void rxTaskMain(void *arg) {
+  BleSyncContext *ctx = (BleSyncContext *)arg;
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    EspNow::resendFailed(*ctx);
+    if (!g_onReceiveCallback) continue;
 
-#if defined(USE_ESPNOW)
-// ---------------- ESP-NOW (NODE) IMPLEMENTATION ----------------
+    for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) {
+      const SyncFrame *frame;
+      while ((frame = ctx->rxRing[t].peek()) != nullptr) {
+        if (!onLinkFrame(*ctx, *frame)) g_onReceiveCallback(*frame);
+        ctx->rxRing[t].release();
+      }
+    }
+  }
+}
 
-static void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len) {
+inline void startRxTask(BleSyncContext &ctx) {
+  if (ctx.rxTask) return;
+  xTaskCreatePinnedToCore(rxTaskMain, "sync_rx", SYNC_TASK_STACK, &ctx,
+                          SYNC_TASK_PRIORITY, &ctx.rxTask, SYNC_TASK_CORE);
+}
+
+// ==================== ESP-NOW ====================
+
+namespace EspNow {
+
+static void recvCB(const uint8_t *mac_addr, const uint8_t *data, int len) {
+  uint64_t rxUs = (uint64_t)esp_timer_get_time();
   if (!g_ctx) return;
-  std::vector<uint8_t> vec(data, data + len);
-  g_ctx->rxBuffer.push(vec);
-  if (g_onReceiveCallback) g_onReceiveCallback(vec.data(), vec.size());
-  g_ctx->connected = true;
+  if (len <= 0) return;
+  deliver(mac_addr, data, (size_t)len, rxUs, SYNC_ESPNOW);
+  g_ctx->up[SYNC_ESPNOW] = true;
 }
 
-inline void init(BleSyncContext &ctx) {
-  g_ctx = &ctx;
+// The oldest frame to addr still waiting for its status
+inline EspNowFrame *oldestInFlight(BleSyncContext &ctx, const uint8_t *addr) {
+  EspNowFrame *oldest = nullptr;
+  for (uint8_t i = 0; i < SYNC_ESPNOW_INFLIGHT; i++) {
+    EspNowFrame &f = ctx.inFlight[i];
+    if (f.state != ESPNOW_IN_FLIGHT || memcmp(f.addr, addr, SYNC_ADDR_LEN) != 0) continue;
+    if (!oldest || (int32_t)(f.order - oldest->order) < 0) oldest = &f;
+  }
+  return oldest;
+}
+
+// Runs on the WiFi task once the peer's radio acknowledged a unicast frame,
+// or didn't after its own retries. A miss is handed to the sync task to
+// resend at once, rather than left to the protocol's much slower timeouts.
+// Broadcasts aren't tracked; their status is always a success.
+static void sendCB(const uint8_t *mac_addr, esp_now_send_status_t status) {
+  uint64_t nowUs = (uint64_t)esp_timer_get_time();
+  if (!g_ctx || !mac_addr) return;
+  BleSyncContext &ctx = *g_ctx;
+  int64_t latencyUs = -1;
+  bool resend = false;
+  bool undelivered = false;
+  portENTER_CRITICAL(&ctx.inFlightMux);
+  EspNowFrame *f = oldestInFlight(ctx, mac_addr);
+  if (f) {
+    if (status == ESP_NOW_SEND_SUCCESS) {
+      latencyUs = (int64_t)(nowUs - f->firstUs);
+      f->state = ESPNOW_FREE;
+    } else if (f->attempts <= SYNC_ESPNOW_RETRIES) {
+      f->state = ESPNOW_RESEND;
+      ctx.resendDue = resend = true;
+    } else {
+      f->state = ESPNOW_FREE;
+      undelivered = true;
+    }
+  }
+  portEXIT_CRITICAL(&ctx.inFlightMux);
+
+  if (latencyUs >= 0) Metrics::observe(METRIC_ESPNOW_DELIVERY, latencyUs);
+  if (undelivered) Metrics::count(METRIC_ESPNOW_UNDELIVERED);
+  if (resend && ctx.rxTask) xTaskNotifyGive(ctx.rxTask);
+}
+
+// The channel is pinned (OTA::espNowChannel()) rather than left wherever
+// the radio happens to be, so the controller and its nodes agree on it
+inline void init(BleSyncContext &ctx, uint8_t channel) {
+  ctx.sendLock = xSemaphoreCreateMutex();
   WiFi.mode(WIFI_STA);
   WiFi.disconnect();
   if (esp_now_init() != ESP_OK) {
     Serial.println(F("[ESP-NOW] init failed"));
-  } else {
-    esp_now_register_recv_cb(espnow_recv_cb);
-    Serial.println(F("[ESP-NOW] Initialized"));
+    return;
+  }
+  ctx.channel = channel;
+  esp_wifi_set_channel(channel, WIFI_SECOND_CHAN_NONE);
+  esp_now_register_recv_cb(recvCB);
+  esp_now_register_send_cb(sendCB);
+  // esp_now_send() only sends to registered peers, broadcast included
+  esp_now_peer_info_t peer = {};
+  memcpy(peer.peer_addr, BROADCASTADDRESS, SYNC_ADDR_LEN);
+  peer.channel = 0;  // whatever channel the radio is on
+  peer.encrypt = false;
+  if (!esp_now_is_peer_exist(BROADCASTADDRESS) && esp_now_add_peer(&peer) != ESP_OK) {
+    Serial.println(F("[ESP-NOW] broadcast peer add failed"));
   }
+  ctx.probeHeardMs = ctx.hopMs = millis();
+  Serial.printf("[ESP-NOW] Initialized on channel %u\n", (unsigned)channel);
+#ifdef CONTROLLER
+  // Connectionless: the controller can broadcast from the start, and the
+  // nodes only ever answer it
+  ctx.up[SYNC_ESPNOW] = true;
+#endif
 }
 
-inline void setReceiveCallback(void (*callback)(const uint8_t*, size_t)) {
-  g_onReceiveCallback = callback;
+inline bool fresh(const EspNowPeer &peer, uint32_t nowMs) {
+  return peer.used && nowMs - peer.heardMs < SYNC_NODE_TIMEOUT_MS;
 }
 
-inline void startServer(BleSyncContext &ctx) {
-  // For ESP-NOW, nothing to advertise; ensure initialized
-  g_ctx = &ctx;
-  ctx.connected = false;
+// Note a frame from addr. With add, a sender that isn't a peer yet is
+// registered as one, in a free slot or the one silent longest past
+// SYNC_NODE_TIMEOUT_MS. On the sync task.
+inline void learnPeer(BleSyncContext &ctx, const uint8_t *addr, bool add) {
+  if (!ctx.sendLock) return;
+  uint32_t nowMs = millis();
+  xSemaphoreTake(ctx.sendLock, portMAX_DELAY);
+  EspNowPeer *slot = nullptr;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    EspNowPeer &p = ctx.unicast[i];
+    if (p.used && memcmp(p.addr, addr, SYNC_ADDR_LEN) == 0) {
+      p.heardMs = nowMs;
+      xSemaphoreGive(ctx.sendLock);
+      return;
+    }
+    if (fresh(p, nowMs)) continue;
+    if (!slot || (slot->used && (!p.used || nowMs - p.heardMs > nowMs - slot->heardMs))) slot = &p;
+  }
+  if (add && slot) {
+    if (slot->used) esp_now_del_peer(slot->addr);
+    slot->used = false;
+    esp_now_peer_info_t peer = {};
+    memcpy(peer.peer_addr, addr, SYNC_ADDR_LEN);
+    // Whatever channel the radio is on: the controller's wherever a node
+    // found it, and still valid if an update check moves the radio to its
+    // access point's channel (OTA), where a pinned peer couldn't be sent to
+    peer.channel = 0;
+    peer.ifidx = WIFI_IF_STA;
+    peer.encrypt = false;
+    if (esp_now_is_peer_exist(addr) || esp_now_add_peer(&peer) == ESP_OK) {
+      slot->used = true;
+      memcpy(slot->addr, addr, SYNC_ADDR_LEN);
+      slot->heardMs = nowMs;
+#ifdef CONTROLLER
+      ctx.joins++;
+#endif
+      Serial.printf("[ESP-NOW] Unicast peer %02X:%02X:%02X:%02X:%02X:%02X\n",
+                    addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+    } else {
+      Serial.println(F("[ESP-NOW] peer add failed"));
+    }
+  }
+  xSemaphoreGive(ctx.sendLock);
 }
 
-inline bool scanAndConnect(BleSyncContext &ctx, uint32_t /*scanTimeSeconds*/ = 5) {
-  // ESP-NOW does not scan; rely on broadcast/peer setup. Return whether we've seen controller.
-  return ctx.connected;
+inline uint8_t peerCount(const BleSyncContext &ctx) {
+  uint32_t nowMs = millis();
+  uint8_t n = 0;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (fresh(ctx.unicast[i], nowMs)) n++;
+  }
+  return n;
 }
 
-inline bool send(BleSyncContext &ctx, const uint8_t *data, size_t len) {
-  (void)ctx;
-  // Send as broadcast; controller should receive and respond
-  esp_err_t res = esp_now_send(BROADCASTADDRESS, data, (int)len);
-  return (res == ESP_OK);
+// One unicast frame, kept until its status comes back. Refused while
+// SYNC_ESPNOW_INFLIGHT frames are still waiting. With sendLock held.
+inline bool sendTracked(BleSyncContext &ctx, const uint8_t *addr, const uint8_t *data, size_t len) {
+  EspNowFrame *f = nullptr;
+  portENTER_CRITICAL(&ctx.inFlightMux);
+  for (uint8_t i = 0; i < SYNC_ESPNOW_INFLIGHT && !f; i++) {
+    if (ctx.inFlight[i].state == ESPNOW_FREE) f = &ctx.inFlight[i];
+  }
+  if (f) {
+    f->state = ESPNOW_IN_FLIGHT;
+    memcpy(f->addr, addr, SYNC_ADDR_LEN);
+    f->attempts = 1;
+    f->order = ctx.sendOrder++;
+  }
+  portEXIT_CRITICAL(&ctx.inFlightMux);
+  if (!f) {
+    Metrics::count(METRIC_SEND_FAILURES);
+    return false;
+  }
+
+  // No status can come back for it before it's sent
+  f->firstUs = (uint64_t)esp_timer_get_time();
+  f->len = (uint16_t)len;
+  memcpy(f->data, data, len);
+  esp_err_t res = esp_now_send(addr, data, len);
+  if (res != ESP_OK) {
+    portENTER_CRITICAL(&ctx.inFlightMux);
+    f->state = ESPNOW_FREE;
+    portEXIT_CRITICAL(&ctx.inFlightMux);
+  }
+  Metrics::count(res == ESP_OK ? METRIC_PACKETS_SENT : METRIC_SEND_FAILURES);
+  return res == ESP_OK;
 }
 
-inline bool hasData(const BleSyncContext &ctx) {
-  return !ctx.rxBuffer.empty();
+// On the sync task, woken by sendCB
+inline void resendFailed(BleSyncContext &ctx) {
+  if (!ctx.resendDue || !ctx.sendLock) return;
+  ctx.resendDue = false;
+  xSemaphoreTake(ctx.sendLock, portMAX_DELAY);
+  for (uint8_t i = 0; i < SYNC_ESPNOW_INFLIGHT; i++) {
+    EspNowFrame &f = ctx.inFlight[i];
+    bool due = false;
+    portENTER_CRITICAL(&ctx.inFlightMux);
+    if (f.state == ESPNOW_RESEND) {
+      f.state = ESPNOW_IN_FLIGHT;
+      f.attempts++;
+      f.order = ctx.sendOrder++;  // now behind the frames sent since
+      due = true;
+    }
+    portEXIT_CRITICAL(&ctx.inFlightMux);
+    if (!due) continue;
+
+    Metrics::count(METRIC_ESPNOW_RETRIES);
+    if (esp_now_send(f.addr, f.data, f.len) != ESP_OK) {
+      portENTER_CRITICAL(&ctx.inFlightMux);
+      f.state = ESPNOW_FREE;
+      portEXIT_CRITICAL(&ctx.inFlightMux);
+      Metrics::count(METRIC_ESPNOW_UNDELIVERED);
+    }
+  }
+  xSemaphoreGive(ctx.sendLock);
 }
 
-inline std::vector<uint8_t> receive(BleSyncContext &ctx) {
-  if (ctx.rxBuffer.empty()) return std::vector<uint8_t>();
-  auto v = ctx.rxBuffer.front();
-  ctx.rxBuffer.pop();
-  return v;
+// One unacknowledged frame that every radio on the channel hears
+inline bool broadcast(BleSyncContext &ctx, const uint8_t *data, size_t len) {
+  if (!ctx.sendLock) return false;
+  xSemaphoreTake(ctx.sendLock, portMAX_DELAY);
+  esp_err_t res = esp_now_send(BROADCASTADDRESS, data, len);
+  xSemaphoreGive(ctx.sendLock);
+  Metrics::count(res == ESP_OK ? METRIC_PACKETS_SENT : METRIC_SEND_FAILURES);
+  return res == ESP_OK;
 }
 
-inline bool isConnected(const BleSyncContext &ctx) {
-  return ctx.connected;
+// Unicast to each peer heard from lately, so every frame is acknowledged
+// and resent if need be. Broadcast until there is one, and whenever none
+// of the unicast frames could go out (all SYNC_ESPNOW_INFLIGHT waiting,
+// say).
+inline bool send(BleSyncContext &ctx, const uint8_t *data, size_t len) {
+  if (!ctx.sendLock) return false;
+  uint32_t nowMs = millis();
+  bool sent = false;
+  xSemaphoreTake(ctx.sendLock, portMAX_DELAY);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const EspNowPeer &p = ctx.unicast[i];
+    if (!fresh(p, nowMs)) continue;
+    if (sendTracked(ctx, p.addr, data, len)) sent = true;
+  }
+  xSemaphoreGive(ctx.sendLock);
+  return sent || broadcast(ctx, data, len);
 }
 
-inline void update(BleSyncContext &ctx) {
-  (void)ctx; // nothing periodic to do for ESP-NOW
+// Node: after SYNC_ESPNOW_HUNT_MS without a probe, step through the
+// channels, SYNC_ESPNOW_DWELL_MS on each, until the controller's probes
+// come through. Its channel follows its own access point, which needn't
+// be the one this node remembers. Not while an update check has the
+// radio on an access point.
+inline void hunt(BleSyncContext &ctx, uint32_t nowMs) {
+  if (WiFi.status() == WL_CONNECTED) {
+    ctx.hopMs = nowMs;
+    return;
+  }
+  if (nowMs - ctx.probeHeardMs < SYNC_ESPNOW_HUNT_MS || nowMs - ctx.hopMs < SYNC_ESPNOW_DWELL_MS) return;
+  ctx.hopMs = nowMs;
+  ctx.up[SYNC_ESPNOW] = false;
+  ctx.channel = ctx.channel % SYNC_ESPNOW_MAX_CHANNEL + 1;
+  esp_wifi_set_channel(ctx.channel, WIFI_SECOND_CHAN_NONE);
+  Serial.printf("[ESP-NOW] No controller, listening on channel %u\n", (unsigned)ctx.channel);
 }
 
-#else
+inline void localAddress(uint8_t *out) {
+  WiFi.macAddress(out);
+}
+
+} // namespace EspNow
+
+#if defined(USE_BLE_SYNC)
+// ==================== BLE ====================
+
+namespace Ble {
 
 // ==================== SERVER (NODE) ====================
 
+// Every connection to the server: the controller's and, with BLUETOOTH,
+// a phone's. Which one is the controller only shows when it subscribes
+// to the sync TX characteristic (TxCallbacks).
 class ServerCallbacks : public NimBLEServerCallbacks {
  public:
-  void onConnect(NimBLEServer* pServer) {
+  void onConnect(NimBLEServer *server, ble_gap_conn_desc *desc) {
     Serial.println(F("[BLE Sync] Client connected"));
-    if (g_ctx) g_ctx->connected = true;
+    if (g_ctx && g_ctx->sharedCallbacks) g_ctx->sharedCallbacks->onConnect(server, desc);
   }
-  void onDisconnect(NimBLEServer* pServer) {
+  void onDisconnect(NimBLEServer *server, ble_gap_conn_desc *desc) {
     Serial.println(F("[BLE Sync] Client disconnected"));
-    if (g_ctx) {
-      g_ctx->connected = false;
-      // Restart advertising
-      if (g_ctx->server) {
-        NimBLEDevice::getAdvertising()->start();
-        Serial.println(F("[BLE Sync] Restarted advertising"));
-      }
+    if (!g_ctx) return;
+    if (g_ctx->up[SYNC_BLE] && desc->conn_handle == g_ctx->controllerConn) g_ctx->up[SYNC_BLE] = false;
+    if (g_ctx->sharedCallbacks) g_ctx->sharedCallbacks->onDisconnect(server, desc);
+    NimBLEDevice::getAdvertising()->start();
+    Serial.println(F("[BLE Sync] Restarted advertising"));
+  }
+};
+
+class TxCallbacks : public NimBLECharacteristicCallbacks {
+ public:
+  void onSubscribe(NimBLECharacteristic *, ble_gap_conn_desc *desc, uint16_t subValue) {
+    if (!g_ctx) return;
+    if (subValue != 0) {
+      g_ctx->controllerConn = desc->conn_handle;
+      g_ctx->up[SYNC_BLE] = true;
+    } else if (desc->conn_handle == g_ctx->controllerConn) {
+      g_ctx->up[SYNC_BLE] = false;
     }
   }
 };
@@ -136,96 +589,350 @@ class ServerCallbacks : public NimBLEServerCallbacks {
 class RxCallbacks : public NimBLECharacteristicCallbacks {
  public:
   void onWrite(NimBLECharacteristic *chr) {
+    uint64_t rxUs = (uint64_t)esp_timer_get_time();
     if (!g_ctx) return;
     std::string val = chr->getValue();
     if (val.size() > 0) {
-      std::vector<uint8_t> data(val.begin(), val.end());
-      g_ctx->rxBuffer.push(data);
-      
-      // Immediately process if callback is set
-      if (g_onReceiveCallback) {
-        g_onReceiveCallback(data.data(), data.size());
-      }
+      deliver(g_noAddr, (const uint8_t *)val.data(), val.size(), rxUs, SYNC_BLE);
     }
   }
 };
 
 // ==================== CLIENT (CONTROLLER) ====================
 
+// Under peerMux
+inline SyncPeer *peerForClient(BleSyncContext &ctx, const NimBLEClient *client) {
+  if (!client) return nullptr;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.peers[i].client == client) return &ctx.peers[i];
+  }
+  return nullptr;
+}
+
+inline bool isPeerConnected(BleSyncContext &ctx, const uint8_t *addr) {
+  bool connected = false;
+  portENTER_CRITICAL(&ctx.peerMux);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.peers[i].connected && memcmp(ctx.peers[i].addr, addr, SYNC_ADDR_LEN) == 0) connected = true;
+  }
+  portEXIT_CRITICAL(&ctx.peerMux);
+  return connected;
+}
+
+// Queue a node for the link task to connect; false if it already is
+inline bool queueFound(BleSyncContext &ctx, const NimBLEAddress &addr) {
+  bool queued = false;
+  portENTER_CRITICAL(&ctx.foundMux);
+  bool seen = false;
+  for (uint8_t i = 0; i < ctx.foundCount; i++) {
+    if (ctx.found[i] == addr) seen = true;
+  }
+  if (!seen && ctx.foundCount < SYNC_MAX_NODES) {
+    ctx.found[ctx.foundCount++] = addr;
+    queued = true;
+  }
+  portEXIT_CRITICAL(&ctx.foundMux);
+  return queued;
+}
+
+// Nodes the controller has connected before, most recent first, kept in
+// NVS so that after a restart or a drop it connects to them by address
+// straight away instead of scanning for them first, and skips the service
+// discovery by using the handles it found last time
+struct KnownPeer {
+  uint64_t addr;
+  uint8_t type;   // public or random address
+  BleHandles handles;
+};
+
+static constexpr char BLE_NVS_NAMESPACE[] = "ble";
+static constexpr char BLE_NVS_PEERS[] = "nodes";   // KnownPeer[], not the handle-less "peers"
+
+inline uint8_t loadKnownPeers(KnownPeer *out) {
+  Preferences prefs;
+  if (!prefs.begin(BLE_NVS_NAMESPACE, true)) return 0;
+  size_t len = prefs.getBytes(BLE_NVS_PEERS, out, sizeof(KnownPeer) * SYNC_MAX_NODES);
+  prefs.end();
+  return len / sizeof(KnownPeer);
+}
+
+inline bool knownHandles(const NimBLEAddress &addr, BleHandles &out) {
+  KnownPeer known[SYNC_MAX_NODES];
+  uint8_t count = loadKnownPeers(known);
+  for (uint8_t i = 0; i < count; i++) {
+    if (known[i].addr != (uint64_t)addr) continue;
+    out = known[i].handles;
+    return out.tx && out.txCccd && out.rx;
+  }
+  return false;
+}
+
+// Written only when a new node joins or its handles changed, so
+// reconnects cost no flash writes
+inline void rememberPeer(const NimBLEAddress &addr, const BleHandles &handles) {
+  KnownPeer known[SYNC_MAX_NODES];
+  memset(known, 0, sizeof(known));
+  uint8_t count = loadKnownPeers(known);
+  uint8_t i = 0;
+  while (i < count && known[i].addr != (uint64_t)addr) i++;
+  if (i < count) {
+    if (memcmp(&known[i].handles, &handles, sizeof(handles)) == 0) return;
+  } else {
+    if (count == SYNC_MAX_NODES) count--;   // forget the oldest
+    memmove(&known[1], &known[0], count * sizeof(KnownPeer));
+    count++;
+    i = 0;
+    known[0].addr = (uint64_t)addr;
+    known[0].type = addr.getType();
+  }
+  known[i].handles = handles;
+  Preferences prefs;
+  if (!prefs.begin(BLE_NVS_NAMESPACE, false)) return;
+  prefs.putBytes(BLE_NVS_PEERS, known, count * sizeof(KnownPeer));
+  prefs.end();
+}
+
+inline void queueKnownPeers(BleSyncContext &ctx) {
+  KnownPeer known[SYNC_MAX_NODES];
+  uint8_t count = loadKnownPeers(known);
+  for (uint8_t i = 0; i < count; i++) {
+    NimBLEAddress addr(known[i].addr, known[i].type);
+    if (!isPeerConnected(ctx, addr.getNative())) queueFound(ctx, addr);
+  }
+}
+
 class ClientCallbacks : public NimBLEClientCallbacks {
  public:
   void onConnect(NimBLEClient* pClient) {
     Serial.println(F("[BLE Sync] Connected to server"));
     pClient->updateConnParams(6, 6, 0, 60); // Fast connection for low latency
+    // A whole frame in one link-layer packet, sent at twice the bit rate
+    // where both ends can. NimBLE exchanges the MTU (BLE_MTU) by itself.
+    // What the link settles on comes back in GAP events (gapEventCB).
+    uint16_t connHandle = pClient->getConnId();
+    int rc = ble_gap_set_data_len(connHandle, BLE_DATA_LEN, BLE_DATA_TIME_US);
+    if (rc != 0) Serial.printf("[BLE Sync] Data length request failed (%d), staying at 27 bytes\n", rc);
+    if (BLE_PREFER_2M_PHY) {
+      rc = ble_gap_set_prefered_le_phy(connHandle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+                                       BLE_GAP_LE_PHY_CODED_ANY);
+      if (rc != 0) Serial.printf("[BLE Sync] 2M PHY request failed (%d), staying on 1M\n", rc);
+    }
   }
 
   void onDisconnect(NimBLEClient* pClient) {
     Serial.println(F("[BLE Sync] Disconnected from server"));
     if (g_ctx) {
-      g_ctx->connected = false;
-      // Will need to scan and reconnect
+      // Still up while any other node is connected; the rest rescan
+      bool any = false;
+      portENTER_CRITICAL(&g_ctx->peerMux);
+      SyncPeer *peer = peerForClient(*g_ctx, pClient);
+      if (peer) peer->connected = false;
+      for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+        if (g_ctx->peers[i].connected) any = true;
+      }
+      portEXIT_CRITICAL(&g_ctx->peerMux);
+      g_ctx->up[SYNC_BLE] = any;
+      // Reconnect to it directly, and scan if that fails; a node that
+      // restarted readvertises within a second or so
+      queueFound(*g_ctx, pClient->getPeerAddress());
+      g_ctx->rescan = true;
+      if (g_ctx->linkTask) xTaskNotifyGive(g_ctx->linkTask);
     }
   }
 };
 
-// Callback for scan results (process devices found in the results)
-static void scanCompleteCB(NimBLEScanResults results) {
+// Runs on the BLE host task for every advertisement. A node advertising
+// the sync service that we aren't connected to stops the scan at once and
+// wakes the link task to connect it; nothing waits for the scan to end.
+class AdvertisedCallbacks : public NimBLEAdvertisedDeviceCallbacks {
+ public:
+  void onResult(NimBLEAdvertisedDevice *device) {
+    if (!g_ctx || !device->isAdvertisingService(NimBLEUUID(SYNC_SERVICE_UUID))) return;
+    NimBLEAddress addr = device->getAddress();
+    if (isPeerConnected(*g_ctx, addr.getNative())) return;
+
+    if (!queueFound(*g_ctx, addr)) return;
+
+    Serial.printf("[BLE Sync] Found node %s\n", addr.toString().c_str());
+    NimBLEDevice::getScan()->stop();
+    if (g_ctx->linkTask) xTaskNotifyGive(g_ctx->linkTask);
+  }
+};
+
+static void scanEndedCB(NimBLEScanResults results) {
+  (void)results;
   if (!g_ctx) return;
+  g_ctx->scanning = false;
+  if (g_ctx->linkTask) xTaskNotifyGive(g_ctx->linkTask);
+}
+
+// A node's notification, matched to its link by connection and handle.
+// The controller subscribes through handles rather than NimBLE's remote
+// characteristics (which only discovery creates), so it takes
+// notifications straight from the GAP events.
+static void onNotify(uint16_t connHandle, uint16_t attrHandle, os_mbuf *om) {
+  uint64_t rxUs = (uint64_t)esp_timer_get_time();
+  uint8_t data[SYNC_FRAME_MAX];
+  uint16_t length = OS_MBUF_PKTLEN(om);
+  if (length == 0 || length > sizeof(data) || os_mbuf_copydata(om, 0, length, data) != 0) return;
 
-  int count = results.getCount();
-  for (int i = 0; i < count; ++i) {
-    const NimBLEAdvertisedDevice* advertisedDevice = results.getDevice(i);
-    if (!advertisedDevice) continue;
-
-    String name = String(advertisedDevice->getName().c_str());
-    Serial.print(F("[BLE Sync] Found device: "));
-    Serial.println(name);
-
-    // Check if this is our target (NODE if we're CONTROLLER)
-    #ifdef CONTROLLER
-    if (name.equals(NODE_BLE_NAME)) {
-      Serial.println(F("[BLE Sync] Found target NODE"));
-      g_ctx->peerDevice = new NimBLEAdvertisedDevice(*advertisedDevice);
-      g_ctx->scanning = false;
+  // Tell the app which node this came from, by the address it has on
+  // every transport. Until its first probe answer says what that is, only
+  // the answer itself gets through (matched on the BLE address).
+  uint8_t from[SYNC_ADDR_LEN];
+  bool found = false;
+  bool idKnown = false;
+  portENTER_CRITICAL(&g_ctx->peerMux);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES && !found; i++) {
+    const SyncPeer &peer = g_ctx->peers[i];
+    if (!peer.connected || peer.connHandle != connHandle || peer.handles.tx != attrHandle) continue;
+    found = true;
+    idKnown = peer.idKnown;
+    memcpy(from, idKnown ? peer.id : peer.addr, SYNC_ADDR_LEN);
+  }
+  portEXIT_CRITICAL(&g_ctx->peerMux);
+  if (!found) return;
+  if (idKnown || data[0] == MSG_LINK_PROBE_ACK) deliver(from, data, length, rxUs, SYNC_BLE);
+}
+
+// Under peerMux. A new link starts as every link does: 23-byte MTU, 1M
+// PHY, and a data length nobody has reported yet.
+inline BleLink *linkFor(BleSyncContext &ctx, uint16_t connHandle, bool add) {
+  BleLink *free = nullptr;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES + 1; i++) {
+    BleLink &link = ctx.links[i];
+    if (link.used && link.connHandle == connHandle) return &link;
+    if (!free && !link.used) free = &link;
+  }
+  if (!add || !free) return nullptr;
+  *free = BleLink();
+  free->used = true;
+  free->connHandle = connHandle;
+  free->params.mtu = 23;
+  free->params.txPhy = free->params.rxPhy = BLE_GAP_LE_PHY_1M;
+  return free;
+}
+
+// What each link negotiated, as it's reported
+inline void onLinkEvent(BleSyncContext &ctx, const ble_gap_event *event) {
+  portENTER_CRITICAL(&ctx.peerMux);
+  BleLink *link;
+  switch (event->type) {
+    case BLE_GAP_EVENT_CONNECT:
+      if (event->connect.status == 0) linkFor(ctx, event->connect.conn_handle, true);
+      break;
+    case BLE_GAP_EVENT_DISCONNECT:
+      link = linkFor(ctx, event->disconnect.conn.conn_handle, false);
+      if (link) link->used = false;
+      break;
+    case BLE_GAP_EVENT_MTU:
+      link = linkFor(ctx, event->mtu.conn_handle, false);
+      if (link) link->params.mtu = event->mtu.value;
+      break;
+    case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+      link = linkFor(ctx, event->phy_updated.conn_handle, false);
+      if (link && event->phy_updated.status == 0) {
+        link->params.txPhy = event->phy_updated.tx_phy;
+        link->params.rxPhy = event->phy_updated.rx_phy;
+      }
+      break;
+#ifdef BLE_GAP_EVENT_DATA_LEN_CHG
+    // Only newer NimBLE hosts report it; the others leave the lengths at 0
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+      link = linkFor(ctx, event->data_len_chg.conn_handle, false);
+      if (link) {
+        link->params.txOctets = event->data_len_chg.max_tx_octets;
+        link->params.rxOctets = event->data_len_chg.max_rx_octets;
+      }
+      break;
+#endif
+    default:
       break;
-    }
-    #endif
   }
+  portEXIT_CRITICAL(&ctx.peerMux);
 }
 
-// Notification callback function (NimBLE 2.x uses function callbacks)
-static void notifyCB(NimBLERemoteCharacteristic* pRemoteChar, uint8_t* pData, size_t length, bool isNotify) {
-  if (!g_ctx) return;
-  std::vector<uint8_t> data(pData, pData + length);
-  g_ctx->rxBuffer.push(data);
-  
-  // Immediately process if callback is set
-  if (g_onReceiveCallback) {
-    g_onReceiveCallback(data.data(), length);
+// Every GAP event, on the NimBLE host task, alongside NimBLE's own handling
+static int gapEventCB(ble_gap_event *event, void *) {
+  if (!g_ctx) return 0;
+  if (event->type == BLE_GAP_EVENT_NOTIFY_RX) {
+    onNotify(event->notify_rx.conn_handle, event->notify_rx.attr_handle, event->notify_rx.om);
+  } else {
+    onLinkEvent(*g_ctx, event);
   }
+  return 0;
+}
+
+static int subscribedCB(uint16_t, const ble_gatt_error *error, ble_gatt_attr *, void *) {
+  if (!g_ctx) return 0;
+  g_ctx->gattStatus = error->status;
+  xSemaphoreGive(g_ctx->gattDone);
+  return 0;
 }
 
-// ==================== COMMON FUNCTIONS ====================
+// ==================== SETUP ====================
+
+inline void startLinkTask(BleSyncContext &ctx);
 
 inline void init(BleSyncContext &ctx) {
-  g_ctx = &ctx;
   NimBLEDevice::init(DEVICE_BLE_NAME);
   NimBLEDevice::setPower(ESP_PWR_LVL_P9); // Max power for range
+  NimBLEDevice::setMTU(BLE_MTU);          // both ends offer it; the link uses the smaller
+  NimBLEDevice::setCustomGapHandler(gapEventCB);
+#ifdef CONTROLLER
+  ctx.gattDone = xSemaphoreCreateBinary();
+  startLinkTask(ctx);
+#else
+  (void)ctx;
+#endif
   Serial.println(F("[BLE Sync] Initialized"));
 }
 
-inline void setReceiveCallback(void (*callback)(const uint8_t*, size_t)) {
-  g_onReceiveCallback = callback;
+// ==================== SERVER (NODE) FUNCTIONS ====================
+
+// The one GATT server. BleSync owns NimBLE, the server and advertising;
+// other services join them through shareServer().
+inline NimBLEServer *server(BleSyncContext &ctx) {
+  if (!ctx.server) {
+    ctx.server = NimBLEDevice::createServer();
+    static ServerCallbacks serverCallbacks;
+    ctx.server->setCallbacks(&serverCallbacks);
+  }
+  return ctx.server;
 }
 
-// ==================== SERVER (NODE) FUNCTIONS ====================
+// Advertise every service on the server: the first in the advertisement
+// itself, where the controller's scan looks for the sync service, and the
+// other with the name in the scan response, since two 128-bit UUIDs don't
+// fit in one 31-byte payload. Once all of them are on the server.
+inline void advertise(BleSyncContext &ctx) {
+  if (!ctx.server) return;
+  const char *services[2];
+  uint8_t n = 0;
+  if (ctx.txChar) services[n++] = SYNC_SERVICE_UUID;
+  if (ctx.sharedService) services[n++] = ctx.sharedService;
+
+  NimBLEAdvertisementData advData;
+  NimBLEAdvertisementData scanResp;
+  advData.setFlags(BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP);
+  if (n > 0) advData.setCompleteServices(NimBLEUUID(services[0]));
+  if (n > 1) scanResp.setCompleteServices(NimBLEUUID(services[1]));
+  scanResp.setName(DEVICE_BLE_NAME);
+
+  NimBLEAdvertising *advertising = NimBLEDevice::getAdvertising();
+  advertising->setMinInterval(32);  // 20ms in 0.625ms units
+  advertising->setMaxInterval(160); // 100ms in 0.625ms units
+  advertising->setAdvertisementData(advData);
+  advertising->setScanResponseData(scanResp);
+  advertising->start();
+
+  Serial.print(F("[BLE Sync] Advertising as: "));
+  Serial.println(DEVICE_BLE_NAME);
+}
 
 inline void startServer(BleSyncContext &ctx) {
-  ctx.server = NimBLEDevice::createServer();
-  
-  static ServerCallbacks serverCallbacks;
-  ctx.server->setCallbacks(&serverCallbacks);
-  
+  server(ctx);
+
   // Create sync service
   auto *service = ctx.server->createService(SYNC_SERVICE_UUID);
   
@@ -234,6 +941,8 @@ inline void startServer(BleSyncContext &ctx) {
     SYNC_TX_UUID, 
     NIMBLE_PROPERTY::NOTIFY
   );
+  static TxCallbacks txCallbacks;
+  ctx.txChar->setCallbacks(&txCallbacks);
   
   // RX characteristic (server receives from client)
   ctx.rxChar = service->createCharacteristic(
@@ -245,103 +954,227 @@ inline void startServer(BleSyncContext &ctx) {
   ctx.rxChar->setCallbacks(&rxCallbacks);
   
   service->start();
-  
-  // Start advertising
-  NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
-  pAdvertising->addServiceUUID(SYNC_SERVICE_UUID);
-  NimBLEAdvertisementData scanResp;
-  pAdvertising->setScanResponseData(scanResp);
-  pAdvertising->start();
-  
-  Serial.print(F("[BLE Sync] Server started, advertising as: "));
-  Serial.println(DEVICE_BLE_NAME);
+  Serial.println(F("[BLE Sync] Server started"));
 }
 
 // ==================== CLIENT (CONTROLLER) FUNCTIONS ====================
 
-inline bool scanAndConnect(BleSyncContext &ctx, uint32_t scanTimeSeconds = 5) {
-  if (ctx.connected) return true;
-  
-  Serial.println(F("[BLE Sync] Starting scan..."));
-  ctx.scanning = true;
-  
-  NimBLEScan* pScan = NimBLEDevice::getScan();
-  // AdvertisedDeviceCallbacks not needed; using scanCompleteCB via start()
-  pScan->setInterval(97);
-  pScan->setWindow(37);
-  pScan->setActiveScan(true);
-  pScan->start(scanTimeSeconds, scanCompleteCB, false);
-  
-  if (!ctx.peerDevice) {
-    Serial.println(F("[BLE Sync] No target device found"));
-    ctx.scanning = false;
+// Look the sync characteristics up on a connected node
+inline bool discover(NimBLEClient *client, BleHandles &out) {
+  NimBLERemoteService *service = client->getService(SYNC_SERVICE_UUID);
+  if (!service) return false;
+  NimBLERemoteCharacteristic *tx = service->getCharacteristic(SYNC_TX_UUID);
+  NimBLERemoteCharacteristic *rx = service->getCharacteristic(SYNC_RX_UUID);
+  NimBLERemoteDescriptor *cccd = tx ? tx->getDescriptor(NimBLEUUID((uint16_t)0x2902)) : nullptr;
+  if (!rx || !cccd) return false;
+  out.tx = tx->getHandle();
+  out.txCccd = cccd->getHandle();
+  out.rx = rx->getHandle();
+  return true;
+}
+
+// Turn the node's notifications on, and wait for it to confirm: a write
+// to a handle it doesn't have (or can't be written) comes back an error
+inline bool subscribe(BleSyncContext &ctx, uint16_t connHandle, const BleHandles &handles) {
+  static const uint8_t notifyOn[2] = {0x01, 0x00};
+  xSemaphoreTake(ctx.gattDone, 0);   // an answer that came after its wait
+  if (ble_gattc_write_flat(connHandle, handles.txCccd, notifyOn, sizeof(notifyOn), subscribedCB, nullptr) != 0) {
     return false;
   }
-  
-  // Connect to the device
-  if (!ctx.client) {
-    ctx.client = NimBLEDevice::createClient();
-    static ClientCallbacks clientCallbacks;
-    ctx.client->setClientCallbacks(&clientCallbacks);
-    ctx.client->setConnectionParams(6, 6, 0, 60);
-    ctx.client->setConnectTimeout(5);
+  if (xSemaphoreTake(ctx.gattDone, pdMS_TO_TICKS(BLE_GATT_TIMEOUT_MS)) != pdTRUE) return false;
+  return ctx.gattStatus == 0;
+}
+
+// Connect one found node into a free peer slot. Runs on the link task,
+// where waiting for the connection and discovery holds up nothing else.
+inline bool connectPeer(BleSyncContext &ctx, const NimBLEAddress &addr) {
+  if (isPeerConnected(ctx, addr.getNative())) return false;
+  SyncPeer *peer = nullptr;
+  portENTER_CRITICAL(&ctx.peerMux);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES && !peer; i++) {
+    if (!ctx.peers[i].connected) peer = &ctx.peers[i];
   }
-  
-  Serial.println(F("[BLE Sync] Connecting to device..."));
-  if (!ctx.client->connect(ctx.peerDevice)) {
-    Serial.println(F("[BLE Sync] Connection failed"));
-    delete ctx.peerDevice;
-    ctx.peerDevice = nullptr;
-    return false;
+  portEXIT_CRITICAL(&ctx.peerMux);
+  if (!peer) return false;
+
+  // Each node gets its own client; a slot keeps it across reconnects
+  if (!peer->client) {
+    peer->client = NimBLEDevice::createClient();
+    static ClientCallbacks clientCallbacks;
+    peer->client->setClientCallbacks(&clientCallbacks);
+    peer->client->setConnectionParams(6, 6, 0, 60);
+    peer->client->setConnectTimeout(BLE_CONNECT_TIMEOUT_S);
   }
-  
-  Serial.println(F("[BLE Sync] Connected! Getting service..."));
-  
-  // Get the service
-  NimBLERemoteService* pRemoteService = ctx.client->getService(SYNC_SERVICE_UUID);
-  if (!pRemoteService) {
-    Serial.println(F("[BLE Sync] Service not found"));
-    ctx.client->disconnect();
+
+  ctx.linkState = LINK_CONNECTING;
+  if (!peer->client->connect(addr)) {
+    Serial.printf("[BLE Sync] Connection to %s failed\n", addr.toString().c_str());
     return false;
   }
-  
-  // Get characteristics
-  ctx.remoteTxChar = pRemoteService->getCharacteristic(SYNC_TX_UUID);
-  ctx.remoteRxChar = pRemoteService->getCharacteristic(SYNC_RX_UUID);
-  
-  if (!ctx.remoteTxChar || !ctx.remoteRxChar) {
-    Serial.println(F("[BLE Sync] Characteristics not found"));
-    ctx.client->disconnect();
-    return false;
+
+  // A node seen before: straight to subscribing, with last time's
+  // handles. Only if that write fails is the service looked up again.
+  uint16_t connHandle = peer->client->getConnId();
+  BleHandles handles;
+  bool saved = knownHandles(addr, handles);
+  if (saved) {
+    ctx.linkState = LINK_SUBSCRIBING;
+    if (!subscribe(ctx, connHandle, handles)) {
+      Serial.printf("[BLE Sync] Saved handles of %s failed, rediscovering\n", addr.toString().c_str());
+      saved = false;
+    }
   }
-  
-  // Subscribe to notifications
-  if (ctx.remoteTxChar->canNotify()) {
-    ctx.remoteTxChar->subscribe(true, notifyCB);
+  if (!saved) {
+    ctx.linkState = LINK_DISCOVERING;
+    if (!discover(peer->client, handles)) {
+      Serial.println(F("[BLE Sync] Sync service not found"));
+      peer->client->disconnect();
+      return false;
+    }
+    ctx.linkState = LINK_SUBSCRIBING;
+    if (!subscribe(ctx, connHandle, handles)) {
+      Serial.println(F("[BLE Sync] Subscribe failed"));
+      peer->client->disconnect();
+      return false;
+    }
   }
-  
-  ctx.connected = true;
-  Serial.println(F("[BLE Sync] Ready for communication"));
+
+  // Last, so send() never sees a half-set-up peer
+  portENTER_CRITICAL(&ctx.peerMux);
+  memcpy(peer->addr, addr.getNative(), SYNC_ADDR_LEN);
+  peer->connHandle = connHandle;
+  peer->handles = handles;
+  peer->idKnown = false;
+  peer->connected = true;
+  portEXIT_CRITICAL(&ctx.peerMux);
+  ctx.up[SYNC_BLE] = true;
+  ctx.joins++;
+  Serial.printf("[BLE Sync] %s ready, MTU %u\n", addr.toString().c_str(), peer->client->getMTU());
+  rememberPeer(addr, handles);
   return true;
 }
 
-// ==================== SEND/RECEIVE ====================
+inline uint8_t peerCount(BleSyncContext &ctx) {
+  uint8_t n = 0;
+  portENTER_CRITICAL(&ctx.peerMux);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.peers[i].connected) n++;
+  }
+  portEXIT_CRITICAL(&ctx.peerMux);
+  return n;
+}
+
+inline bool takeFound(BleSyncContext &ctx, NimBLEAddress &out) {
+  bool any = false;
+  portENTER_CRITICAL(&ctx.foundMux);
+  if (ctx.foundCount > 0) {
+    out = ctx.found[0];
+    for (uint8_t i = 1; i < ctx.foundCount; i++) ctx.found[i - 1] = ctx.found[i];
+    ctx.foundCount--;
+    any = true;
+  }
+  portEXIT_CRITICAL(&ctx.foundMux);
+  return any;
+}
+
+// With no node connected, scan until one turns up, listening all the time.
+// Once some are, look for the rest in short, light scans every
+// SYNC_RESCAN_MS so the links keep their airtime.
+inline void startScan(BleSyncContext &ctx) {
+  bool idle = !ctx.up[SYNC_BLE];
+  NimBLEScan* pScan = NimBLEDevice::getScan();
+  static AdvertisedCallbacks advertisedCallbacks;
+  pScan->setAdvertisedDeviceCallbacks(&advertisedCallbacks, false);
+  pScan->setMaxResults(0);  // matches are handled in onResult, keep nothing
+  pScan->setInterval(97);
+  pScan->setWindow(idle ? 97 : 37);
+  pScan->setActiveScan(true);
+  ctx.scanning = true;
+  ctx.rescan = false;
+  ctx.lastScanMs = millis();
+  ctx.linkState = LINK_SCANNING;
+  if (!pScan->start(idle ? 0 : 1, scanEndedCB, false)) {
+    ctx.scanning = false;
+    ctx.linkState = LINK_IDLE;
+  }
+}
+
+// The controller's connection manager: connects the known nodes and what
+// the scan found, one node at a time, and keeps a scan going while slots are free. Woken by a
+// match, a scan ending or a node dropping.
+static void linkTaskMain(void *arg) {
+  BleSyncContext *ctx = (BleSyncContext *)arg;
+  queueKnownPeers(*ctx);  // before any scan
+  for (;;) {
+    NimBLEAddress addr;
+    while (takeFound(*ctx, addr)) {
+      if (ctx->scanning) {
+        NimBLEDevice::getScan()->stop();  // the radio can't connect mid-scan
+        ctx->scanning = false;
+      }
+      connectPeer(*ctx, addr);
+      ctx->linkState = LINK_IDLE;
+    }
+
+    if (!ctx->scanning && peerCount(*ctx) < SYNC_MAX_NODES &&
+        (!ctx->up[SYNC_BLE] || ctx->rescan || millis() - ctx->lastScanMs >= SYNC_RESCAN_MS)) {
+      startScan(*ctx);
+    }
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLE_RETRY_MS));
+  }
+}
+
+inline void startLinkTask(BleSyncContext &ctx) {
+  if (ctx.linkTask) return;
+  xTaskCreatePinnedToCore(linkTaskMain, "ble_link", BLE_LINK_TASK_STACK, &ctx,
+                          BLE_LINK_TASK_PRIORITY, &ctx.linkTask, BLE_LINK_TASK_CORE);
+}
+
+// Returns at once: the link task does the scanning and connecting. Asks it
+// for a scan now rather than at the next SYNC_RESCAN_MS.
+inline void scanAndConnect(BleSyncContext &ctx) {
+  ctx.rescan = true;
+  if (ctx.linkTask) xTaskNotifyGive(ctx.linkTask);
+}
+
+// ==================== SEND ====================
 
 inline bool send(BleSyncContext &ctx, const uint8_t *data, size_t len) {
-  if (!ctx.connected) return false;
+  if (!ctx.up[SYNC_BLE]) return false;
   
   #ifdef CONTROLLER
-  // Client mode: write to remote characteristic
-  if (ctx.remoteRxChar) {
-    return ctx.remoteRxChar->writeValue(data, len, false); // No response needed
+  // Client mode: write to every node's RX characteristic. BLE has no
+  // broadcast, so each node costs its own write. The handles are copied
+  // under peerMux and written outside it; one that went stale meanwhile
+  // only makes that write fail.
+  uint16_t conns[SYNC_MAX_NODES];
+  uint16_t rx[SYNC_MAX_NODES];
+  uint8_t n = 0;
+  bool sent = false;
+  portENTER_CRITICAL(&ctx.peerMux);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (!ctx.peers[i].connected) continue;
+    conns[n] = ctx.peers[i].connHandle;
+    rx[n++] = ctx.peers[i].handles.rx;
   }
+  portEXIT_CRITICAL(&ctx.peerMux);
+  for (uint8_t i = 0; i < n; i++) {
+    if (ble_gattc_write_no_rsp_flat(conns[i], rx[i], data, len) == 0) { // No response needed
+      Metrics::count(METRIC_PACKETS_SENT);
+      sent = true;
+    } else {
+      Metrics::count(METRIC_SEND_FAILURES);
+    }
+  }
+  return sent;
   #endif
   
   #ifdef NODE
   // Server mode: notify through TX characteristic
-  if (ctx.txChar && ctx.server && ctx.server->getConnectedCount() > 0) {
+  if (ctx.txChar && ctx.up[SYNC_BLE]) {
     ctx.txChar->setValue(data, len);
     ctx.txChar->notify();
+    Metrics::count(METRIC_PACKETS_SENT);
     return true;
   }
   #endif
@@ -349,36 +1182,369 @@ inline bool send(BleSyncContext &ctx, const uint8_t *data, size_t len) {
   return false;
 }
 
+// Fills out (room for SYNC_MAX_NODES) with each live link's parameters and
+// returns how many there are: the node links on the controller, every
+// connection on a node. The PHY update finishes shortly after the
+// connection, so ask again if it still says 1M.
+inline uint8_t linkParams(BleSyncContext &ctx, SyncLinkParams *out) {
+  uint8_t n = 0;
+  portENTER_CRITICAL(&ctx.peerMux);
+  #ifdef CONTROLLER
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const SyncPeer &peer = ctx.peers[i];
+    const BleLink *link = peer.connected ? linkFor(ctx, peer.connHandle, false) : nullptr;
+    if (!link) continue;
+    out[n] = link->params;
+    memcpy(out[n].addr, peer.idKnown ? peer.id : peer.addr, SYNC_ADDR_LEN);
+    n++;
+  }
+  #endif
+  #ifdef NODE
+  for (uint8_t i = 0; i < SYNC_MAX_NODES + 1 && n < SYNC_MAX_NODES; i++) {
+    if (!ctx.links[i].used) continue;
+    out[n] = ctx.links[i].params;
+    memset(out[n].addr, 0, SYNC_ADDR_LEN);
+    n++;
+  }
+  #endif
+  portEXIT_CRITICAL(&ctx.peerMux);
+  return n;
+}
+
+} // namespace Ble
+#endif
+
+// ==================== COMMON INTERFACE ====================
+
+// channel: ESP-NOW's, see OTA::espNowChannel()
+inline void init(BleSyncContext &ctx, uint8_t channel = SYNC_ESPNOW_CHANNEL) {
+  g_ctx = &ctx;
+  startRxTask(ctx);
+  EspNow::init(ctx, channel);
+#if defined(USE_BLE_SYNC)
+  Ble::init(ctx);
+#endif
+}
+
+inline void setReceiveCallback(SyncReceiveCallback callback) {
+  g_onReceiveCallback = callback;
+}
+
+// The node's address: its WiFi MAC, so it's the same whichever transport
+// a frame of it comes over
+inline void localAddress(uint8_t *out) {
+  EspNow::localAddress(out);
+}
+
+inline void startServer(BleSyncContext &ctx) {
+  localAddress(ctx.selfId);
+#if defined(USE_BLE_SYNC)
+  Ble::startServer(ctx);
+#endif
+}
+
+#if defined(USE_BLE_SYNC)
+// The server, for another service to join (ble_iphone.h). Its callbacks
+// see every connection after BleSync's own, and uuid is advertised too.
+inline NimBLEServer *shareServer(BleSyncContext &ctx, const char *uuid, NimBLEServerCallbacks *callbacks) {
+  ctx.sharedService = uuid;
+  ctx.sharedCallbacks = callbacks;
+  return Ble::server(ctx);
+}
+#endif
+
+// Once every service is on the server (startServer(), shareServer())
+inline void advertise(BleSyncContext &ctx) {
+#if defined(USE_BLE_SYNC)
+  Ble::advertise(ctx);
+#else
+  (void)ctx;
+#endif
+}
+
+// Returns at once; over BLE it asks the link task for a scan now
+inline bool scanAndConnect(BleSyncContext &ctx, uint32_t /*scanTimeSeconds*/ = 5) {
+#if defined(USE_BLE_SYNC)
+  Ble::scanAndConnect(ctx);
+#endif
+  return ctx.up[SYNC_ESPNOW] || ctx.up[SYNC_BLE];
+}
+
+inline bool sendOn(BleSyncContext &ctx, SyncTransport transport, const uint8_t *data, size_t len) {
+  if (transport == SYNC_ESPNOW) return EspNow::send(ctx, data, len);
+#if defined(USE_BLE_SYNC)
+  if (transport == SYNC_BLE) return Ble::send(ctx, data, len);
+#endif
+  return false;
+}
+
+// On the active transport. If that one refuses the frame, the other one
+// carries it, so nothing waits for the selection to catch up.
+inline bool send(BleSyncContext &ctx, const uint8_t *data, size_t len) {
+  SyncTransport active = ctx.active;
+  if (sendOn(ctx, active, data, len)) return true;
+  SyncTransport other = active == SYNC_ESPNOW ? SYNC_BLE : SYNC_ESPNOW;
+  return ctx.up[other] && sendOn(ctx, other, data, len);
+}
+
+// To every node at once where the transport can: on ESP-NOW one
+// unacknowledged broadcast, for frames with recovery of their own (the
+// firmware transfer). Otherwise as send().
+inline bool broadcast(BleSyncContext &ctx, const uint8_t *data, size_t len) {
+  if (ctx.active == SYNC_ESPNOW && EspNow::broadcast(ctx, data, len)) return true;
+  return send(ctx, data, len);
+}
+
 inline bool hasData(const BleSyncContext &ctx) {
-  return !ctx.rxBuffer.empty();
+  for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) {
+    if (!ctx.rxRing[t].empty()) return true;
+  }
+  return false;
 }
 
-inline std::vector<uint8_t> receive(BleSyncContext &ctx) {
-  if (ctx.rxBuffer.empty()) {
-    return std::vector<uint8_t>();
+inline bool receive(BleSyncContext &ctx, SyncFrame &out) {
+  for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) {
+    if (ctx.rxRing[t].pop(out)) return true;
   }
-  std::vector<uint8_t> data = ctx.rxBuffer.front();
-  ctx.rxBuffer.pop();
-  return data;
+  return false;
+}
+
+inline uint32_t droppedFrames(const BleSyncContext &ctx) {
+  uint32_t n = 0;
+  for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) n += ctx.rxRing[t].dropped();
+  return n;
 }
 
 inline bool isConnected(const BleSyncContext &ctx) {
-  return ctx.connected;
+  return ctx.up[SYNC_ESPNOW] || ctx.up[SYNC_BLE];
 }
 
-inline void update(BleSyncContext &ctx) {
-  #ifdef CONTROLLER
-  // Periodically try to reconnect if disconnected
-  static uint32_t lastScanAttempt = 0;
-  if (!ctx.connected && !ctx.scanning && (millis() - lastScanAttempt > 5000)) {
-    lastScanAttempt = millis();
-    scanAndConnect(ctx, 5);
+// Fills out (room for SYNC_MAX_NODES) with each live BLE link's
+// parameters and returns how many there are; ESP-NOW negotiates nothing
+inline uint8_t linkParams(BleSyncContext &ctx, SyncLinkParams *out) {
+#if defined(USE_BLE_SYNC)
+  return Ble::linkParams(ctx, out);
+#else
+  (void)ctx;
+  (void)out;
+  return 0;
+#endif
+}
+
+inline const char *transportName(SyncTransport transport) {
+  return transport == SYNC_ESPNOW ? "ESP-NOW" : "BLE";
+}
+
+// ==================== TRANSPORT SELECTION ====================
+// With both transports built in, the controller keeps both up: it probes
+// each every SYNC_LINK_PROBE_MS, keeps a smoothed RTT and loss per node,
+// and sends on the one whose worst node does better. A node answers a
+// probe on the transport it came over, and sends everything else on the
+// transport the controller last used, so a switch takes effect at once on
+// both ends. Node addresses are the same on both (localAddress()), so the
+// node table, clock sync and the schedule carry on across a switch.
+
+inline LinkStats *findStats(BleSyncContext &ctx, SyncTransport transport, const uint8_t *id, bool add) {
+  LinkStats *free = nullptr;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    LinkStats &st = ctx.stats[transport][i];
+    if (st.used && memcmp(st.id, id, SYNC_ADDR_LEN) == 0) return &st;
+    if (!free && (!st.used || millis() - st.lastAckMs >= SYNC_NODE_TIMEOUT_MS)) free = &st;
   }
-  #endif
+  if (!add || !free) return nullptr;
+  *free = LinkStats();
+  free->used = true;
+  memcpy(free->id, id, SYNC_ADDR_LEN);
+  return free;
+}
+
+inline bool fresh(const LinkStats &st, uint32_t nowMs) {
+  return st.used && nowMs - st.lastAckMs < SYNC_LINK_STALE_MS;
+}
+
+// What sending on a transport costs now: the slowest node's RTT plus a
+// penalty for its losses. UINT32_MAX if a node answering lately on either
+// transport isn't answering on this one.
+inline uint32_t cost(BleSyncContext &ctx, SyncTransport transport, uint32_t nowMs) {
+  uint32_t worst = 0;
+  bool any = false;
+  portENTER_CRITICAL(&ctx.statsMux);
+  for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) {
+    for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+      if (!fresh(ctx.stats[t][i], nowMs)) continue;
+      const LinkStats *st = findStats(ctx, transport, ctx.stats[t][i].id, false);
+      if (!st || !fresh(*st, nowMs)) {
+        worst = UINT32_MAX;
+        break;
+      }
+      uint32_t c = st->rttUs + (uint32_t)st->lossPermille * SYNC_LINK_LOSS_COST_US / 1000;
+      worst = std::max(worst, c);
+      any = true;
+    }
+    if (worst == UINT32_MAX) break;
+  }
+  portEXIT_CRITICAL(&ctx.statsMux);
+  return any ? worst : UINT32_MAX;
 }
 
-// Close transport selection (#if defined(NODE) / #else)
+inline void sendProbes(BleSyncContext &ctx, uint32_t nowMs) {
+  ctx.probeSeq++;
+  ctx.lastProbeMs = nowMs;
+  for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) {
+    if (!ctx.up[t]) continue;
+    // Whoever didn't answer the last one lost it
+    portENTER_CRITICAL(&ctx.statsMux);
+    for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+      LinkStats &st = ctx.stats[t][i];
+      if (!st.used) continue;
+      uint32_t lost = st.lastSeq == (uint16_t)(ctx.probeSeq - 1) ? 0 : 1000;
+      st.lossPermille = (uint16_t)((st.lossPermille * 7 + lost) / 8);
+    }
+    portEXIT_CRITICAL(&ctx.statsMux);
+
+    LinkProbePacket probe;
+    memset(&probe, 0, sizeof(probe));
+    probe.type = MSG_LINK_PROBE;
+    probe.transport = t;
+    probe.seq = ctx.probeSeq;
+    probe.t1Us = (uint32_t)esp_timer_get_time();
+    // Broadcast: it's also how a node finds the controller's channel, and
+    // how the controller finds new nodes to make unicast peers of
+    if (t == SYNC_ESPNOW) {
+      EspNow::broadcast(ctx, (uint8_t *)&probe, sizeof(probe));
+      continue;
+    }
+    sendOn(ctx, (SyncTransport)t, (uint8_t *)&probe, sizeof(probe));
+  }
+}
+
+// Fail over as soon as the active transport stops reaching a node the
+// other one reaches; otherwise switch only for a clear gain, and not more
+// often than SYNC_LINK_HOLD_MS
+inline void selectTransport(BleSyncContext &ctx, uint32_t nowMs) {
+  SyncTransport active = ctx.active;
+  SyncTransport other = active == SYNC_ESPNOW ? SYNC_BLE : SYNC_ESPNOW;
+  uint32_t current = cost(ctx, active, nowMs);
+  uint32_t alternative = cost(ctx, other, nowMs);
+  if (alternative == UINT32_MAX) return;
+
+  bool failover = current == UINT32_MAX;
+  bool better = (uint64_t)alternative * 100 < (uint64_t)current * (100 - SYNC_LINK_HYSTERESIS_PCT) &&
+                nowMs - ctx.switchedMs >= SYNC_LINK_HOLD_MS;
+  if (!failover && !better) return;
+
+  ctx.active = other;
+  ctx.switchedMs = nowMs;
+  Metrics::count(METRIC_TRANSPORT_SWITCHES);
+  if (failover) {
+    Serial.printf("[Link] %s lost a node, now on %s (%u us)\n",
+                  transportName(active), transportName(other), (unsigned)alternative);
+  } else {
+    Serial.printf("[Link] %s %u us -> %s %u us\n",
+                  transportName(active), (unsigned)current, transportName(other), (unsigned)alternative);
+  }
+}
+
+// Probe answers, on the sync task
+inline void onProbeAck(BleSyncContext &ctx, const SyncFrame &frame) {
+  if (frame.len != sizeof(LinkProbeAckPacket)) return;
+  LinkProbeAckPacket ack;
+  memcpy(&ack, frame.data, sizeof(ack));
+  if (ack.transport >= SYNC_TRANSPORTS) return;
+  uint32_t rttUs = (uint32_t)esp_timer_get_time() - ack.t1Us;
+
+#if defined(USE_BLE_SYNC)
+  // Learn which BLE link this node is
+  if (ack.transport == SYNC_BLE) {
+    portENTER_CRITICAL(&ctx.peerMux);
+    for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+      SyncPeer &peer = ctx.peers[i];
+      if (peer.connected && !peer.idKnown && memcmp(peer.addr, frame.addr, SYNC_ADDR_LEN) == 0) {
+        memcpy(peer.id, ack.id, SYNC_ADDR_LEN);
+        peer.idKnown = true;
+      }
+    }
+    portEXIT_CRITICAL(&ctx.peerMux);
+  }
+#endif
+
+  portENTER_CRITICAL(&ctx.statsMux);
+  LinkStats *st = findStats(ctx, (SyncTransport)ack.transport, ack.id, true);
+  if (st) {
+    if ((int16_t)(ack.seq - st->lastSeq) > 0 || st->lastAckMs == 0) st->lastSeq = ack.seq;
+    st->lastAckMs = millis();
+    st->rttUs = st->rttUs == 0 ? rttUs : (st->rttUs * 7 + rttUs) / 8;
+  }
+  portEXIT_CRITICAL(&ctx.statsMux);
+}
+
+// Frames the link layer handles itself, on the sync task. True if it took
+// the frame; otherwise the node notes which transport the controller is on.
+inline bool onLinkFrame(BleSyncContext &ctx, const SyncFrame &frame) {
+  if (frame.len == 0) return false;
+#ifdef CONTROLLER
+  if (frame.transport == SYNC_ESPNOW) EspNow::learnPeer(ctx, frame.addr, frame.data[0] == MSG_LINK_PROBE_ACK);
+  if (frame.data[0] != MSG_LINK_PROBE_ACK) return false;
+  onProbeAck(ctx, frame);
+  return true;
+#else
+  if (frame.data[0] != MSG_LINK_PROBE) {
+    ctx.active = frame.transport;
+    return false;
+  }
+  if (frame.len != sizeof(LinkProbePacket)) return true;
+  if (frame.transport == SYNC_ESPNOW) {
+    ctx.probeHeardMs = millis();
+    EspNow::learnPeer(ctx, frame.addr, true);  // so the answer goes unicast
+  }
+  LinkProbePacket probe;
+  memcpy(&probe, frame.data, sizeof(probe));
+  LinkProbeAckPacket ack;
+  memset(&ack, 0, sizeof(ack));
+  ack.type = MSG_LINK_PROBE_ACK;
+  ack.transport = probe.transport;
+  ack.seq = probe.seq;
+  ack.t1Us = probe.t1Us;
+  memcpy(ack.id, ctx.selfId, SYNC_ADDR_LEN);
+  sendOn(ctx, frame.transport, (uint8_t *)&ack, sizeof(ack));
+  return true;
 #endif
+}
+
+// Worst node's smoothed RTT and loss on a transport, for reports; false if
+// no node is answering on it
+inline bool transportStats(BleSyncContext &ctx, SyncTransport transport, uint32_t &rttUs, uint16_t &lossPermille) {
+  uint32_t nowMs = millis();
+  bool any = false;
+  rttUs = 0;
+  lossPermille = 0;
+  portENTER_CRITICAL(&ctx.statsMux);
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const LinkStats &st = ctx.stats[transport][i];
+    if (!fresh(st, nowMs)) continue;
+    rttUs = std::max(rttUs, st.rttUs);
+    lossPermille = std::max(lossPermille, st.lossPermille);
+    any = true;
+  }
+  portEXIT_CRITICAL(&ctx.statsMux);
+  return any;
+}
+
+// From loop(). The BLE link task connects on its own. The controller
+// probes here, and with both transports picks one; a node without the
+// controller's probes looks for its ESP-NOW channel.
+inline void update(BleSyncContext &ctx) {
+  uint32_t nowMs = millis();
+#if defined(CONTROLLER)
+  if (nowMs - ctx.lastProbeMs < SYNC_LINK_PROBE_MS) return;
+  sendProbes(ctx, nowMs);
+#if defined(USE_BLE_SYNC)
+  selectTransport(ctx, nowMs);
+#endif
+#else
+  EspNow::hunt(ctx, nowMs);
+#endif
+}
 
 } // namespace BleSync
 
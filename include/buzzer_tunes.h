@@ -9,8 +9,19 @@ struct Note {
     uint16_t durationMs;
 };
 
-// Play any array of notes
-void playTune(const Note *tune, uint8_t count);
+// Tunes play in the background: notes are switched by an esp_timer, so
+// these all return at once. A tune started while another plays waits
+// behind it. Stimulation owns the fingers whenever it has edges to fire;
+// a tune it interrupts is dropped along with the queue.
+
+// Play any array of notes; the array must outlive playback. False if the
+// queue is full or stimulation is running.
+bool playTune(const Note *tune, uint8_t count);
+
+// Silence the current tune and drop the queue
+void stopTune();
+
+bool isTunePlaying();
 
 // Convenience functions
 void playSuccess();
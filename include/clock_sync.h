@@ -0,0 +1,208 @@
+// Controller <-> node clock offset estimation (NTP-style, four timestamps)
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <Arduino.h>
+#include "config.h"
+
+// One exchange gives four timestamps:
+//   t1 controller send, t2 node receive, t3 node send, t4 controller receive
+// from which
+//   offset = ((t2 - t1) + (t3 - t4)) / 2   (node clock - controller clock)
+//   delay  = (t4 - t1) - (t3 - t2)         (round trip minus node turnaround)
+//
+// Radio latency is asymmetric and bursty, so only samples whose delay is
+// within CLOCK_SYNC_DELAY_MARGIN_US of the window minimum are trusted (their
+// offset error is bounded by delay / 2). The two crystals also drift apart
+// by tens of ppm, so a least-squares line is fitted through the trusted
+// samples: offset(t) = offsetUs + skew * (t - refUs), t in node time.
+
+struct ClockSample {
+  int64_t  nodeUs;     // node time of the exchange, (t2 + t3) / 2
+  int64_t  offsetUs;
+  uint32_t delayUs;
+};
+
+// Node side: t1/t2/t3 of pings we've answered but whose t4 hasn't come back yet
+struct PendingPing {
+  uint8_t  seq;
+  bool     used;
+  uint64_t t1Us;
+  uint64_t t2Us;
+  uint64_t t3Us;
+};
+
+static constexpr uint8_t CLOCK_SYNC_PENDING = 4;
+
+struct ClockSyncContext {
+  ClockSample window[CLOCK_SYNC_WINDOW];
+  uint8_t  count = 0;
+  uint8_t  head = 0;
+  int64_t  refUs = 0;      // node time the fit is anchored at
+  int64_t  offsetUs = 0;   // node - controller at refUs
+  double   skew = 0.0;     // d(offset)/dt, node clock rate error vs controller
+  uint32_t delayUs = 0;    // smallest delay in the window
+  bool     valid = false;
+  bool     locked = false; // fit established and tracking; pings can slow down
+  uint32_t accepted = 0;
+  uint32_t rejected = 0;
+  uint32_t resets = 0;
+  PendingPing pending[CLOCK_SYNC_PENDING];
+};
+
+namespace ClockSync {
+
+inline void reset(ClockSyncContext &ctx) {
+  ctx = ClockSyncContext();
+}
+
+// Offset predicted by the current fit at node time nodeUs
+inline int64_t offsetAt(const ClockSyncContext &ctx, int64_t nodeUs) {
+  return ctx.offsetUs + (int64_t)(ctx.skew * (double)(nodeUs - ctx.refUs));
+}
+
+inline float skewPpm(const ClockSyncContext &ctx) {
+  return (float)(ctx.skew * 1e6);
+}
+
+// Refit offset and skew over the trusted samples in the window
+inline void fit(ClockSyncContext &ctx) {
+  uint32_t minDelay = UINT32_MAX;
+  for (uint8_t i = 0; i < ctx.count; i++) {
+    if (ctx.window[i].delayUs < minDelay) minDelay = ctx.window[i].delayUs;
+  }
+  uint32_t limit = minDelay + CLOCK_SYNC_DELAY_MARGIN_US;
+
+  // Anchor at the newest sample; work in deviations to keep doubles exact
+  const ClockSample &newest = ctx.window[(ctx.head + CLOCK_SYNC_WINDOW - 1) % CLOCK_SYNC_WINDOW];
+  int64_t x0 = newest.nodeUs;
+  int64_t y0 = newest.offsetUs;
+
+  uint8_t n = 0;
+  double sx = 0, sy = 0;
+  int64_t xMin = INT64_MAX, xMax = INT64_MIN;
+  for (uint8_t i = 0; i < ctx.count; i++) {
+    const ClockSample &s = ctx.window[i];
+    if (s.delayUs > limit) continue;
+    sx += (double)(s.nodeUs - x0);
+    sy += (double)(s.offsetUs - y0);
+    if (s.nodeUs < xMin) xMin = s.nodeUs;
+    if (s.nodeUs > xMax) xMax = s.nodeUs;
+    n++;
+  }
+
+  double mx = sx / n, my = sy / n;
+  double sxx = 0, sxy = 0;
+  for (uint8_t i = 0; i < ctx.count; i++) {
+    const ClockSample &s = ctx.window[i];
+    if (s.delayUs > limit) continue;
+    double dx = (double)(s.nodeUs - x0) - mx;
+    double dy = (double)(s.offsetUs - y0) - my;
+    sxx += dx * dx;
+    sxy += dx * dy;
+  }
+
+  // A slope over a short span is mostly noise; keep the last skew until
+  // the trusted samples cover enough time
+  if (n >= 2 && (xMax - xMin) >= (int64_t)CLOCK_SYNC_MIN_SPAN_US && sxx > 0) {
+    double skew = sxy / sxx;
+    if (skew > CLOCK_SYNC_MAX_SKEW) skew = CLOCK_SYNC_MAX_SKEW;
+    if (skew < -CLOCK_SYNC_MAX_SKEW) skew = -CLOCK_SYNC_MAX_SKEW;
+    ctx.skew = skew;
+    ctx.locked = ctx.count >= CLOCK_SYNC_WINDOW / 2;
+  }
+
+  ctx.refUs = x0;
+  ctx.offsetUs = y0 + (int64_t)(my - ctx.skew * mx);
+  ctx.delayUs = minDelay;
+  ctx.valid = true;
+}
+
+// Feed one completed exchange. Returns false if the sample was rejected.
+inline bool addSample(ClockSyncContext &ctx,
+                      uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+  int64_t rtt = (int64_t)(t4 - t1);
+  int64_t turnaround = (int64_t)(t3 - t2);
+  int64_t delay = rtt - turnaround;
+
+  if (rtt <= 0 || turnaround < 0 || delay < 0 || delay > (int64_t)CLOCK_SYNC_MAX_DELAY_US) {
+    ctx.rejected++;
+    return false;
+  }
+
+  ClockSample s;
+  s.nodeUs = (int64_t)(t2 + t3) / 2;
+  s.offsetUs = (((int64_t)(t2 - t1)) + ((int64_t)(t3 - t4))) / 2;
+  s.delayUs = (uint32_t)delay;
+
+  // A trusted sample far off the fitted line means a clock jumped (e.g. the
+  // peer rebooted): the old samples no longer describe it, start over
+  if (ctx.valid && s.delayUs <= ctx.delayUs + CLOCK_SYNC_DELAY_MARGIN_US) {
+    int64_t residual = s.offsetUs - offsetAt(ctx, s.nodeUs);
+    if (residual > (int64_t)CLOCK_SYNC_STEP_US || residual < -(int64_t)CLOCK_SYNC_STEP_US) {
+      ctx.count = 0;
+      ctx.head = 0;
+      ctx.skew = 0.0;
+      ctx.valid = false;
+      ctx.locked = false;
+      ctx.resets++;
+    }
+  }
+
+  ctx.window[ctx.head] = s;
+  ctx.head = (ctx.head + 1) % CLOCK_SYNC_WINDOW;
+  if (ctx.count < CLOCK_SYNC_WINDOW) ctx.count++;
+
+  fit(ctx);
+  ctx.accepted++;
+  return true;
+}
+
+inline bool isValid(const ClockSyncContext &ctx) {
+  return ctx.valid;
+}
+
+inline bool isLocked(const ClockSyncContext &ctx) {
+  return ctx.locked;
+}
+
+// How often the controller should ping: fast until the fit has locked on,
+// then only often enough to follow slow changes in drift
+inline uint32_t pingIntervalMs(const ClockSyncContext &ctx) {
+  return ctx.locked ? TIME_SYNC_INTERVAL_LOCKED_MS : TIME_SYNC_INTERVAL_MS;
+}
+
+// Map a controller esp_timer_get_time() value onto this node's clock.
+// offset depends on node time, but skew is tiny so evaluating it at
+// controllerUs + offsetUs is accurate to well under a microsecond.
+inline int64_t controllerTimeToLocal(const ClockSyncContext &ctx, int64_t controllerUs) {
+  return controllerUs + offsetAt(ctx, controllerUs + ctx.offsetUs);
+}
+
+inline int64_t localTimeToController(const ClockSyncContext &ctx, int64_t localUs) {
+  return localUs - offsetAt(ctx, localUs);
+}
+
+// ---- Node-side bookkeeping for pings whose t4 arrives with the next ping ----
+
+inline void rememberPing(ClockSyncContext &ctx, uint8_t seq,
+                         uint64_t t1, uint64_t t2, uint64_t t3) {
+  PendingPing &p = ctx.pending[seq % CLOCK_SYNC_PENDING];
+  p.seq = seq;
+  p.used = true;
+  p.t1Us = t1;
+  p.t2Us = t2;
+  p.t3Us = t3;
+}
+
+// Complete an earlier exchange once the controller reports its t4
+inline bool completePing(ClockSyncContext &ctx, uint8_t seq, uint64_t t4) {
+  PendingPing &p = ctx.pending[seq % CLOCK_SYNC_PENDING];
+  if (!p.used || p.seq != seq) return false;
+  p.used = false;
+  return addSample(ctx, p.t1Us, p.t2Us, p.t3Us, t4);
+}
+
+} // namespace ClockSync
+
+#endif // CLOCK_SYNC_H
@@ -3,12 +3,18 @@
 
 #include <Arduino.h>
 
-// Role
+// Role (a build may set it instead with -DNODE or -DCONTROLLER)
+#if !defined(NODE) && !defined(CONTROLLER)
 //#define NODE
 #define CONTROLLER
+#endif
 
-// Use ESP-NOW transport for low-latency controller<->node sync
-#define USE_ESPNOW
+// Sync transports: ESP-NOW is always built in, and BLE too unless a build
+// leaves it out with -DSYNC_NO_BLE. With both, the controller keeps a link
+// up on each and sends on the faster (ble_sync.h).
+#if !defined(SYNC_NO_BLE)
+#define USE_BLE_SYNC
+#endif
 
 // Board
 #define QTPY_ESP32_S3
@@ -17,6 +23,7 @@
 // Other
 //#define BLUETOOTH
 //#define POWER_SAVER
+//#define TRACE           // record edge and sync timing in a RAM ring; "trace" dumps it
 
 static constexpr uint64_t ESP_SLEEP = 100000; // us
 
@@ -61,6 +68,80 @@ static constexpr float PULSE_WIDTH_MS = 100.0f;
 static constexpr float MAX_PRE_JITTER_MS  = 31.5f;
 static constexpr float MAX_JITTER_MS  = 66.5f;
 
+// Sync
+static constexpr uint32_t SYNC_START_DELAY_US = 200000;     // lead time between sending a sequence and playing it
+static constexpr bool SYNC_SEND_SEED = true;                 // send seeds for the node to regenerate instead of full sequences
+static constexpr uint8_t SYNC_SEED_MAX = 8;                  // sequence descriptors per seed packet
+static constexpr uint8_t SYNC_LOOKAHEAD = 3;                 // cycles the controller schedules and sends ahead
+static constexpr uint8_t SYNC_QUEUE_MAX = 8;                 // cycles the node holds waiting to play
+static constexpr uint8_t SYNC_MAX_NODES = 4;                 // nodes one controller drives and tracks
+static constexpr uint32_t SYNC_NODE_TIMEOUT_MS = 10000;      // a node silent this long is treated as gone
+static constexpr uint32_t SYNC_RESCAN_MS = 30000;            // BLE: look for more nodes this often while connected
+static constexpr uint32_t BLE_CONNECT_TIMEOUT_S = 2;         // BLE: give up on one connect attempt after this
+static constexpr uint32_t BLE_RETRY_MS = 200;                // BLE: link task wakes at least this often to retry
+static constexpr uint32_t BLE_GATT_TIMEOUT_MS = 1000;         // BLE: wait this long for a node to confirm a subscription
+static constexpr uint8_t SYNC_RX_SLOTS = 8;                  // receive ring slots per transport, power of two
+static constexpr uint16_t SYNC_FRAME_MAX = 250;              // largest frame a slot holds (ESP-NOW maximum)
+static constexpr uint16_t BLE_MTU = SYNC_FRAME_MAX + 3;      // BLE: ATT MTU to ask for; the largest frame in one write
+static constexpr uint16_t BLE_DATA_LEN = 251;                // BLE: link-layer payload (Data Length Extension maximum)
+static constexpr uint16_t BLE_DATA_TIME_US = (BLE_DATA_LEN + 14) * 8;  // BLE: its airtime on 1M, with preamble, header, MIC and CRC
+static constexpr bool BLE_PREFER_2M_PHY = true;              // BLE: ask for the 2M PHY; a peer without it stays on 1M
+static constexpr uint32_t SYNC_LINK_PROBE_MS = 500;          // controller: probe each transport this often; on ESP-NOW it's also the beacon nodes find it by
+static constexpr uint32_t SYNC_LINK_STALE_MS = 2000;         // a node silent this long on one is unreachable there
+static constexpr uint32_t SYNC_LINK_LOSS_COST_US = 20000;    // added to RTT for 100% probe loss when comparing
+static constexpr uint8_t SYNC_LINK_HYSTERESIS_PCT = 25;      // switch only to one at least this much cheaper
+static constexpr uint32_t SYNC_LINK_HOLD_MS = 10000;         // and not sooner than this after the last switch
+static constexpr uint8_t SYNC_ESPNOW_CHANNEL = 1;            // ESP-NOW: channel with no remembered access point (OTA::espNowChannel())
+static constexpr uint8_t SYNC_ESPNOW_MAX_CHANNEL = 13;       // ESP-NOW: a node looking for the controller tries 1 to this
+static constexpr uint32_t SYNC_ESPNOW_HUNT_MS = 3000;        // ESP-NOW: node looks on other channels after this long without a probe
+static constexpr uint32_t SYNC_ESPNOW_DWELL_MS = 1600;       // ESP-NOW: and listens this long on each, over three probes
+static constexpr uint8_t SYNC_ESPNOW_INFLIGHT = 16;          // ESP-NOW: unicast frames waiting for their send status
+static constexpr uint8_t SYNC_ESPNOW_RETRIES = 2;            // ESP-NOW: resends of a unicast frame the peer didn't acknowledge
+static constexpr uint32_t SYNC_TASK_STACK = 4096;            // sync receive task
+static constexpr UBaseType_t SYNC_TASK_PRIORITY = 5;         // above loop() (1), below the radio stacks
+static constexpr BaseType_t SYNC_TASK_CORE = 1;              // loop() core; WiFi and BLE run on core 0
+static constexpr uint32_t BLE_LINK_TASK_STACK = 4096;        // BLE: controller's scan and connect task
+static constexpr UBaseType_t BLE_LINK_TASK_PRIORITY = 2;     // above loop(), below the sync task
+static constexpr BaseType_t BLE_LINK_TASK_CORE = 0;          // next to the BLE host
+static constexpr uint32_t TIME_SYNC_INTERVAL_MS = 250;          // controller clock ping period while acquiring
+static constexpr uint32_t TIME_SYNC_INTERVAL_LOCKED_MS = 2000;  // ping period once offset and drift are tracked
+static constexpr uint8_t CLOCK_SYNC_WINDOW = 16;                // samples kept for the offset/drift fit
+static constexpr uint32_t CLOCK_SYNC_MAX_DELAY_US = 50000;      // discard exchanges slower than this
+static constexpr uint32_t CLOCK_SYNC_DELAY_MARGIN_US = 1500;    // trust samples within this of the minimum delay
+static constexpr uint32_t CLOCK_SYNC_MIN_SPAN_US = 2000000;     // time covered before drift is estimated
+static constexpr double CLOCK_SYNC_MAX_SKEW = 200e-6;           // clamp drift estimate to +-200 ppm
+static constexpr uint32_t CLOCK_SYNC_STEP_US = 5000;            // residual that means a clock jumped
+static constexpr float SYNC_OFFSET_SLEW = 0.05f;                // max offset correction, us per us of playback
+
+// Trace (only with TRACE defined)
+static constexpr uint16_t TRACE_SLOTS = 1024;                   // records kept, power of two (24 bytes each)
+static constexpr uint32_t TRACE_LOOP_STALL_US = 5000;           // loop() gap worth recording
+
+// OTA
+static constexpr uint8_t OTA_CHECK_EVERY_BOOTS = 1;             // check on every Nth boot; 0 = never
+static constexpr uint32_t OTA_FAST_CONNECT_MS = 3000;           // try the remembered access point this long before scanning
+static constexpr uint32_t OTA_START_FALLBACK_MS = 60000;        // check anyway if sync isn't up by then
+static constexpr uint32_t OTA_TASK_STACK = 12288;               // background check (TLS needs the room)
+static constexpr UBaseType_t OTA_TASK_PRIORITY = 1;             // same as loop()
+static constexpr BaseType_t OTA_TASK_CORE = 0;                  // next to the WiFi stack, away from loop()
+static constexpr uint32_t OTA_CHUNK_BYTES = 262144;             // bytes per HTTP Range request
+static constexpr uint32_t OTA_PROGRESS_BYTES = 65536;           // save the resume point to NVS this often
+static constexpr uint8_t OTA_CHUNK_RETRIES = 3;                 // failed chunks in a row before giving up until next check
+
+// Firmware transfer, controller -> nodes over the sync link (fw_transfer.h)
+static constexpr uint8_t FW_BLOCK_BYTES = 200;                  // image bytes per frame; fits ESP-NOW and a 247-byte BLE MTU
+static constexpr uint8_t FW_BURST_BLOCKS = 8;                   // blocks broadcast per loop() pass
+static constexpr uint8_t FW_NACK_BLOCKS = 64;                   // blocks per window; one bitmap covers it
+static constexpr uint32_t FW_OFFER_INTERVAL_MS = 5000;          // controller advertises its node image this often
+static constexpr uint32_t FW_RETRY_MS = 250;                    // poll again after this long without every bitmap
+static constexpr uint8_t FW_POLL_RETRIES = 3;                   // polls per pass before going on without a node
+static constexpr uint32_t FW_SESSION_TIMEOUT_MS = 10000;        // give up on a node that stops answering
+
+// Tunes
+static constexpr uint8_t TUNE_QUEUE_MAX = 4;                    // tunes waiting behind the one playing
+static constexpr uint16_t TUNE_NOTE_GAP_MS = 20;                // silence after each note
+static constexpr uint32_t TUNE_LOCK_RETRY_US = 1000;            // timer step again this soon if loop() holds the player
+
 // -------------------------
 // User-configurable params
 // -------------------------
@@ -0,0 +1,92 @@
+// Fixed-size receive ring for radio frames
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+
+// Single producer and single consumer. Each radio task gets a ring of its
+// own (the WiFi task for ESP-NOW, the NimBLE host for BLE), and the sync
+// task drains them all. Slots are preallocated, so receiving a frame never
+// touches the heap, and head/tail are atomics, so the two sides need no
+// lock. A frame that finds the ring full (or is larger than a slot) is
+// dropped and counted.
+
+static constexpr uint8_t SYNC_ADDR_LEN = 6;
+static_assert((SYNC_RX_SLOTS & (SYNC_RX_SLOTS - 1)) == 0, "SYNC_RX_SLOTS must be a power of two");
+
+// The radios a sync frame can travel over (ble_sync.h)
+enum SyncTransport : uint8_t {
+  SYNC_ESPNOW = 0,
+  SYNC_BLE = 1,
+  SYNC_TRANSPORTS
+};
+
+struct SyncFrame {
+  uint8_t  addr[SYNC_ADDR_LEN];  // sender, all zero if the transport can't tell
+  SyncTransport transport;       // what it came over
+  uint16_t len;
+  uint64_t rxUs;                 // esp_timer_get_time() when the radio delivered it
+  uint8_t  data[SYNC_FRAME_MAX];
+};
+
+class FrameRing {
+ public:
+  // Producer side. False if the frame was dropped.
+  bool push(const uint8_t *addr, const uint8_t *data, size_t len, uint64_t rxUs, SyncTransport transport) {
+    uint32_t head = _head.load(std::memory_order_relaxed);
+    if (len > SYNC_FRAME_MAX || head - _tail.load(std::memory_order_acquire) >= SYNC_RX_SLOTS) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    SyncFrame &f = _slots[head & (SYNC_RX_SLOTS - 1)];
+    memcpy(f.addr, addr, SYNC_ADDR_LEN);
+    f.transport = transport;
+    f.len = (uint16_t)len;
+    f.rxUs = rxUs;
+    memcpy(f.data, data, len);
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: the oldest frame, valid until release(); nullptr if empty
+  const SyncFrame *peek() const {
+    uint32_t tail = _tail.load(std::memory_order_relaxed);
+    if (_head.load(std::memory_order_acquire) == tail) return nullptr;
+    return &_slots[tail & (SYNC_RX_SLOTS - 1)];
+  }
+
+  void release() {
+    _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool pop(SyncFrame &out) {
+    const SyncFrame *f = peek();
+    if (!f) return false;
+    out.transport = f->transport;
+    out.len = f->len;
+    out.rxUs = f->rxUs;
+    memcpy(out.addr, f->addr, SYNC_ADDR_LEN);
+    memcpy(out.data, f->data, f->len);
+    release();
+    return true;
+  }
+
+  bool empty() const {
+    return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_relaxed);
+  }
+
+  uint32_t dropped() const {
+    return _dropped.load(std::memory_order_relaxed);
+  }
+
+ private:
+  SyncFrame _slots[SYNC_RX_SLOTS];
+  std::atomic<uint32_t> _head{0};
+  std::atomic<uint32_t> _tail{0};
+  std::atomic<uint32_t> _dropped{0};
+};
+
+#endif // FRAME_RING_H
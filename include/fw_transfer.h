@@ -0,0 +1,639 @@
+// Node firmware updates from the controller over the sync link
+#ifndef FW_TRANSFER_H
+#define FW_TRANSFER_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "ble_sync.h"
+#include "ota.h"
+#include "ota_partition.h"
+
+// A controller that keeps a node image (OTA::NodeImage) offers it every
+// FW_OFFER_INTERVAL_MS. A node running an older version asks for it from
+// the byte it already has, so a transfer cut short by a reboot or a lost
+// link carries on where it stopped (the resume point is the same NVS
+// record a WiFi download uses).
+//
+// Every node that asked is served at once. The image goes out in windows
+// of FW_NACK_BLOCKS blocks, each block FW_BLOCK_BYTES with its own CRC-32.
+// A window is broadcast once, then the controller polls and each node
+// answers with a bitmap of the blocks it still misses. Only the union of
+// those goes out again, until no node misses any; the next window starts
+// at the lowest block any node lacks. A node holds one window in RAM and
+// writes it to flash in order, so a node that joins late or resumes
+// further on just skips what it has. Each finished image is checked
+// against the offered SHA-256 before it's made bootable, and runs from the
+// next restart.
+
+static constexpr uint8_t FW_NACK_BYTES = FW_NACK_BLOCKS / 8;
+static_assert(FW_NACK_BLOCKS % 8 == 0, "a window's bitmap must be whole bytes");
+
+enum FwStatus : uint8_t {
+  FW_OK = 0,
+  FW_DONE = 1,       // verified and set to boot
+  FW_FAILED = 2,     // flash or digest check failed; the node starts over
+};
+
+typedef struct {
+  uint8_t type;          // MSG_FW_OFFER
+  uint8_t version;       // FW_VERSION of the image
+  uint32_t size;
+  uint8_t sha256[32];
+} FwOfferPacket;
+
+typedef struct {
+  uint8_t type;          // MSG_FW_REQUEST or MSG_FW_ACK
+  uint8_t status;        // FwStatus
+  uint32_t image;        // first bytes of the image's SHA-256
+  uint32_t offset;       // the node has every byte before this
+} FwAckPacket;
+
+typedef struct {
+  uint8_t type;          // MSG_FW_BLOCK
+  uint8_t len;
+  uint32_t image;
+  uint32_t offset;       // a multiple of FW_BLOCK_BYTES
+  uint32_t crc;          // CRC-32 of the bytes before it and of data[0, len)
+  uint8_t data[FW_BLOCK_BYTES];
+} FwBlockPacket;
+
+typedef struct {
+  uint8_t type;          // MSG_FW_POLL
+  uint32_t image;
+  uint32_t base;         // first block of the window
+} FwPollPacket;
+
+typedef struct {
+  uint8_t type;          // MSG_FW_NACK
+  uint32_t image;
+  uint32_t base;         // echo of the poll
+  uint32_t next;         // the node has every block before this
+  uint8_t missing[FW_NACK_BYTES];  // bit i: block base + i still needed
+} FwNackPacket;
+
+static_assert(offsetof(FwBlockPacket, data) + FW_BLOCK_BYTES <= SYNC_FRAME_MAX, "a block must fit one frame");
+
+#ifdef CONTROLLER
+// A node taking part in the transfer
+struct FwReceiver {
+  bool used = false;
+  uint8_t addr[SYNC_ADDR_LEN] = {0};
+  uint32_t next = 0;                      // first block it lacks
+  uint8_t missing[FW_NACK_BYTES] = {0};   // in the current window
+  bool answered = false;                  // the current poll
+  uint32_t lastHeardMs = 0;
+  uint32_t startMs = 0;
+};
+
+enum FwSendPhase : uint8_t {
+  FW_SENDING,   // broadcasting the blocks in pending
+  FW_POLLING,   // waiting for every receiver's bitmap
+};
+#endif
+
+#ifdef NODE
+enum FwReceiveState : uint8_t {
+  FW_IDLE,
+  FW_RECEIVING,
+  FW_VERIFYING,   // all bytes in flash; loop() checks the digest
+  FW_INSTALLED,   // boots after the next restart
+};
+#endif
+
+struct FwTransferContext {
+#ifdef CONTROLLER
+  OTA::NodeImage image;     // what we hand out, once the background task has checked it
+  FwReceiver receivers[SYNC_MAX_NODES];
+  uint32_t base = 0;        // first block of the current window
+  uint8_t pending[FW_NACK_BYTES] = {0};  // still to send in this pass
+  FwSendPhase phase = FW_SENDING;
+  uint32_t pollMs = 0;
+  uint8_t polls = 0;        // polls sent for this pass
+  uint32_t lastOfferMs = 0;
+#endif
+#ifdef NODE
+  volatile FwReceiveState state = FW_IDLE;
+  uint8_t version = 0;
+  uint32_t size = 0;
+  uint8_t sha256[32] = {0};
+  String id;                // progress record key, the digest in hex
+  OtaWriteContext writer;
+  uint32_t saved = 0;       // resume point last written to NVS
+  uint8_t *window = nullptr;              // FW_NACK_BLOCKS blocks, slot = block % FW_NACK_BLOCKS
+  uint8_t have[FW_NACK_BYTES] = {0};      // slots holding a block not yet written
+  SemaphoreHandle_t lock = nullptr;       // onFrame() on the sync task vs update() from loop()
+#endif
+};
+
+namespace FwTransfer {
+
+inline uint32_t crc32(const uint8_t *data, size_t len, uint32_t crc = 0) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (uint8_t b = 0; b < 8; b++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+inline uint32_t blockCrc(const FwBlockPacket &pkt) {
+  uint32_t crc = crc32((const uint8_t *)&pkt, offsetof(FwBlockPacket, crc));
+  return crc32(pkt.data, pkt.len, crc);
+}
+
+inline uint32_t imageTag(const uint8_t sha256[32]) {
+  uint32_t tag;
+  memcpy(&tag, sha256, sizeof(tag));
+  return tag;
+}
+
+inline uint32_t blockCount(uint32_t size) {
+  return (size + FW_BLOCK_BYTES - 1) / FW_BLOCK_BYTES;
+}
+
+inline bool bit(const uint8_t *bits, uint32_t i) {
+  return bits[i / 8] & (1 << (i % 8));
+}
+
+inline void setBit(uint8_t *bits, uint32_t i, bool on) {
+  if (on) bits[i / 8] |= (uint8_t)(1 << (i % 8));
+  else bits[i / 8] &= (uint8_t)~(1 << (i % 8));
+}
+
+// Whether a node whose first missing block is next can take this block
+// now: it holds one window from there, later blocks wait for a later one
+inline bool inWindow(uint32_t block, uint32_t next, uint32_t total) {
+  return block >= next && block < next + FW_NACK_BLOCKS && block < total;
+}
+
+inline bool isTransferFrame(uint8_t type) {
+  return type >= MSG_FW_OFFER && type <= MSG_FW_NACK;
+}
+
+#ifdef CONTROLLER
+// ---------------- CONTROLLER: sending ----------------
+
+inline void sendOffer(FwTransferContext &ctx, BleSyncContext &link) {
+  FwOfferPacket offer;
+  memset(&offer, 0, sizeof(offer));
+  offer.type = MSG_FW_OFFER;
+  offer.version = ctx.image.version;
+  offer.size = ctx.image.size;
+  memcpy(offer.sha256, ctx.image.sha256, 32);
+  BleSync::broadcast(link, (uint8_t *)&offer, sizeof(offer));
+}
+
+inline bool sendBlock(FwTransferContext &ctx, BleSyncContext &link, uint32_t block) {
+  FwBlockPacket pkt;
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.type = MSG_FW_BLOCK;
+  pkt.offset = block * FW_BLOCK_BYTES;
+  pkt.len = (uint8_t)std::min((uint32_t)FW_BLOCK_BYTES, ctx.image.size - pkt.offset);
+  pkt.image = imageTag(ctx.image.sha256);
+  if (esp_partition_read(ctx.image.part, pkt.offset, pkt.data, pkt.len) != ESP_OK) return false;
+  pkt.crc = blockCrc(pkt);
+  return BleSync::broadcast(link, (uint8_t *)&pkt, offsetof(FwBlockPacket, data) + pkt.len);
+}
+
+inline void sendPoll(FwTransferContext &ctx, BleSyncContext &link, uint32_t nowMs) {
+  FwPollPacket poll;
+  memset(&poll, 0, sizeof(poll));
+  poll.type = MSG_FW_POLL;
+  poll.image = imageTag(ctx.image.sha256);
+  poll.base = ctx.base;
+  BleSync::send(link, (uint8_t *)&poll, sizeof(poll));
+  ctx.phase = FW_POLLING;
+  ctx.pollMs = nowMs;
+  ctx.polls++;
+}
+
+// Until it answers a poll, assume a receiver lacks every block of the
+// window it can take
+inline void assumeMissing(const FwTransferContext &ctx, FwReceiver &r) {
+  uint32_t total = blockCount(ctx.image.size);
+  for (uint32_t i = 0; i < FW_NACK_BLOCKS; i++) {
+    setBit(r.missing, i, inWindow(ctx.base + i, r.next, total));
+  }
+}
+
+inline bool anyReceivers(const FwTransferContext &ctx) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.receivers[i].used) return true;
+  }
+  return false;
+}
+
+// Every receiver has the whole image and is checking it
+inline bool allComplete(const FwTransferContext &ctx) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.receivers[i].used && ctx.receivers[i].next < blockCount(ctx.image.size)) return false;
+  }
+  return true;
+}
+
+inline bool collectPending(FwTransferContext &ctx) {
+  memset(ctx.pending, 0, sizeof(ctx.pending));
+  bool any = false;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const FwReceiver &r = ctx.receivers[i];
+    if (!r.used) continue;
+    for (uint8_t b = 0; b < FW_NACK_BYTES; b++) {
+      ctx.pending[b] |= r.missing[b];
+      any = any || r.missing[b];
+    }
+  }
+  return any;
+}
+
+// Send again whatever any receiver still misses, or move on to the next
+// window once none does
+inline void startPass(FwTransferContext &ctx) {
+  if (!collectPending(ctx) && !allComplete(ctx)) {
+    uint32_t base = UINT32_MAX;
+    for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+      if (ctx.receivers[i].used) base = std::min(base, ctx.receivers[i].next);
+    }
+    ctx.base = base;
+    for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+      if (ctx.receivers[i].used) assumeMissing(ctx, ctx.receivers[i]);
+    }
+    collectPending(ctx);
+  }
+
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) ctx.receivers[i].answered = false;
+  ctx.phase = FW_SENDING;
+  ctx.polls = 0;
+}
+
+inline FwReceiver *findReceiver(FwTransferContext &ctx, const uint8_t *addr) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    FwReceiver &r = ctx.receivers[i];
+    if (r.used && memcmp(r.addr, addr, SYNC_ADDR_LEN) == 0) return &r;
+  }
+  return nullptr;
+}
+
+// A node that asked, or one we lost track of that still answers polls.
+// The first one starts a window at its next block; later ones are
+// covered by the window after theirs comes round.
+inline FwReceiver *addReceiver(FwTransferContext &ctx, const uint8_t *addr, uint32_t next, uint32_t nowMs) {
+  FwReceiver *r = findReceiver(ctx, addr);
+  if (!r) {
+    bool first = !anyReceivers(ctx);
+    for (uint8_t i = 0; i < SYNC_MAX_NODES && !r; i++) {
+      if (!ctx.receivers[i].used) r = &ctx.receivers[i];
+    }
+    if (!r) return nullptr;
+    *r = FwReceiver();
+    r->used = true;
+    memcpy(r->addr, addr, SYNC_ADDR_LEN);
+    r->startMs = nowMs;
+    Serial.printf("[FW] sending node firmware v%u to %02X:%02X:%02X:%02X:%02X:%02X from byte %u\n",
+                  ctx.image.version, addr[0], addr[1], addr[2], addr[3], addr[4], addr[5],
+                  (unsigned)(next * FW_BLOCK_BYTES));
+    if (first) {
+      ctx.base = next;
+      ctx.phase = FW_SENDING;
+      ctx.polls = 0;
+      memset(ctx.pending, 0, sizeof(ctx.pending));
+    }
+  }
+  r->next = next;
+  r->lastHeardMs = nowMs;
+  assumeMissing(ctx, *r);
+  if (ctx.phase == FW_SENDING) {
+    for (uint8_t b = 0; b < FW_NACK_BYTES; b++) ctx.pending[b] |= r->missing[b];
+  }
+  return r;
+}
+
+// From loop() under syncLock: offer the image, and send the current pass
+// FW_BURST_BLOCKS at a time between the sync traffic
+inline void service(FwTransferContext &ctx, BleSyncContext &link, uint32_t nowMs) {
+  if (!ctx.image.valid) {
+    if (!OTA::background().done || !OTA::nodeImage().valid) return;
+    ctx.image = OTA::nodeImage();
+  }
+
+  // Keep offering: a node that turns up mid-transfer joins in
+  if (nowMs - ctx.lastOfferMs >= FW_OFFER_INTERVAL_MS) {
+    ctx.lastOfferMs = nowMs;
+    sendOffer(ctx, link);
+  }
+
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    FwReceiver &r = ctx.receivers[i];
+    if (r.used && nowMs - r.lastHeardMs >= FW_SESSION_TIMEOUT_MS) {
+      Serial.printf("[FW] %02X:%02X:%02X:%02X:%02X:%02X stopped answering at %u bytes\n",
+                    r.addr[0], r.addr[1], r.addr[2], r.addr[3], r.addr[4], r.addr[5],
+                    (unsigned)(r.next * FW_BLOCK_BYTES));
+      r.used = false;
+    }
+  }
+  if (!anyReceivers(ctx)) return;
+
+  if (ctx.phase == FW_SENDING) {
+    uint32_t total = blockCount(ctx.image.size);
+    uint8_t sent = 0;
+    for (uint32_t i = 0; i < FW_NACK_BLOCKS && sent < FW_BURST_BLOCKS; i++) {
+      if (!bit(ctx.pending, i)) continue;
+      if (ctx.base + i < total && !sendBlock(ctx, link, ctx.base + i)) return;  // radio queue full
+      setBit(ctx.pending, i, false);
+      sent++;
+    }
+    // Pass done. While the nodes only check their images, poll slowly.
+    if (sent == 0 && (!allComplete(ctx) || nowMs - ctx.pollMs >= FW_RETRY_MS)) {
+      sendPoll(ctx, link, nowMs);
+    }
+    return;
+  }
+
+  bool all = true;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.receivers[i].used && !ctx.receivers[i].answered) all = false;
+  }
+  if (all) {
+    startPass(ctx);
+  } else if (nowMs - ctx.pollMs >= FW_RETRY_MS) {
+    // A lost poll or answer is cheaper to repeat than the blocks; after a
+    // few, go on with the silent node's last bitmap
+    if (ctx.polls < FW_POLL_RETRIES) sendPoll(ctx, link, nowMs);
+    else startPass(ctx);
+  }
+}
+
+// A node's REQUEST, NACK or final ACK, from handleAck() under syncLock
+inline void onReply(FwTransferContext &ctx, const uint8_t *addr, const uint8_t *data, size_t len, uint32_t nowMs) {
+  if (!ctx.image.valid || len == 0) return;
+  uint32_t tag = imageTag(ctx.image.sha256);
+  uint32_t total = blockCount(ctx.image.size);
+
+  if (data[0] == MSG_FW_NACK) {
+    if (len != sizeof(FwNackPacket)) return;
+    FwNackPacket nack;
+    memcpy(&nack, data, sizeof(nack));
+    if (nack.image != tag) return;
+    FwReceiver *r = findReceiver(ctx, addr);
+    if (!r) r = addReceiver(ctx, addr, std::min(nack.next, total), nowMs);
+    if (!r) return;
+    r->lastHeardMs = nowMs;
+    r->next = std::min(nack.next, total);
+    if (nack.base == ctx.base) {
+      memcpy(r->missing, nack.missing, FW_NACK_BYTES);
+      r->answered = true;
+    }
+    return;
+  }
+
+  if (len != sizeof(FwAckPacket)) return;
+  FwAckPacket reply;
+  memcpy(&reply, data, sizeof(reply));
+  if (reply.image != tag) return;
+
+  if (reply.type == MSG_FW_REQUEST) {
+    addReceiver(ctx, addr, std::min(reply.offset / FW_BLOCK_BYTES, total), nowMs);
+    return;
+  }
+
+  FwReceiver *r = findReceiver(ctx, addr);
+  if (!r || reply.status == FW_OK) return;
+  Serial.printf("[FW] %02X:%02X:%02X:%02X:%02X:%02X %s after %u s\n",
+                addr[0], addr[1], addr[2], addr[3], addr[4], addr[5],
+                reply.status == FW_DONE ? "installed the update" : "failed to install the update",
+                (unsigned)((nowMs - r->startMs) / 1000));
+  r->used = false;
+}
+
+inline bool sending(const FwTransferContext &ctx) {
+  return anyReceivers(ctx);
+}
+#endif
+
+#ifdef NODE
+// ---------------- NODE: receiving ----------------
+
+// From setup(), before the sync link delivers anything
+inline void begin(FwTransferContext &ctx) {
+  if (!ctx.lock) ctx.lock = xSemaphoreCreateMutex();
+}
+
+inline uint32_t received(const FwTransferContext &ctx) {
+  return ctx.writer.offset + ctx.writer.fill;
+}
+
+// First block not wholly in flash (after a resume it may be partly there)
+inline uint32_t nextBlock(const FwTransferContext &ctx) {
+  return received(ctx) / FW_BLOCK_BYTES;
+}
+
+inline void reply(FwTransferContext &ctx, BleSyncContext &link, uint8_t type, uint8_t status) {
+  FwAckPacket pkt;
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.type = type;
+  pkt.status = status;
+  pkt.image = imageTag(ctx.sha256);
+  pkt.offset = received(ctx);
+  BleSync::send(link, (uint8_t *)&pkt, sizeof(pkt));
+}
+
+inline void release(FwTransferContext &ctx) {
+  OtaPartition::end(ctx.writer);
+  free(ctx.window);
+  ctx.window = nullptr;
+}
+
+inline void fail(FwTransferContext &ctx, BleSyncContext &link, const char *why) {
+  Serial.printf("[FW] update failed: %s\n", why);
+  release(ctx);
+  OTA::clearProgress();
+  reply(ctx, link, MSG_FW_ACK, FW_FAILED);
+  ctx.state = FW_IDLE;
+}
+
+// Open the inactive slot for the offered image, picking up any earlier
+// attempt at it, and ask for the rest
+inline void start(FwTransferContext &ctx, BleSyncContext &link, const FwOfferPacket &offer) {
+  const esp_partition_t *part = OtaPartition::target();
+  if (!part || offer.size == 0 || offer.size > part->size) return;
+
+  release(ctx);
+  ctx.window = (uint8_t *)malloc((size_t)FW_NACK_BLOCKS * FW_BLOCK_BYTES);
+  if (!ctx.window) return;
+  memset(ctx.have, 0, sizeof(ctx.have));
+  ctx.version = offer.version;
+  ctx.size = offer.size;
+  memcpy(ctx.sha256, offer.sha256, 32);
+  ctx.id = OtaPartition::toHex(offer.sha256);
+  uint32_t from = OTA::loadProgress(ctx.id, part);
+  if (from > ctx.size) from = 0;
+  if (!OtaPartition::begin(ctx.writer, part, from) && !OtaPartition::begin(ctx.writer, part, 0)) {
+    release(ctx);
+    return;
+  }
+  ctx.saved = ctx.writer.offset;
+
+  Serial.printf("[FW] controller offers v%u (%u bytes), %u already here\n",
+                offer.version, (unsigned)offer.size, (unsigned)ctx.writer.offset);
+  if (received(ctx) >= ctx.size) {
+    ctx.state = FW_VERIFYING;
+    return;
+  }
+  ctx.state = FW_RECEIVING;
+  reply(ctx, link, MSG_FW_REQUEST, FW_OK);
+}
+
+// Write out the held blocks that now follow on from what's in flash
+inline bool drain(FwTransferContext &ctx) {
+  while (received(ctx) < ctx.size) {
+    uint32_t block = nextBlock(ctx);
+    uint32_t slot = block % FW_NACK_BLOCKS;
+    if (!bit(ctx.have, slot)) break;
+    uint32_t skip = received(ctx) - block * FW_BLOCK_BYTES;
+    uint32_t len = std::min((uint32_t)FW_BLOCK_BYTES, ctx.size - block * FW_BLOCK_BYTES);
+    setBit(ctx.have, slot, false);
+    if (!OtaPartition::write(ctx.writer, ctx.window + slot * FW_BLOCK_BYTES + skip, len - skip)) return false;
+  }
+  return true;
+}
+
+inline void onBlock(FwTransferContext &ctx, BleSyncContext &link, const uint8_t *data, size_t len) {
+  if (len < offsetof(FwBlockPacket, data) || len > sizeof(FwBlockPacket)) return;
+  FwBlockPacket pkt;
+  memcpy(&pkt, data, len);
+  if (pkt.image != imageTag(ctx.sha256) || len != offsetof(FwBlockPacket, data) + pkt.len) return;
+  if (pkt.offset % FW_BLOCK_BYTES != 0 || pkt.offset >= ctx.size ||
+      pkt.len != std::min((uint32_t)FW_BLOCK_BYTES, ctx.size - pkt.offset)) {
+    return;
+  }
+  if (blockCrc(pkt) != pkt.crc) return;  // corrupt; it's reported missing at the next poll
+
+  uint32_t block = pkt.offset / FW_BLOCK_BYTES;
+  if (!inWindow(block, nextBlock(ctx), blockCount(ctx.size))) return;  // have it, or too far ahead
+  uint32_t slot = block % FW_NACK_BLOCKS;
+  memcpy(ctx.window + slot * FW_BLOCK_BYTES, pkt.data, pkt.len);
+  setBit(ctx.have, slot, true);
+
+  if (!drain(ctx)) {
+    fail(ctx, link, "flash write");
+    return;
+  }
+  if (OtaPartition::committed(ctx.writer) - ctx.saved >= OTA_PROGRESS_BYTES) {
+    ctx.saved = OtaPartition::committed(ctx.writer);
+    OTA::saveProgress(ctx.id, ctx.writer.part, ctx.saved);
+  }
+  if (received(ctx) >= ctx.size) {
+    if (!OtaPartition::flush(ctx.writer)) {
+      fail(ctx, link, "flash write");
+      return;
+    }
+    ctx.state = FW_VERIFYING;
+  }
+}
+
+// Answer a poll with the blocks of its window we can take and lack
+inline void onPoll(FwTransferContext &ctx, BleSyncContext &link, const uint8_t *data, size_t len) {
+  if (len != sizeof(FwPollPacket)) return;
+  FwPollPacket poll;
+  memcpy(&poll, data, sizeof(poll));
+  if (poll.image != imageTag(ctx.sha256)) return;
+  if (ctx.state == FW_INSTALLED) {
+    reply(ctx, link, MSG_FW_ACK, FW_DONE);  // in case the first one was lost
+    return;
+  }
+
+  FwNackPacket nack;
+  memset(&nack, 0, sizeof(nack));
+  nack.type = MSG_FW_NACK;
+  nack.image = poll.image;
+  nack.base = poll.base;
+  uint32_t total = blockCount(ctx.size);
+  nack.next = ctx.state == FW_RECEIVING ? nextBlock(ctx) : total;
+  for (uint32_t i = 0; i < FW_NACK_BLOCKS; i++) {
+    uint32_t block = poll.base + i;
+    bool wanted = inWindow(block, nack.next, total) && !bit(ctx.have, block % FW_NACK_BLOCKS);
+    setBit(nack.missing, i, wanted);
+  }
+  BleSync::send(link, (uint8_t *)&nack, sizeof(nack));
+}
+
+// Caller holds ctx.lock
+inline void handleFrame(FwTransferContext &ctx, BleSyncContext &link, const uint8_t *data, size_t len, bool canStart) {
+
+  if (data[0] == MSG_FW_BLOCK) {
+    if (ctx.state == FW_RECEIVING) onBlock(ctx, link, data, len);
+    return;
+  }
+  if (data[0] == MSG_FW_POLL) {
+    if (ctx.state != FW_IDLE) onPoll(ctx, link, data, len);
+    return;
+  }
+  if (data[0] != MSG_FW_OFFER || len != sizeof(FwOfferPacket)) return;
+
+  FwOfferPacket offer;
+  memcpy(&offer, data, sizeof(offer));
+  bool same = ctx.state != FW_IDLE && memcmp(offer.sha256, ctx.sha256, 32) == 0;
+  if (ctx.state == FW_INSTALLED) {
+    if (same) reply(ctx, link, MSG_FW_ACK, FW_DONE);
+    return;
+  }
+  if (ctx.state == FW_VERIFYING || offer.version <= FW_VERSION) return;
+  if (same) {
+    reply(ctx, link, MSG_FW_REQUEST, FW_OK);  // the controller may have lost track of us
+  } else if (canStart) {
+    start(ctx, link, offer);
+  }
+}
+
+// An OFFER, BLOCK or POLL, on the sync task. Flash writes stall for a
+// sector erase now and then, so the caller doesn't hold syncLock; ctx.lock
+// keeps update() out instead. canStart is false while the slot is taken by
+// a WiFi update.
+inline void onFrame(FwTransferContext &ctx, BleSyncContext &link, const uint8_t *data, size_t len, bool canStart) {
+  if (len == 0 || !ctx.lock) return;
+  xSemaphoreTake(ctx.lock, portMAX_DELAY);
+  handleFrame(ctx, link, data, len, canStart);
+  xSemaphoreGive(ctx.lock);
+}
+
+// Caller holds ctx.lock
+inline void finish(FwTransferContext &ctx, BleSyncContext &link, bool digestOk) {
+  if (!digestOk) {
+    fail(ctx, link, "SHA-256 mismatch");
+    return;
+  }
+  OTA::clearProgress();
+  if (!OtaPartition::activate(ctx.writer.part)) {
+    fail(ctx, link, "image rejected by the bootloader check");
+    return;
+  }
+  Serial.printf("[FW] v%u verified, runs after the next restart\n", ctx.version);
+  ctx.state = FW_INSTALLED;
+  OTA::background().updateInstalled = true;
+  reply(ctx, link, MSG_FW_ACK, FW_DONE);
+}
+
+// From loop(): check a complete image and set it to boot. The digest
+// takes a while, so it runs without ctx.lock; while FW_VERIFYING,
+// handleFrame() leaves the image and the writer alone.
+inline void update(FwTransferContext &ctx, BleSyncContext &link) {
+  if (ctx.state != FW_VERIFYING || !ctx.lock) return;
+
+  xSemaphoreTake(ctx.lock, portMAX_DELAY);
+  release(ctx);
+  xSemaphoreGive(ctx.lock);
+  uint8_t digest[32];
+  bool digestOk = OtaPartition::sha256(ctx.writer.part, ctx.size, digest) && memcmp(digest, ctx.sha256, 32) == 0;
+  xSemaphoreTake(ctx.lock, portMAX_DELAY);
+  finish(ctx, link, digestOk);
+  xSemaphoreGive(ctx.lock);
+}
+
+// Nothing received or pending, so the slot is free for a WiFi update
+inline bool idle(const FwTransferContext &ctx) {
+  return ctx.state == FW_IDLE;
+}
+#endif
+
+} // namespace FwTransfer
+
+#endif // FW_TRANSFER_H
@@ -0,0 +1,184 @@
+// Runtime counters and histograms, queried over Serial or the iPhone UART
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+
+// Always built in: an update is one relaxed atomic add, cheap enough for
+// the radio and edge timer tasks. Histograms use fixed microsecond buckets
+// so they need no allocation and can be read while they're being filled.
+
+enum MetricCounter : uint8_t {
+  METRIC_PACKETS_SENT,
+  METRIC_SEND_FAILURES,     // the transport refused a frame
+  METRIC_PACKETS_RECEIVED,
+  METRIC_RX_DROPPED,        // receive ring full or frame too large
+  METRIC_ACK_TIMEOUTS,      // controller: a cycle started before a node acknowledged it
+  METRIC_RECONNECTS,        // controller: a node came back after timing out
+  METRIC_LINKS_LOST,        // controller: a node went quiet for SYNC_NODE_TIMEOUT_MS
+  METRIC_TRANSPORT_SWITCHES, // controller: moved between ESP-NOW and BLE
+  METRIC_QUEUE_OVERRUNS,    // node: cycle arrived with the queue full
+  METRIC_LATE_CYCLES,       // node: cycle arrived or came up for playback after its start
+  METRIC_ESPNOW_RETRIES,    // ESP-NOW: unicast frames resent after the peer didn't acknowledge them
+  METRIC_ESPNOW_UNDELIVERED, // ESP-NOW: unicast frames still unacknowledged after SYNC_ESPNOW_RETRIES
+  METRIC_PULSES_SKIPPED,    // pulses dropped because their OFF edge was already due when the ON edge fired
+  METRIC_COUNTER_COUNT
+};
+
+enum MetricHistogram : uint8_t {
+  METRIC_RTT,               // controller: ping round trip, per node
+  METRIC_OFFSET,            // node: size of each clock correction to playback
+  METRIC_EDGE_LATENESS,     // pulse edge written vs due
+  METRIC_LOOP_TIME,         // one pass of loop()
+  METRIC_ESPNOW_DELIVERY,   // ESP-NOW unicast: send to the peer's acknowledgement, resends included
+  METRIC_HISTOGRAM_COUNT
+};
+
+// Upper bounds (us) of all but the last bucket, which takes the rest
+static constexpr uint32_t METRIC_BUCKETS_US[] = {50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000};
+static constexpr uint8_t METRIC_BUCKETS = sizeof(METRIC_BUCKETS_US) / sizeof(METRIC_BUCKETS_US[0]) + 1;
+
+struct MetricHistogramData {
+  std::atomic<uint32_t> buckets[METRIC_BUCKETS];
+  std::atomic<uint32_t> count;
+  std::atomic<uint32_t> max;
+  std::atomic<uint64_t> sum;
+};
+
+struct MetricsContext {
+  std::atomic<uint32_t> counters[METRIC_COUNTER_COUNT];
+  MetricHistogramData histograms[METRIC_HISTOGRAM_COUNT];
+  uint32_t sinceMs = 0;     // millis() at the last reset
+};
+
+typedef void (*MetricsWriter)(const char *line);
+
+namespace Metrics {
+
+// Zero-initialised static storage, shared by every translation unit
+inline MetricsContext &context() {
+  static MetricsContext ctx;
+  return ctx;
+}
+
+inline void count(MetricCounter c, uint32_t n = 1) {
+  context().counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void observe(MetricHistogram h, int64_t valueUs) {
+  uint32_t v = valueUs < 0 ? 0 : (valueUs > (int64_t)UINT32_MAX ? UINT32_MAX : (uint32_t)valueUs);
+  MetricHistogramData &d = context().histograms[h];
+  uint8_t b = 0;
+  while (b < METRIC_BUCKETS - 1 && v > METRIC_BUCKETS_US[b]) b++;
+  d.buckets[b].fetch_add(1, std::memory_order_relaxed);
+  d.count.fetch_add(1, std::memory_order_relaxed);
+  d.sum.fetch_add(v, std::memory_order_relaxed);
+  uint32_t prev = d.max.load(std::memory_order_relaxed);
+  while (v > prev && !d.max.compare_exchange_weak(prev, v, std::memory_order_relaxed)) {
+  }
+}
+
+inline uint32_t counter(MetricCounter c) {
+  return context().counters[c].load(std::memory_order_relaxed);
+}
+
+// Upper bound of the bucket holding quantile q; the max for the last one
+inline uint32_t quantile(MetricHistogram h, float q) {
+  const MetricHistogramData &d = context().histograms[h];
+  uint32_t total = d.count.load(std::memory_order_relaxed);
+  if (total == 0) return 0;
+  uint32_t rank = (uint32_t)ceilf(q * (float)total);
+  uint32_t seen = 0;
+  for (uint8_t b = 0; b < METRIC_BUCKETS - 1; b++) {
+    seen += d.buckets[b].load(std::memory_order_relaxed);
+    if (seen >= rank) return METRIC_BUCKETS_US[b];
+  }
+  return d.max.load(std::memory_order_relaxed);
+}
+
+inline const char *counterName(uint8_t c) {
+  static const char *const names[METRIC_COUNTER_COUNT] = {
+    "packets_sent", "send_failures", "packets_received", "rx_dropped", "ack_timeouts",
+    "reconnects", "links_lost", "transport_switches", "queue_overruns", "late_cycles",
+    "espnow_retries", "espnow_undelivered", "pulses_skipped"};
+  return c < METRIC_COUNTER_COUNT ? names[c] : "?";
+}
+
+inline const char *histogramName(uint8_t h) {
+  static const char *const names[METRIC_HISTOGRAM_COUNT] = {
+    "rtt_us", "offset_us", "edge_late_us", "loop_us", "espnow_tx_us"};
+  return h < METRIC_HISTOGRAM_COUNT ? names[h] : "?";
+}
+
+inline void reset() {
+  MetricsContext &ctx = context();
+  for (uint8_t c = 0; c < METRIC_COUNTER_COUNT; c++) ctx.counters[c].store(0, std::memory_order_relaxed);
+  for (uint8_t h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+    MetricHistogramData &d = ctx.histograms[h];
+    for (uint8_t b = 0; b < METRIC_BUCKETS; b++) d.buckets[b].store(0, std::memory_order_relaxed);
+    d.count.store(0, std::memory_order_relaxed);
+    d.max.store(0, std::memory_order_relaxed);
+    d.sum.store(0, std::memory_order_relaxed);
+  }
+  ctx.sinceMs = millis();
+}
+
+// Everything, one line per metric:
+//   B,<bucket upper bounds>
+//   C,<name>,<value>
+//   H,<name>,<count>,<mean>,<max>,<bucket counts>
+inline void dump(MetricsWriter out) {
+  MetricsContext &ctx = context();
+  char line[160];
+  int n = snprintf(line, sizeof(line), "B");
+  for (uint8_t b = 0; b < METRIC_BUCKETS - 1; b++) {
+    n += snprintf(line + n, sizeof(line) - n, ",%u", (unsigned)METRIC_BUCKETS_US[b]);
+  }
+  snprintf(line + n, sizeof(line) - n, ",inf\n");
+  out(line);
+
+  for (uint8_t c = 0; c < METRIC_COUNTER_COUNT; c++) {
+    snprintf(line, sizeof(line), "C,%s,%u\n", counterName(c), (unsigned)counter((MetricCounter)c));
+    out(line);
+  }
+  for (uint8_t h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+    const MetricHistogramData &d = ctx.histograms[h];
+    uint32_t total = d.count.load(std::memory_order_relaxed);
+    uint64_t sum = d.sum.load(std::memory_order_relaxed);
+    n = snprintf(line, sizeof(line), "H,%s,%u,%u,%u", histogramName(h), (unsigned)total,
+                 (unsigned)(total ? sum / total : 0), (unsigned)d.max.load(std::memory_order_relaxed));
+    for (uint8_t b = 0; b < METRIC_BUCKETS && n < (int)sizeof(line); b++) {
+      n += snprintf(line + n, sizeof(line) - n, ",%u", (unsigned)d.buckets[b].load(std::memory_order_relaxed));
+    }
+    if (n < (int)sizeof(line) - 1) {
+      line[n++] = '\n';
+      line[n] = 0;
+    }
+    out(line);
+  }
+}
+
+// Link quality in one short line, small enough to poll from a phone:
+//   LINK,<seconds>,<sent>,<received>,<dropped>,<ack timeouts>,
+//        <rtt p50>,<rtt p99>,<offset p99>,<edge late p99>,<loop p99>
+inline void summary(MetricsWriter out) {
+  char line[128];
+  snprintf(line, sizeof(line), "LINK,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+           (unsigned)((millis() - context().sinceMs) / 1000),
+           (unsigned)counter(METRIC_PACKETS_SENT),
+           (unsigned)counter(METRIC_PACKETS_RECEIVED),
+           (unsigned)counter(METRIC_RX_DROPPED),
+           (unsigned)counter(METRIC_ACK_TIMEOUTS),
+           (unsigned)quantile(METRIC_RTT, 0.5f),
+           (unsigned)quantile(METRIC_RTT, 0.99f),
+           (unsigned)quantile(METRIC_OFFSET, 0.99f),
+           (unsigned)quantile(METRIC_EDGE_LATENESS, 0.99f),
+           (unsigned)quantile(METRIC_LOOP_TIME, 0.99f));
+  out(line);
+}
+
+} // namespace Metrics
+
+#endif // METRICS_H
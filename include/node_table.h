@@ -0,0 +1,180 @@
+// Controller-side table of the nodes it drives
+#ifndef NODE_TABLE_H
+#define NODE_TABLE_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "ble_sync.h"
+#include "clock_sync.h"
+#include "metrics.h"
+
+// The controller sends every ping and schedule once, to all nodes, and
+// sorts the replies out here by sender address. Each node keeps its own
+// clock fit, round trip estimate and loss counters.
+
+struct NodeInfo {
+  uint8_t  addr[SYNC_ADDR_LEN];
+  bool     used = false;
+  bool     active = false;        // heard from within SYNC_NODE_TIMEOUT_MS
+  uint32_t lastSeenMs = 0;
+  ClockSyncContext clock;         // node clock vs controller
+  uint32_t rttUs = 0;             // smoothed round trip, minus node turnaround
+  uint8_t  lastPingSeq = 0;       // last ping this node answered
+  uint64_t lastPingT4 = 0;        // when that answer arrived (0 = none yet)
+  uint64_t lastAckedStartUs = 0;  // latest cycle start the node acknowledged
+  uint32_t lastAckedIndex = 0;    // and its sequence number (0 = unknown)
+  uint32_t pingsSent = 0;
+  uint32_t pingsAnswered = 0;
+  uint32_t syncAcks = 0;
+  uint32_t cyclesMissed = 0;      // cycles that started before the node acknowledged them
+};
+
+struct NodeTableContext {
+  NodeInfo nodes[SYNC_MAX_NODES];
+};
+
+namespace NodeTable {
+
+inline NodeInfo *find(NodeTableContext &ctx, const uint8_t *addr) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    NodeInfo &n = ctx.nodes[i];
+    if (n.used && memcmp(n.addr, addr, SYNC_ADDR_LEN) == 0) return &n;
+  }
+  return nullptr;
+}
+
+// Look up the sender of a reply, adding it if new. A returning node keeps
+// its stats; a new one takes a free slot or the longest-silent inactive
+// one. Returns nullptr if every slot holds an active node.
+inline NodeInfo *add(NodeTableContext &ctx, const uint8_t *addr, uint32_t nowMs, bool &isNew) {
+  isNew = false;
+  NodeInfo *n = find(ctx, addr);
+  bool returning = n != nullptr;
+  if (!n) {
+    for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+      NodeInfo &c = ctx.nodes[i];
+      if (c.active) continue;
+      if (!c.used) { n = &c; break; }
+      if (!n || (nowMs - c.lastSeenMs) > (nowMs - n->lastSeenMs)) n = &c;
+    }
+    if (!n) return nullptr;
+    *n = NodeInfo();
+    memcpy(n->addr, addr, SYNC_ADDR_LEN);
+    n->used = true;
+  }
+  if (!n->active) {
+    if (returning) Metrics::count(METRIC_RECONNECTS);
+    // Clock and ping state don't survive a gap; restart the fit
+    ClockSync::reset(n->clock);
+    n->lastPingT4 = 0;
+    n->active = true;
+    isNew = true;
+  }
+  n->lastSeenMs = nowMs;
+  return n;
+}
+
+inline uint8_t activeCount(const NodeTableContext &ctx) {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.nodes[i].active) count++;
+  }
+  return count;
+}
+
+// Mark nodes that went quiet as gone so they stop holding the ping rate up
+inline void expire(NodeTableContext &ctx, uint32_t nowMs) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    NodeInfo &n = ctx.nodes[i];
+    if (n.active && nowMs - n.lastSeenMs > SYNC_NODE_TIMEOUT_MS) {
+      n.active = false;
+      Metrics::count(METRIC_LINKS_LOST);
+      Serial.printf("[Nodes] %02X:%02X:%02X:%02X:%02X:%02X timed out\n",
+                    n.addr[0], n.addr[1], n.addr[2], n.addr[3], n.addr[4], n.addr[5]);
+    }
+  }
+}
+
+// Fill the t4 reports of the next ping, one per node that answered
+inline void fillPingReports(const NodeTableContext &ctx, TimePingPacket &ping) {
+  ping.count = 0;
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const NodeInfo &n = ctx.nodes[i];
+    if (!n.active || n.lastPingT4 == 0) continue;
+    PingReport &r = ping.prev[ping.count++];
+    memcpy(r.addr, n.addr, SYNC_ADDR_LEN);
+    r.seq = n.lastPingSeq;
+    r.t4_us = n.lastPingT4;
+  }
+}
+
+inline void onPingSent(NodeTableContext &ctx) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    if (ctx.nodes[i].active) ctx.nodes[i].pingsSent++;
+  }
+}
+
+inline void onTimeAck(NodeInfo &n, uint8_t seq, uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+  // The node completes this exchange when the next ping reports t4
+  n.lastPingSeq = seq;
+  n.lastPingT4 = t4;
+  n.pingsAnswered++;
+
+  int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+  if (delay >= 0) {
+    Metrics::observe(METRIC_RTT, delay);
+    n.rttUs = n.rttUs == 0 ? (uint32_t)delay : (uint32_t)((n.rttUs * 7 + (uint64_t)delay) / 8);
+  }
+  ClockSync::addSample(n.clock, t1, t2, t3, t4);
+}
+
+inline void onSyncAck(NodeInfo &n, uint64_t startTimeUs, uint32_t index) {
+  n.syncAcks++;
+  if (startTimeUs > n.lastAckedStartUs) {
+    n.lastAckedStartUs = startTimeUs;
+    if (index != 0) n.lastAckedIndex = index;
+  }
+}
+
+// A cycle starting now was only played by the nodes that had acknowledged it
+inline void onCycleStarted(NodeTableContext &ctx, uint64_t startTimeUs) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    NodeInfo &n = ctx.nodes[i];
+    if (n.active && n.lastAckedStartUs < startTimeUs) {
+      n.cyclesMissed++;
+      Metrics::count(METRIC_ACK_TIMEOUTS);
+    }
+  }
+}
+
+// Fast pings until every node's fit has locked on
+inline uint32_t pingIntervalMs(const NodeTableContext &ctx) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const NodeInfo &n = ctx.nodes[i];
+    if (n.active && !ClockSync::isLocked(n.clock)) return TIME_SYNC_INTERVAL_MS;
+  }
+  return activeCount(ctx) > 0 ? TIME_SYNC_INTERVAL_LOCKED_MS : TIME_SYNC_INTERVAL_MS;
+}
+
+inline void print(const NodeTableContext &ctx) {
+  for (uint8_t i = 0; i < SYNC_MAX_NODES; i++) {
+    const NodeInfo &n = ctx.nodes[i];
+    if (!n.used) continue;
+    uint32_t outstanding = n.pingsSent > n.pingsAnswered ? n.pingsSent - n.pingsAnswered : 0;
+    Serial.printf("[Nodes] %02X:%02X:%02X:%02X:%02X:%02X %s rtt: %u us, offset: %ld us, drift: %.2f ppm, "
+                  "acked: #%u, pings lost: %u/%u, cycles missed: %u\n",
+                  n.addr[0], n.addr[1], n.addr[2], n.addr[3], n.addr[4], n.addr[5],
+                  n.active ? "up" : "gone",
+                  (unsigned)n.rttUs,
+                  (long)n.clock.offsetUs,
+                  ClockSync::skewPpm(n.clock),
+                  (unsigned)n.lastAckedIndex,
+                  (unsigned)outstanding,
+                  (unsigned)n.pingsSent,
+                  (unsigned)n.cyclesMissed);
+  }
+}
+
+} // namespace NodeTable
+
+#endif // NODE_TABLE_H
@@ -12,38 +12,152 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <HTTPClient.h>
-#include <Update.h>
 #include <ArduinoJson.h>
+#include <Preferences.h>
+#include <esp_wifi.h>
 #include "config.h"
+#include "ota_delta.h"
+#include "ota_partition.h"
 
 namespace OTA {
 
   // ---- Forward declarations ----
   struct Status;
+  struct NodeImage;
   
   const char* cmco_password = "cmco123456789!";
 
   inline bool connectWiFi(uint32_t timeoutMs = 10000);
-  inline Status fetchOtaStatus(uint32_t timeoutMs = 5000);
+  inline Status fetchOtaStatus(uint32_t timeoutMs = 5000, Status *node = nullptr);
   inline bool checkForUpdate(Status payload);
-  inline bool performOTA(const String& firmwareURL);
-  void otaCheck();
+  inline bool performOTA(const Status &status, bool activate = true);
+  inline bool performDeltaOTA(const Status &status);
+  void otaCheck(bool restartOnUpdate = true);
+  inline bool loadNodeImage(NodeImage &image);
+  inline void updateNodeImage(const Status &node);
 
   // ---- OTA status struct ----
   struct Status {
     bool valid = false;
     String version;
     String firmwareUrl;
+    String sha256;        // hex digest of the image; optional
+    uint32_t size = 0;    // image bytes; optional, else learned from the download
+    String patchUrl;      // delta from patchFrom to this version; optional
+    int patchFrom = -1;
   };
 
+  // Boot policy, kept in NVS: how many boots since the last check and the
+  // access point that last worked, so the next check can skip the scan.
+  static constexpr char NVS_NAMESPACE[] = "ota";
+
+  struct SavedAp {
+    bool valid = false;
+    String ssid;
+    uint8_t bssid[6] = {0};
+    int32_t channel = 0;
+    bool secured = false;
+  };
+
+  struct BackgroundState {
+    TaskHandle_t task = nullptr;
+    bool check = false;                     // run otaCheck(), not just the slot scan
+    volatile bool done = false;
+    volatile bool updateInstalled = false;  // flashed; runs after the next restart
+  };
+
+  inline BackgroundState &background() {
+    static BackgroundState state;
+    return state;
+  }
+
+  // Node firmware a controller keeps in its inactive slot and passes on to
+  // the nodes over the sync link (fw_transfer.h). Set by the background
+  // task, only once the slot has been hashed and matches.
+  struct NodeImage {
+    bool valid = false;
+    uint8_t version = 0;
+    uint32_t size = 0;
+    uint8_t sha256[32] = {0};
+    const esp_partition_t *part = nullptr;
+  };
+
+  inline NodeImage &nodeImage() {
+    static NodeImage image;
+    return image;
+  }
+
   // -------- WiFi --------
 
+  inline bool waitConnected(uint32_t timeoutMs)
+  {
+    unsigned long start = millis();
+    while (WiFi.status() != WL_CONNECTED && millis() - start < timeoutMs) {
+      delay(250);
+      Serial.print(".");
+    }
+    Serial.println();
+    return WiFi.status() == WL_CONNECTED;
+  }
+
+  inline SavedAp loadAp()
+  {
+    SavedAp ap;
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, true)) return ap;
+    ap.ssid = prefs.getString("ssid", "");
+    ap.valid = !ap.ssid.isEmpty() && prefs.getBytes("bssid", ap.bssid, sizeof(ap.bssid)) == sizeof(ap.bssid);
+    ap.channel = prefs.getInt("channel", 0);
+    ap.secured = prefs.getBool("secured", false);
+    prefs.end();
+    return ap;
+  }
+
+  inline void saveAp(bool secured)
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false)) return;
+    prefs.putString("ssid", WiFi.SSID());
+    prefs.putBytes("bssid", WiFi.BSSID(), 6);
+    prefs.putInt("channel", WiFi.channel());
+    prefs.putBool("secured", secured);
+    prefs.end();
+  }
+
+  // ESP-NOW's channel: the remembered access point's, so that joining it
+  // for a check, even in the background mid-sync, doesn't move the radio
+  inline uint8_t espNowChannel()
+  {
+    SavedAp ap = loadAp();
+    if (ap.valid && ap.channel >= 1 && ap.channel <= SYNC_ESPNOW_MAX_CHANNEL) return (uint8_t)ap.channel;
+    return SYNC_ESPNOW_CHANNEL;
+  }
+
+  // Straight to the remembered access point on its channel, no scan
+  inline bool connectSavedWifi()
+  {
+    SavedAp ap = loadAp();
+    if (!ap.valid) return false;
+
+    Serial.printf("Trying last network: %s (ch %d)\n", ap.ssid.c_str(), (int)ap.channel);
+    WiFi.begin(ap.ssid.c_str(), ap.secured ? cmco_password : nullptr, ap.channel, ap.bssid, true);
+    if (waitConnected(OTA_FAST_CONNECT_MS)) {
+      Serial.printf("Connected to %s, IP: %s\n", ap.ssid.c_str(), WiFi.localIP().toString().c_str());
+      return true;
+    }
+    Serial.println("Last network unavailable, scanning");
+    WiFi.disconnect();
+    return false;
+  }
+
   inline bool connectAnyWifi()
   {
     WiFi.mode(WIFI_STA);
-    WiFi.disconnect(true);
+    WiFi.disconnect();  // not (true): that turns off the radio ESP-NOW runs on
     delay(500);
 
+    if (connectSavedWifi()) return true;
+
     int n = WiFi.scanNetworks();
     Serial.printf("Found %d networks\n", n);
 
@@ -58,17 +172,11 @@ namespace OTA {
         Serial.printf("Trying open network: %s\n", ssid.c_str());
 
         WiFi.begin(ssid.c_str());
-        unsigned long start = millis();
-        while (WiFi.status() != WL_CONNECTED && millis() - start < 8000) {
-          delay(250);
-          Serial.print(".");
-        }
-        Serial.println();
-
-        if (WiFi.status() == WL_CONNECTED) {
+        if (waitConnected(8000)) {
           Serial.printf("Connected to %s, IP: %s\n",
                         ssid.c_str(),
                         WiFi.localIP().toString().c_str());
+          saveAp(false);
           return true;
         } else {
           Serial.println("Failed, moving to next open network");
@@ -84,17 +192,11 @@ namespace OTA {
       if (auth != WIFI_AUTH_OPEN) {
         Serial.printf("Trying secured network: %s (auth:%d)\n", ssid.c_str(), auth);
         WiFi.begin(ssid.c_str(), cmco_password);
-        unsigned long start = millis();
-        while (WiFi.status() != WL_CONNECTED && millis() - start < 10000) {
-          delay(250);
-          Serial.print(".");
-        }
-        Serial.println();
-
-        if (WiFi.status() == WL_CONNECTED) {
+        if (waitConnected(10000)) {
           Serial.printf("Connected to %s, IP: %s\n",
                         ssid.c_str(),
                         WiFi.localIP().toString().c_str());
+          saveAp(true);
           return true;
         } else {
           Serial.println("Failed, moving to next secured network");
@@ -106,50 +208,141 @@ namespace OTA {
     return false;
   }
 
+  // -------- Boot Policy --------
+
+  // Count this boot; true if it's one that should check for updates
+  inline bool bootCheckDue()
+  {
+    if (OTA_CHECK_EVERY_BOOTS == 0) return false;
+
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false)) return true;
+    uint32_t boots = prefs.getUInt("boots", 0) + 1;
+    bool due = boots >= OTA_CHECK_EVERY_BOOTS;
+    prefs.putUInt("boots", due ? 0 : boots);
+    prefs.end();
+
+    if (!due) {
+      Serial.printf("OTA check skipped (%u of %u boots)\n", (unsigned)boots, (unsigned)OTA_CHECK_EVERY_BOOTS);
+    }
+    return due;
+  }
+
   // -------- OTA Boot Check --------
-  void otaCheck()
+  void otaCheck(bool restartOnUpdate)
   {
     Serial.println("\nQT Py ESP32-S3 OTA Boot");
     Serial.printf("Current FW Version: %d\n", FW_VERSION);
 
+    // ESP-NOW shares the station interface; joining an access point moves
+    // it to the AP's channel, so put it back afterwards. On the remembered
+    // AP (espNowChannel()) it doesn't move at all.
+    uint8_t syncChannel = 0;
+    wifi_second_chan_t second;
+    esp_wifi_get_channel(&syncChannel, &second);
+
     if (!OTA::connectAnyWifi()) {
       Serial.println("WiFi unavailable, running current firmware");
-      return;
+    } else {
+      Serial.println("WiFi connected");
+      Serial.println("Checking website for JS-based OTA updates...");
+
+      Status nodeStatus;
+      Status status = OTA::fetchOtaStatus(5000, &nodeStatus);
+
+      if (!status.valid) {
+        Serial.println("Status fetch failed");
+      } else {
+        Serial.println("Status OK");
+        Serial.println(status.version);
+        Serial.println(status.firmwareUrl);
+
+        if (OTA::checkForUpdate(status)) {
+          Serial.println("New firmware available");
+          // A patch from this exact version is a fraction of the image;
+          // fall back to the full download if it can't be used
+          bool updated = false;
+          if (!status.patchUrl.isEmpty() && status.patchFrom == FW_VERSION) {
+            updated = OTA::performDeltaOTA(status);
+          }
+          if (updated || OTA::performOTA(status)) {
+            if (restartOnUpdate) {
+              Serial.println("OTA success, rebooting...");
+              delay(100);
+              ESP.restart();
+            }
+            Serial.println("OTA success, new firmware runs after the next restart");
+            background().updateInstalled = true;
+          } else {
+            Serial.println("OTA failed, continuing current firmware");
+          }
+        } else {
+          Serial.println("Firmware up to date");
+          #ifdef CONTROLLER
+          // The slot is free, so it can carry the nodes' firmware
+          OTA::updateNodeImage(nodeStatus);
+          #endif
+        }
+      }
     }
 
-    Serial.println("WiFi connected");
-    Serial.println("Checking website for JS-based OTA updates...");
+    WiFi.disconnect(false);
+    if (syncChannel != 0) esp_wifi_set_channel(syncChannel, WIFI_SECOND_CHAN_NONE);
+  }
 
-    Status status = OTA::fetchOtaStatus();
+  // -------- Background Check --------
 
-    if (!status.valid) {
-      Serial.println("Status fetch failed");
-      return;
-    }
+  inline void backgroundTask(void *)
+  {
+    BackgroundState &state = background();
+    if (state.check) otaCheck(false);
+    #ifdef CONTROLLER
+    // Whatever the check did, see if the slot holds node firmware to hand on
+    NodeImage image;
+    if (!state.updateInstalled && loadNodeImage(image)) nodeImage() = image;
+    #endif
+    state.done = true;
+    vTaskDelete(nullptr);
+  }
 
-    Serial.println("Status OK");
-    Serial.println(status.version);
-    Serial.println(status.firmwareUrl);
+  // Run otaCheck() on its own task so stimulation carries on meanwhile. A
+  // new image is flashed but not booted until the next restart. Once per
+  // boot; a controller starts it even on boots that skip the check, to
+  // load the node image it keeps.
+  inline void startBackgroundCheck(bool check = true)
+  {
+    BackgroundState &state = background();
+    if (state.task) return;
+    state.check = check;
+    Serial.println(check ? "Starting background OTA check" : "Loading stored node firmware");
+    xTaskCreatePinnedToCore(backgroundTask, "ota", OTA_TASK_STACK, nullptr,
+                            OTA_TASK_PRIORITY, &state.task, OTA_TASK_CORE);
+  }
 
-    if (OTA::checkForUpdate(status)) {
-      Serial.println("New firmware available");
-      if (OTA::performOTA(status.firmwareUrl)) {
-        Serial.println("OTA success, rebooting...");
-        delay(100);
-        ESP.restart();
-      } else {
-        Serial.println("OTA failed, continuing current firmware");
-      }
-    } else {
-      Serial.println("Firmware up to date");
-    }
-    
-    WiFi.disconnect(true);
-    WiFi.mode(WIFI_OFF);
+  inline bool backgroundStarted()
+  {
+    return background().task != nullptr;
   }
 
   // -------- Get OTA Status from Web --------
-  inline Status fetchOtaStatus(uint32_t timeoutMs)
+
+  // One role's entry in the manifest
+  template <class Json>
+  inline Status parseStatus(const Json &entry)
+  {
+    Status result;
+    result.valid = true;
+    result.version = entry["version"] | "";
+    result.firmwareUrl = entry["firmwareUrl"] | "";
+    result.sha256 = entry["sha256"] | "";
+    result.size = entry["size"] | 0;
+    result.patchUrl = entry["patchUrl"] | "";
+    result.patchFrom = entry["patchFrom"] | -1;
+    return result;
+  }
+
+  // This role's entry; node, if given, also gets the node entry
+  inline Status fetchOtaStatus(uint32_t timeoutMs, Status *node)
   {
     Status result;
 
@@ -169,7 +362,7 @@ namespace OTA {
       return result;
     }
 
-    StaticJsonDocument<256> doc;
+    StaticJsonDocument<1024> doc;
     DeserializationError err = deserializeJson(doc, https.getStream());
     https.end();
 
@@ -177,11 +370,8 @@ namespace OTA {
       return result;
     }
 
-    result.valid = true;
-    result.version = doc[SYNC_ROLE]["version"] | "";
-    result.firmwareUrl = doc[SYNC_ROLE]["firmwareUrl"] | "";
-
-    return result;
+    if (node) *node = parseStatus(doc["node"]);
+    return parseStatus(doc[SYNC_ROLE]);
   }
 
   // -------- Check Manifest --------
@@ -192,49 +382,351 @@ namespace OTA {
     return (availableVersion > FW_VERSION);
   }
 
+  // -------- Download Progress --------
+
+  // Which image a saved offset belongs to: its digest, or failing that the
+  // version and URL
+  inline String imageId(const Status &status)
+  {
+    if (!status.sha256.isEmpty()) return status.sha256;
+    String id = status.version;
+    id += "@";
+    id += status.firmwareUrl;
+    return id;
+  }
+
+  // Bytes already in the slot from an earlier attempt at the same image
+  inline uint32_t loadProgress(const String &id, const esp_partition_t *part)
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, true)) return 0;
+    bool same = prefs.getString("dl_id", "") == id && prefs.getString("dl_part", "") == part->label;
+    uint32_t offset = same ? prefs.getUInt("dl_off", 0) : 0;
+    prefs.end();
+    return offset;
+  }
+
+  inline void saveProgress(const String &id, const esp_partition_t *part, uint32_t offset)
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false)) return;
+    prefs.putString("dl_id", id);
+    prefs.putString("dl_part", part->label);
+    prefs.putUInt("dl_off", offset);
+    prefs.end();
+  }
+
+  inline void clearProgress()
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false)) return;
+    prefs.remove("dl_id");
+    prefs.remove("dl_part");
+    prefs.remove("dl_off");
+    prefs.end();
+  }
+
+  // -------- Node Image (controller) --------
+
+  // What the inactive slot holds for the nodes, from NVS, not yet checked
+  inline bool readNodeImage(NodeImage &image)
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, true)) return false;
+    image.version = prefs.getUChar("node_ver", 0);
+    image.size = prefs.getUInt("node_size", 0);
+    bool shaOk = prefs.getBytes("node_sha", image.sha256, 32) == 32;
+    String label = prefs.getString("node_part", "");
+    prefs.end();
+    image.part = OtaPartition::target();
+    return image.version > 0 && shaOk && image.part && label == image.part->label &&
+           image.size > 0 && image.size <= image.part->size;
+  }
+
+  inline void saveNodeImage(const NodeImage &image)
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false)) return;
+    prefs.putUChar("node_ver", image.version);
+    prefs.putUInt("node_size", image.size);
+    prefs.putBytes("node_sha", image.sha256, 32);
+    prefs.putString("node_part", image.part->label);
+    prefs.end();
+  }
+
+  inline void forgetNodeImage()
+  {
+    Preferences prefs;
+    if (!prefs.begin(NVS_NAMESPACE, false)) return;
+    prefs.remove("node_ver");
+    prefs.remove("node_size");
+    prefs.remove("node_sha");
+    prefs.remove("node_part");
+    prefs.end();
+  }
+
+  // The stored node image, if the slot still hashes to it. Takes a second
+  // or so for a full image, so it runs on the background task.
+  inline bool loadNodeImage(NodeImage &image)
+  {
+    if (!readNodeImage(image)) return false;
+    uint8_t digest[32];
+    image.valid = OtaPartition::sha256(image.part, image.size, digest) && memcmp(digest, image.sha256, 32) == 0;
+    if (image.valid) {
+      Serial.printf("Node firmware v%u ready to pass on (%u bytes)\n", image.version, (unsigned)image.size);
+    } else {
+      Serial.println("Stored node firmware doesn't match its digest, dropping it");
+      forgetNodeImage();
+    }
+    return image.valid;
+  }
+
+  // Download a newer node image into the inactive slot. The manifest's
+  // node entry needs sha256 and size: the nodes are told both up front.
+  inline void updateNodeImage(const Status &node)
+  {
+    int version = atoi(node.version.c_str());
+    NodeImage image;
+    if (!node.valid || version <= 0 || version > 255 || node.size == 0 ||
+        !OtaPartition::fromHex(node.sha256.c_str(), image.sha256)) {
+      return;
+    }
+    NodeImage stored;
+    if (readNodeImage(stored) && stored.version >= version) return;
+
+    Serial.printf("Downloading node firmware v%d to pass on\n", version);
+    if (!performOTA(node, false)) return;
+    image.version = (uint8_t)version;
+    image.size = node.size;
+    image.part = OtaPartition::target();
+    saveNodeImage(image);
+  }
+
   // -------- Perform OTA --------
-  inline bool performOTA(const String& firmwareURL)
+
+  enum ChunkResult : uint8_t {
+    CHUNK_OK,
+    CHUNK_RETRY,    // network trouble; try again from the last saved sector
+    CHUNK_FAILED,   // the image or the flash is wrong; give up
+  };
+
+  // Total image size from "Content-Range: bytes 0-65535/1048576"
+  inline uint32_t rangeTotal(const String &contentRange)
+  {
+    const char *slash = strchr(contentRange.c_str(), '/');
+    return slash ? (uint32_t)strtoul(slash + 1, nullptr, 10) : 0;
+  }
+
+  // Fetch the next OTA_CHUNK_BYTES with a Range request and write them
+  // after what's in the slot. Learns the image size from the first reply.
+  inline ChunkResult fetchChunk(HTTPClient &http, WiFiClientSecure &client, const String &url,
+                                OtaWriteContext &writer, uint32_t &size, const String &id)
+  {
+    uint32_t from = writer.offset;
+    uint32_t to = from + OTA_CHUNK_BYTES - 1;
+    if (size > 0 && to >= size) to = size - 1;
+
+    if (!http.begin(client, url)) return CHUNK_RETRY;
+    const char *headers[] = {"Content-Range"};
+    http.collectHeaders(headers, 1);
+    char range[40];
+    snprintf(range, sizeof(range), "bytes=%u-%u", (unsigned)from, (unsigned)to);
+    http.addHeader("Range", range);
+
+    int code = http.GET();
+    uint32_t total = 0;
+    if (code == HTTP_CODE_PARTIAL_CONTENT) {
+      total = rangeTotal(http.header("Content-Range"));
+    } else if (code == HTTP_CODE_OK && from == 0) {
+      // Server ignores Range: take the whole image in one go
+      total = http.getSize() > 0 ? (uint32_t)http.getSize() : 0;
+      to = total - 1;
+    } else {
+      Serial.printf("OTA chunk at %u: HTTP %d\n", (unsigned)from, code);
+      http.end();
+      // A server or link error may pass; anything else (a 200 mid-image,
+      // 404, 416) means starting over
+      return code <= 0 || code >= 500 ? CHUNK_RETRY : CHUNK_FAILED;
+    }
+
+    if (total == 0 || total > writer.part->size || (size > 0 && total != size)) {
+      Serial.printf("OTA image size %u doesn't fit or match\n", (unsigned)total);
+      http.end();
+      return CHUNK_FAILED;
+    }
+    size = total;
+    if (to >= size) to = size - 1;
+
+    WiFiClient *stream = http.getStreamPtr();
+    uint8_t buf[1024];
+    uint32_t want = to - from + 1;
+    uint32_t saved = from;
+    while (want > 0) {
+      size_t n = stream->readBytes(buf, std::min((uint32_t)sizeof(buf), want));
+      if (n == 0) break;  // timed out or dropped
+      if (!OtaPartition::write(writer, buf, n)) {
+        Serial.println("OTA flash write failed");
+        http.end();
+        return CHUNK_FAILED;
+      }
+      want -= n;
+      if (OtaPartition::committed(writer) - saved >= OTA_PROGRESS_BYTES) {
+        saved = OtaPartition::committed(writer);
+        saveProgress(id, writer.part, saved);
+      }
+    }
+    http.end();
+    saveProgress(id, writer.part, OtaPartition::committed(writer));
+
+    Serial.printf("OTA %u / %u bytes\n", (unsigned)(writer.offset + writer.fill), (unsigned)size);
+    return want == 0 ? CHUNK_OK : CHUNK_RETRY;
+  }
+
+  // Download the image into the inactive slot in ranged chunks, resuming
+  // from the progress saved in NVS, then check its SHA-256 against the
+  // manifest before marking it bootable
+  inline bool performOTA(const Status &status, bool activate)
   {
+    const esp_partition_t *part = OtaPartition::target();
+    if (!part) {
+      Serial.println("No OTA partition to write");
+      return false;
+    }
+    forgetNodeImage();  // whatever the slot held is about to go
+
+    String id = imageId(status);
+    OtaWriteContext writer;
+    if (!OtaPartition::begin(writer, part, loadProgress(id, part)) &&
+        !OtaPartition::begin(writer, part, 0)) {
+      Serial.println("OTA buffer allocation failed");
+      return false;
+    }
+    if (writer.offset > 0) {
+      Serial.printf("Resuming OTA download at %u bytes\n", (unsigned)writer.offset);
+    }
+
     WiFiClientSecure client;
     client.setInsecure();  // OK for now; pin CA cert later
 
     HTTPClient http;
     http.setTimeout(10000);
+    http.setReuse(true);   // keep the TLS session between chunks
+
+    uint32_t size = status.size;
+    uint8_t failures = 0;
+    ChunkResult result = CHUNK_OK;
+    while (size == 0 || writer.offset < size) {
+      result = fetchChunk(http, client, status.firmwareUrl, writer, size, id);
+      if (result == CHUNK_FAILED) break;
+      if (result == CHUNK_OK) {
+        failures = 0;
+        continue;
+      }
+      if (++failures > OTA_CHUNK_RETRIES) break;
+      // Drop the partial sector and ask again from the last whole one
+      OtaPartition::begin(writer, part, OtaPartition::committed(writer));
+      delay(1000);
+    }
+
+    bool ok = result == CHUNK_OK && OtaPartition::flush(writer);
+    OtaPartition::end(writer);
+    if (result == CHUNK_FAILED) clearProgress();
+    if (!ok) {
+      Serial.println(result == CHUNK_FAILED ? "OTA download failed"
+                                            : "OTA download interrupted, resumes at the next check");
+      return false;
+    }
+
+    if (status.sha256.isEmpty()) {
+      Serial.println("Manifest has no sha256, relying on the image check");
+    } else {
+      uint8_t digest[32];
+      if (!OtaPartition::sha256(part, size, digest) ||
+          !OtaPartition::digestMatches(digest, status.sha256.c_str())) {
+        Serial.println("OTA SHA-256 mismatch, discarding download");
+        clearProgress();
+        return false;
+      }
+      Serial.println("OTA SHA-256 verified");
+    }
+    clearProgress();
+
+    if (activate && !OtaPartition::activate(part)) {
+      Serial.println("OTA image rejected by the bootloader check");
+      return false;
+    }
+    return true;
+  }
+
+  // -------- Perform Delta OTA --------
 
-    Serial.println("http.begin...");
-    if (!http.begin(client, firmwareURL)) return false;
+  // Stream the patch from status.patchUrl and rebuild the new image from
+  // the running one. Not resumable: patches are small enough to refetch.
+  inline bool performDeltaOTA(const Status &status)
+  {
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    const esp_partition_t *part = OtaPartition::target();
+    if (!running || !part) {
+      Serial.println("No OTA partition to write");
+      return false;
+    }
 
-    Serial.println("http.GET...");
+    WiFiClientSecure client;
+    client.setInsecure();  // OK for now; pin CA cert later
+
+    HTTPClient http;
+    http.setTimeout(10000);
+    if (!http.begin(client, status.patchUrl)) return false;
     int code = http.GET();
     if (code != HTTP_CODE_OK) {
+      Serial.printf("OTA patch: HTTP %d\n", code);
       http.end();
       return false;
     }
 
-    int contentLen = http.getSize();
-    Serial.printf("contentLen = %d\n", contentLen);
-
-    if (contentLen <= 0) {
-      Serial.println("Invalid firmware size");
+    WiFiClient &stream = *http.getStreamPtr();
+    OtaDeltaHeader header;
+    if (!OtaDelta::readHeader(stream, header) || header.newSize > part->size) {
+      Serial.println("OTA patch header invalid");
       http.end();
       return false;
     }
-
-    if (!Update.begin(contentLen)) {
-      Serial.printf("Update.begin error: %d\n", Update.getError());
+    if (!OtaDelta::matchesRunning(running, header)) {
+      Serial.println("OTA patch was made from different firmware");
       http.end();
       return false;
     }
 
-    WiFiClient& stream = *http.getStreamPtr();
-    size_t written = Update.writeStream(stream);
-    Serial.printf("written = %u\n", (unsigned)written);
-
-    bool success = Update.end(true);
-    Serial.println("Update.end...");
+    // The slot is about to be overwritten, so a half-done full download
+    // or a node image there is gone
+    clearProgress();
+    forgetNodeImage();
+
+    Serial.printf("Applying OTA patch: %u -> %u bytes\n", (unsigned)header.oldSize, (unsigned)header.newSize);
+    OtaWriteContext writer;
+    bool ok = OtaPartition::begin(writer, part, 0) &&
+              OtaDelta::apply(stream, running, header, writer) &&
+              OtaPartition::flush(writer);
+    OtaPartition::end(writer);
     http.end();
+    if (!ok) {
+      Serial.println("OTA patch failed");
+      return false;
+    }
 
-    return success;
+    uint8_t digest[32];
+    if (!OtaPartition::sha256(part, header.newSize, digest) || memcmp(digest, header.newSha, 32) != 0 ||
+        (!status.sha256.isEmpty() && !OtaPartition::digestMatches(digest, status.sha256.c_str()))) {
+      Serial.println("OTA patched image SHA-256 mismatch");
+      return false;
+    }
+    Serial.println("OTA patched image verified");
+
+    if (!OtaPartition::activate(part)) {
+      Serial.println("OTA image rejected by the bootloader check");
+      return false;
+    }
+    return true;
   }
 
 } // namespace OTA
@@ -0,0 +1,128 @@
+// Delta OTA: rebuild the next image from the running one and a patch
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "ota_partition.h"
+
+// Patches are made on a PC with tools/ota_delta.py (format described there)
+// and streamed straight through: old bytes are read from the running slot,
+// the result goes into the other slot through OtaPartition. No buffer
+// holds more than OTA_DELTA_BUF bytes, so nothing depends on patch size.
+
+static constexpr uint8_t OTA_DELTA_VERSION = 1;
+static constexpr uint16_t OTA_DELTA_BUF = 512;
+
+enum OtaDeltaOp : uint8_t {
+  OTA_DELTA_END = 0,
+  OTA_DELTA_ADD = 1,      // from, len, then (same, diff, diff bytes) runs
+  OTA_DELTA_INSERT = 2,   // len, bytes
+};
+
+struct OtaDeltaHeader {
+  uint32_t oldSize = 0;
+  uint32_t newSize = 0;
+  uint8_t oldSha[32];
+  uint8_t newSha[32];
+};
+
+namespace OtaDelta {
+
+// Reader is anything with readBytes(buf, len) that blocks up to a timeout
+// and returns fewer bytes only on failure (WiFiClient does)
+template <class Reader>
+inline bool readExact(Reader &in, uint8_t *buf, size_t len) {
+  return in.readBytes(buf, len) == len;
+}
+
+template <class Reader>
+inline bool readVarint(Reader &in, uint32_t &value) {
+  value = 0;
+  for (uint8_t shift = 0; shift < 35; shift += 7) {
+    uint8_t b;
+    if (!readExact(in, &b, 1)) return false;
+    value |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+template <class Reader>
+inline bool readHeader(Reader &in, OtaDeltaHeader &h) {
+  uint8_t fixed[13];
+  if (!readExact(in, fixed, sizeof(fixed))) return false;
+  if (memcmp(fixed, "CMDP", 4) != 0 || fixed[4] != OTA_DELTA_VERSION) return false;
+  memcpy(&h.oldSize, fixed + 5, 4);   // little-endian, as is the ESP32
+  memcpy(&h.newSize, fixed + 9, 4);
+  return readExact(in, h.oldSha, 32) && readExact(in, h.newSha, 32);
+}
+
+// True if the running slot holds the image the patch was made from
+inline bool matchesRunning(const esp_partition_t *running, const OtaDeltaHeader &h) {
+  uint8_t digest[32];
+  return running && h.oldSize <= running->size &&
+         OtaPartition::sha256(running, h.oldSize, digest) &&
+         memcmp(digest, h.oldSha, 32) == 0;
+}
+
+// Apply the ops after the header, writing newSize bytes to out
+template <class Reader>
+inline bool apply(Reader &in, const esp_partition_t *old, const OtaDeltaHeader &h, OtaWriteContext &out) {
+  uint8_t buf[OTA_DELTA_BUF];
+  uint8_t oldBuf[OTA_DELTA_BUF];
+  uint32_t produced = 0;
+
+  for (;;) {
+    uint8_t op;
+    if (!readExact(in, &op, 1)) return false;
+
+    if (op == OTA_DELTA_END) return produced == h.newSize;
+
+    if (op == OTA_DELTA_INSERT) {
+      uint32_t len;
+      if (!readVarint(in, len) || len > h.newSize - produced) return false;
+      for (uint32_t left = len; left > 0;) {
+        uint32_t n = std::min(left, (uint32_t)OTA_DELTA_BUF);
+        if (!readExact(in, buf, n) || !OtaPartition::write(out, buf, n)) return false;
+        left -= n;
+      }
+      produced += len;
+      continue;
+    }
+
+    if (op != OTA_DELTA_ADD) return false;
+    uint32_t from, len;
+    if (!readVarint(in, from) || !readVarint(in, len)) return false;
+    if (from > h.oldSize || len > h.oldSize - from || len > h.newSize - produced) return false;
+
+    uint32_t done = 0;
+    while (done < len) {
+      uint32_t same, diff;
+      if (!readVarint(in, same) || !readVarint(in, diff)) return false;
+      if (same > len - done || diff > len - done - same) return false;
+
+      for (uint32_t left = same; left > 0;) {
+        uint32_t n = std::min(left, (uint32_t)OTA_DELTA_BUF);
+        if (esp_partition_read(old, from + done, oldBuf, n) != ESP_OK) return false;
+        if (!OtaPartition::write(out, oldBuf, n)) return false;
+        done += n;
+        left -= n;
+      }
+      for (uint32_t left = diff; left > 0;) {
+        uint32_t n = std::min(left, (uint32_t)OTA_DELTA_BUF);
+        if (esp_partition_read(old, from + done, oldBuf, n) != ESP_OK) return false;
+        if (!readExact(in, buf, n)) return false;
+        for (uint32_t i = 0; i < n; i++) buf[i] += oldBuf[i];
+        if (!OtaPartition::write(out, buf, n)) return false;
+        done += n;
+        left -= n;
+      }
+    }
+    produced += len;
+  }
+}
+
+} // namespace OtaDelta
+
+#endif // OTA_DELTA_H
@@ -0,0 +1,142 @@
+// Writing a firmware image into the inactive OTA slot at any offset
+#ifndef OTA_PARTITION_H
+#define OTA_PARTITION_H
+
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include "config.h"
+
+// Arduino's Update class always starts an image at byte 0. These write the
+// partition directly, a 4 KB flash sector at a time, so a download can pick
+// up at any sector boundary it reached before (a reboot, a lost link) and
+// the image is checked from flash before it is made bootable.
+
+static constexpr uint32_t OTA_SECTOR_BYTES = 4096;
+
+struct OtaWriteContext {
+  const esp_partition_t *part = nullptr;
+  uint32_t offset = 0;          // bytes in flash; a sector multiple until flush()
+  uint8_t *sector = nullptr;    // the sector being filled
+  uint32_t fill = 0;
+};
+
+namespace OtaPartition {
+
+// The slot the next image goes into (app0/app1, whichever isn't running)
+inline const esp_partition_t *target() {
+  return esp_ota_get_next_update_partition(nullptr);
+}
+
+// Start writing at offset, which must be a sector boundary (0 for a fresh
+// image, or where an earlier attempt stopped)
+inline bool begin(OtaWriteContext &ctx, const esp_partition_t *part, uint32_t offset) {
+  if (!part || offset % OTA_SECTOR_BYTES != 0 || offset > part->size) return false;
+  if (!ctx.sector) ctx.sector = (uint8_t *)malloc(OTA_SECTOR_BYTES);
+  if (!ctx.sector) return false;
+  ctx.part = part;
+  ctx.offset = offset;
+  ctx.fill = 0;
+  return true;
+}
+
+inline bool writeSector(OtaWriteContext &ctx, uint32_t len) {
+  if (ctx.offset + OTA_SECTOR_BYTES > ctx.part->size) return false;
+  if (esp_partition_erase_range(ctx.part, ctx.offset, OTA_SECTOR_BYTES) != ESP_OK) return false;
+  if (esp_partition_write(ctx.part, ctx.offset, ctx.sector, len) != ESP_OK) return false;
+  ctx.offset += len;
+  ctx.fill = 0;
+  return true;
+}
+
+inline bool write(OtaWriteContext &ctx, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    uint32_t n = std::min((uint32_t)len, OTA_SECTOR_BYTES - ctx.fill);
+    memcpy(ctx.sector + ctx.fill, data, n);
+    ctx.fill += n;
+    data += n;
+    len -= n;
+    if (ctx.fill == OTA_SECTOR_BYTES && !writeSector(ctx, OTA_SECTOR_BYTES)) return false;
+  }
+  return true;
+}
+
+// Write out a final partial sector; nothing can follow it
+inline bool flush(OtaWriteContext &ctx) {
+  return ctx.fill == 0 || writeSector(ctx, ctx.fill);
+}
+
+// Bytes safely in flash, always a sector boundary: where to resume from
+inline uint32_t committed(const OtaWriteContext &ctx) {
+  return ctx.offset - ctx.offset % OTA_SECTOR_BYTES;
+}
+
+inline void end(OtaWriteContext &ctx) {
+  free(ctx.sector);
+  ctx.sector = nullptr;
+  ctx.fill = 0;
+}
+
+// SHA-256 of the first size bytes of a partition, read back from flash
+inline bool sha256(const esp_partition_t *part, uint32_t size, uint8_t out[32]) {
+  uint8_t *buf = (uint8_t *)malloc(OTA_SECTOR_BYTES);
+  if (!buf) return false;
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  bool ok = mbedtls_sha256_starts_ret(&sha, 0) == 0;
+  for (uint32_t at = 0; ok && at < size; at += OTA_SECTOR_BYTES) {
+    uint32_t n = std::min(OTA_SECTOR_BYTES, size - at);
+    ok = esp_partition_read(part, at, buf, n) == ESP_OK && mbedtls_sha256_update_ret(&sha, buf, n) == 0;
+  }
+  ok = ok && mbedtls_sha256_finish_ret(&sha, out) == 0;
+  mbedtls_sha256_free(&sha);
+  free(buf);
+  return ok;
+}
+
+// Compare against the manifest's hex digest (case-insensitive)
+inline bool digestMatches(const uint8_t digest[32], const char *hex) {
+  if (!hex || strlen(hex) != 64) return false;
+  static const char digits[] = "0123456789abcdef";
+  for (uint8_t i = 0; i < 32; i++) {
+    if (tolower(hex[i * 2]) != digits[digest[i] >> 4]) return false;
+    if (tolower(hex[i * 2 + 1]) != digits[digest[i] & 0x0F]) return false;
+  }
+  return true;
+}
+
+// Lower-case hex of a digest, as the manifest writes it
+inline String toHex(const uint8_t digest[32]) {
+  static const char digits[] = "0123456789abcdef";
+  char hex[65];
+  for (uint8_t i = 0; i < 32; i++) {
+    hex[i * 2] = digits[digest[i] >> 4];
+    hex[i * 2 + 1] = digits[digest[i] & 0x0F];
+  }
+  hex[64] = '\0';
+  return String(hex);
+}
+
+// Hex back to bytes; false unless it's exactly 64 hex digits
+inline bool fromHex(const char *hex, uint8_t digest[32]) {
+  if (!hex || strlen(hex) != 64) return false;
+  for (uint8_t i = 0; i < 64; i++) {
+    char c = tolower(hex[i]);
+    uint8_t v;
+    if (c >= '0' && c <= '9') v = c - '0';
+    else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+    else return false;
+    digest[i / 2] = (i % 2) ? (uint8_t)(digest[i / 2] | v) : (uint8_t)(v << 4);
+  }
+  return true;
+}
+
+// Boot the new image next time; the bootloader validates its header first
+inline bool activate(const esp_partition_t *part) {
+  return esp_ota_set_boot_partition(part) == ESP_OK;
+}
+
+} // namespace OtaPartition
+
+#endif // OTA_PARTITION_H
@@ -0,0 +1,145 @@
+// PWM output layer for the finger actuators
+#ifndef PWM_OUTPUT_H
+#define PWM_OUTPUT_H
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "config.h"
+
+// Each PWM pin is attached to its LEDC channel once at boot. After that a
+// pulse edge is a duty-only write; the LEDC timer is only reprogrammed when
+// a finger is asked for a different frequency than it is currently running.
+
+namespace PwmOutput {
+
+// Who is driving the fingers. Stimulation and tunes both write from the
+// esp_timer task, so ownership changes never race an edge.
+enum class Owner : uint8_t {
+  NONE,
+  TUNE,
+  STIMULATION,
+};
+
+struct EdgeStats {
+  uint32_t edges = 0;      // pulse edges timed
+  uint32_t retimes = 0;    // frequency changes (ledcSetup calls)
+  uint32_t minUs = UINT32_MAX;
+  uint32_t maxUs = 0;
+  uint64_t totalUs = 0;
+};
+
+struct State {
+  uint32_t freq[NUM_FINGERS] = {0};
+  bool ready = false;
+  volatile Owner owner = Owner::NONE;
+  EdgeStats stats;
+};
+
+// Shared by every translation unit (buzzer_tunes.cpp retimes channels too),
+// so keep it in an inline function rather than a per-TU static.
+inline State& state() {
+  static State s;
+  return s;
+}
+
+// Arduino-ESP32 pairs LEDC channels onto timers (channel / 2), so use even
+// channels only to give every finger its own timer and frequency.
+inline uint8_t channelFor(uint8_t index) {
+  return (index * 2) % 16;
+}
+
+inline void begin() {
+  State& s = state();
+  if (s.ready) return;
+
+  for (uint8_t i = 0; i < NUM_FINGERS; i++) {
+    uint8_t channel = channelFor(i);
+    s.freq[i] = ledcSetup(channel, DEFAULT_FREQ, PWM_RESOLUTION) ? (uint32_t)DEFAULT_FREQ : 0;
+    ledcAttachPin(PWM_PINS[i], channel);
+    ledcWrite(channel, DUTYCYCLE_OFF);
+  }
+  s.ready = true;
+}
+
+// Retime a finger's channel only if the frequency actually changed
+inline void setFrequency(uint8_t index, uint32_t freq) {
+  if (index >= NUM_FINGERS || freq == 0) return;
+  State& s = state();
+  if (!s.ready) begin();
+  if (s.freq[index] == freq) return;
+
+  s.freq[index] = ledcSetup(channelFor(index), freq, PWM_RESOLUTION) ? freq : 0;
+  s.stats.retimes++;
+}
+
+inline void setDuty(uint8_t index, uint16_t dutyCycle) {
+  if (index >= NUM_FINGERS) return;
+  if (!state().ready) begin();
+  ledcWrite(channelFor(index), dutyCycle);
+}
+
+// A pulse edge: retime if needed, then duty-only write. The whole edge is
+// timed so the stats reflect what a caller actually pays per edge.
+inline void write(uint8_t index, uint32_t freq, uint16_t dutyCycle) {
+  if (index >= NUM_FINGERS) return;
+
+  int64_t t0 = esp_timer_get_time();
+  if (dutyCycle != DUTYCYCLE_OFF) setFrequency(index, freq);
+  setDuty(index, dutyCycle);
+  uint32_t dt = (uint32_t)(esp_timer_get_time() - t0);
+
+  EdgeStats& st = state().stats;
+  st.edges++;
+  st.totalUs += dt;
+  if (dt < st.minUs) st.minUs = dt;
+  if (dt > st.maxUs) st.maxUs = dt;
+}
+
+// Stimulation always gets the outputs, silencing a tune that was playing;
+// a tune only gets them while nothing else holds them.
+inline bool claim(Owner who) {
+  State& s = state();
+  if (s.owner == who) return true;
+  if (who == Owner::TUNE && s.owner != Owner::NONE) return false;
+  if (s.owner == Owner::TUNE) {
+    for (uint8_t i = 0; i < NUM_FINGERS; i++) setDuty(i, DUTYCYCLE_OFF);
+  }
+  s.owner = who;
+  return true;
+}
+
+inline void release(Owner who) {
+  State& s = state();
+  if (s.owner == who) s.owner = Owner::NONE;
+}
+
+inline Owner owner() {
+  return state().owner;
+}
+
+inline uint32_t frequency(uint8_t index) {
+  return index < NUM_FINGERS ? state().freq[index] : 0;
+}
+
+inline const EdgeStats& edgeStats() {
+  return state().stats;
+}
+
+inline void resetEdgeStats() {
+  state().stats = EdgeStats();
+}
+
+inline void printEdgeStats() {
+  const EdgeStats& st = state().stats;
+  if (st.edges == 0) return;
+  Serial.printf("[PWM] edges: %u, retimes: %u, edge cost us min/avg/max: %u/%u/%u\n",
+                (unsigned)st.edges,
+                (unsigned)st.retimes,
+                (unsigned)st.minUs,
+                (unsigned)(st.totalUs / st.edges),
+                (unsigned)st.maxUs);
+}
+
+} // namespace PwmOutput
+
+#endif // PWM_OUTPUT_H
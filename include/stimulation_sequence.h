@@ -2,7 +2,13 @@
 #define STIMULATION_SEQUENCE_H
 
 #include <Arduino.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "config.h"
+#include "pwm_output.h"
+#include "metrics.h"
+#include "trace.h"
 
 // ---------------- DATA STRUCT ----------------
 
@@ -15,119 +21,472 @@ struct StimulationPeriod {
     float frequency;        // Hz
 };
 
+// ---------------- RNG ----------------
+
+// Bump when buildSequence() or SequenceRng changes what a seed produces
+static constexpr uint8_t SEQUENCE_GENERATOR_VERSION = 1;
+
+// PCG32 (XSH-RR). Self-contained so the controller and node produce the
+// same sequence from the same seed regardless of the core's random().
+class SequenceRng {
+public:
+    explicit SequenceRng(uint32_t seed) {
+        _state = 0;
+        next();
+        _state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = _state;
+        _state = old * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+        uint32_t rot = (uint32_t)(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+    }
+
+    // [0, bound)
+    uint32_t below(uint32_t bound) {
+        return (uint32_t)(((uint64_t)next() * bound) >> 32);
+    }
+
+    // [lo, hi)
+    int32_t range(int32_t lo, int32_t hi) {
+        if (hi <= lo) return lo;
+        return lo + (int32_t)below((uint32_t)(hi - lo));
+    }
+
+private:
+    uint64_t _state;
+};
+
+// ---------------- EDGE SCHEDULE ----------------
+
+// One pulse edge, precomputed as a microsecond offset from sequence start.
+// PERIOD_END marks the end of a period's post-delay so that the period
+// counter advances from the timer rather than from loop().
+enum class EdgeKind : uint8_t { PULSE_ON, PULSE_OFF, PERIOD_END };
+
+struct PulseEdge {
+    uint32_t atUs;      // Offset from sequence start (us)
+    uint8_t  period;    // Index into stimPeriods
+    EdgeKind kind;
+};
+
+static constexpr uint8_t MAX_EDGES = NUM_PERIODS * 3;
+
 // ---------------- CLASS ----------------
 
+// Pulse edges are fired from an esp_timer one-shot chain: each callback
+// fires every edge that is due and re-arms the timer for the next one, so
+// edge timing no longer depends on how often loop() gets around to update().
+// The timer swaps sequences itself, so the periods stay private to it and
+// _lock; other tasks see only the state it publishes under _stateMux.
 class StimulationSequence {
 public:
     StimulationSequence() = default;
 
-    StimulationPeriod stimPeriods[NUM_PERIODS];
-
     void begin(uint32_t seed) {
-        randomSeed(seed);
-        buildSequence();
-        reset();
+        StimulationPeriod periods[NUM_PERIODS];
+        generate(seed, periods);
+        play(periods, esp_timer_get_time());
     }
 
-    void reset() {
-        _currentPeriod = 0;
-        _phase = Phase::PRE_DELAY;
-        _phaseStartMs = millis();
-        clearBuzzers();
+    // Build the sequence for seed into out. Deterministic and independent of
+    // Arduino's random(), so a node can rebuild a sequence from its seed.
+    static void generate(uint32_t seed, StimulationPeriod* out) {
+        SequenceRng rng(seed);
+        buildSequence(rng, out);
     }
 
-    void update() {
-        // Smoothly pull syncOffset toward pendingOffset
-        constexpr float pullRate = 0.02f; // 2% per update
-        syncOffsetUs += (pendingOffsetUs - syncOffsetUs) * pullRate;
+    // Playing time of a sequence, rounded the same way as its edges
+    static uint32_t durationUs(const StimulationPeriod* periods) {
+        uint32_t t = 0;
+        for (uint8_t i = 0; i < NUM_PERIODS; i++) {
+            t += (uint32_t)lroundf(periods[i].preDelayMs * 1000.0f);
+            t += (uint32_t)lroundf(periods[i].pulseWidthMs * 1000.0f);
+            t += (uint32_t)lroundf(periods[i].postDelayMs * 1000.0f);
+        }
+        return t;
+    }
 
-        // Convert syncOffsetUs to milliseconds
-        float syncOffsetMs = syncOffsetUs / 1000.0f;
+    // Hash of everything that shapes generate()'s output. Both sides must
+    // agree on it before a sequence is shipped as a seed.
+    static uint32_t paramHash() {
+        uint32_t h = 2166136261u; // FNV-1a
+        auto mix = [&h](const void* data, size_t len) {
+            const uint8_t* b = (const uint8_t*)data;
+            for (size_t i = 0; i < len; i++) { h ^= b[i]; h *= 16777619u; }
+        };
+        const uint8_t version = SEQUENCE_GENERATOR_VERSION;
+        const float times[] = { TOTAL_TIME_MS, PULSE_WIDTH_MS, MAX_PRE_JITTER_MS, MAX_JITTER_MS,
+                                DEFAULT_FREQ, FREQ_RANDOM_MIN, FREQ_RANDOM_MAX };
+        const uint8_t flags[] = { NUM_PERIODS, NUM_FINGERS, JITTER_ENABLED, FREQ_RANDOM_ENABLED };
+        mix(&version, sizeof(version));
+        mix(times, sizeof(times));
+        mix(flags, sizeof(flags));
+        return h;
+    }
 
-        // Adjust phase start time
-        _phaseStartMs -= (uint32_t)syncOffsetMs;
-        
-        if (_currentPeriod >= NUM_PERIODS) return;
+    // Restart the current stimPeriods from now
+    void reset() {
+        resetAt(esp_timer_get_time());
+    }
 
-        StimulationPeriod& p = stimPeriods[_currentPeriod];
-        uint32_t now = millis();
-        float elapsed = (float)(now - _phaseStartMs);
+    // Restart the current stimPeriods with period 0 starting at startUs
+    // (esp_timer_get_time() timebase). Edges already in the past fire at once.
+    void resetAt(int64_t startUs) {
+        ensureTimer();
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        esp_timer_stop(_timer);
+        silenceAll();
+        _hasQueued = false;
+        startSequence(startUs, 0);
+        armNext();
+        xSemaphoreGive(_lock);
+    }
 
-        switch (_phase) {
+    // Replace the sequence and schedule it in one step, so the timer never
+    // fires an edge of the old schedule against the new periods. Drops
+    // anything queued with queueNext(). tag is caller data (the node uses
+    // the controller-time start) reported back by schedule().
+    void play(const StimulationPeriod* periods, int64_t startUs, int64_t tag = 0) {
+        ensureTimer();
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        esp_timer_stop(_timer);
+        silenceAll();
+        _hasQueued = false;
+        memcpy(stimPeriods, periods, sizeof(stimPeriods));
+        startSequence(startUs, tag);
+        armNext();
+        xSemaphoreGive(_lock);
+    }
 
-        case Phase::PRE_DELAY:
-            if (elapsed >= p.preDelayMs) {
-                startPulse(p);
-                _phase = Phase::PULSE;
-                _phaseStartMs = now;
+    // Hand over the sequence to play after the current one. The timer swaps
+    // it in right after the current sequence's last edge, so back-to-back
+    // sequences don't depend on loop() noticing the boundary. Starts at once
+    // if nothing is playing; returns false if a sequence is already queued.
+    bool queueNext(const StimulationPeriod* periods, int64_t startUs, int64_t tag = 0) {
+        ensureTimer();
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        bool ok = !_hasQueued;
+        if (ok) {
+            memcpy(_queued, periods, sizeof(_queued));
+            _queuedStartUs = startUs;
+            _queuedTag = tag;
+            _hasQueued = true;
+            if (_nextEdge >= _edgeCount) {
+                startQueued();
+                armNext();
             }
-            break;
+        }
+        xSemaphoreGive(_lock);
+        return ok;
+    }
 
-        case Phase::PULSE:
-            if (elapsed >= p.pulseWidthMs) {
-                stopPulse(p);
-                _phase = Phase::POST_DELAY;
-                _phaseStartMs = now;
-            }
-            break;
+    bool hasQueued() const {
+        return _hasQueued;
+    }
 
-        case Phase::POST_DELAY:
-            if (elapsed >= p.postDelayMs) {
-                _currentPeriod++;
-                _phase = Phase::PRE_DELAY;
-                _phaseStartMs = now;
-            }
-            break;
+    // Start time, tag and generation of the sequence currently playing (or
+    // last played), read together so an offset can be posted for that one
+    void schedule(int64_t& startUs, int64_t& tag, uint32_t& generation) {
+        ensureTimer();
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        startUs = _startUs;
+        tag = _tag;
+        generation = _generation;
+        xSemaphoreGive(_lock);
+    }
+
+    // Bumped every time a sequence starts, including timer swaps
+    uint32_t generation() const {
+        return _generation;
+    }
+
+    // Bookkeeping only; edges are driven by the timer. The float offsets
+    // belong to update() alone; other tasks post through setSyncOffset().
+    void update() {
+        // A newly started sequence begins with no offset; a target
+        // posted for an earlier sequence no longer applies
+        portENTER_CRITICAL(&_stateMux);
+        bool stale = _offsetStale;
+        _offsetStale = false;
+        bool posted = _offsetPosted && _postedGeneration == _generation;
+        float targetUs = _postedOffsetUs;
+        _offsetPosted = false;
+        portEXIT_CRITICAL(&_stateMux);
+        if (stale) {
+            syncOffsetUs = 0.0f;
+            pendingOffsetUs = 0.0f;
         }
+        if (posted) {
+            constexpr float MAX_STEP_US = 2000.0f; // clamp extreme corrections
+            float step = targetUs - pendingOffsetUs;
+            if (step > MAX_STEP_US) step = MAX_STEP_US;
+            if (step < -MAX_STEP_US) step = -MAX_STEP_US;
+            pendingOffsetUs += step;
+        }
+
+        // Slew syncOffset toward pendingOffset at a bounded rate, so a
+        // correction takes the same time however often loop() runs
+        int64_t now = esp_timer_get_time();
+        float maxStep = (float)(now - _lastUpdateUs) * SYNC_OFFSET_SLEW;
+        _lastUpdateUs = now;
+
+        float delta = pendingOffsetUs - syncOffsetUs;
+        if (delta > maxStep) delta = maxStep;
+        if (delta < -maxStep) delta = -maxStep;
+        syncOffsetUs += delta;
+
+        // Picked up by the timer when it arms the next edge, unless a
+        // sequence started since the check above
+        portENTER_CRITICAL(&_stateMux);
+        if (!_offsetStale) _appliedOffsetUs = (int32_t)syncOffsetUs;
+        portEXIT_CRITICAL(&_stateMux);
     }
 
     bool isFinished() const {
         return _currentPeriod >= NUM_PERIODS;
     }
 
-    bool isActive() const {
-        return stimPeriods[_currentPeriod].active;
+    // Whether the period playing now has a pulse
+    bool isActive() {
+        portENTER_CRITICAL(&_stateMux);
+        bool active = _periodActive;
+        portEXIT_CRITICAL(&_stateMux);
+        return active;
     }
 
-    void setSyncOffset(float offsetUs) {
-        constexpr float MAX_STEP_US = 2000.0f; // clamp extreme corrections
-
-        float delta = offsetUs - pendingOffsetUs;
-
-        if (delta > MAX_STEP_US) delta = MAX_STEP_US;
-        if (delta < -MAX_STEP_US) delta = -MAX_STEP_US;
+    // Stretch edge offsets by ppm to run at the controller's clock rate
+    void setRateCorrection(float ppm) {
+        _skewPpb = (int32_t)(ppm * 1000.0f);
+    }
 
-        pendingOffsetUs += delta;
+    // Shift the remaining edges of sequence generation by offsetUs,
+    // positive = later. Only posted here; update() picks it up and applies
+    // it gradually. Cleared whenever a sequence is (re)started.
+    void setSyncOffset(float offsetUs, uint32_t generation) {
+        portENTER_CRITICAL(&_stateMux);
+        _postedOffsetUs = offsetUs;
+        _postedGeneration = generation;
+        _offsetPosted = true;
+        portEXIT_CRITICAL(&_stateMux);
     }
 
 
 private:
     // ---------------- INTERNAL ----------------
 
-    enum class Phase { PRE_DELAY, PULSE, POST_DELAY };
+    StimulationPeriod stimPeriods[NUM_PERIODS];  // the playing sequence; under _lock
 
     bool _buzzerStates[NUM_FINGERS] = { false, false, false, false };
 
     float syncOffsetUs = 0.0f;       // current applied offset
     float pendingOffsetUs = 0.0f;    // target offset for smoothing
-    uint8_t  _currentPeriod = 0;
-    Phase    _phase = Phase::PRE_DELAY;
-    uint32_t _phaseStartMs = 0;
+    float _postedOffsetUs = 0.0f;    // latest setSyncOffset(); under _stateMux
+    uint32_t _postedGeneration = 0;
+    bool _offsetPosted = false;
+    volatile int32_t _appliedOffsetUs = 0;
+    volatile int32_t _skewPpb = 0;
+    int64_t  _lastUpdateUs = 0;
+    volatile uint8_t _currentPeriod = NUM_PERIODS;
+    bool _periodActive = false;      // stimPeriods[_currentPeriod].active, for isActive()
+    portMUX_TYPE _stateMux = portMUX_INITIALIZER_UNLOCKED;  // what the timer publishes to other tasks
+
+    PulseEdge _edges[MAX_EDGES];
+    uint8_t   _edgeCount = 0;
+    uint8_t   _nextEdge = 0;
+    int64_t   _startUs = 0;
+    int64_t   _tag = 0;
+    volatile uint32_t _generation = 0;   // bumped under _lock and _stateMux
+    volatile bool _offsetStale = false;
+
+    StimulationPeriod _queued[NUM_PERIODS];
+    int64_t   _queuedStartUs = 0;
+    int64_t   _queuedTag = 0;
+    volatile bool _hasQueued = false;
+
+    esp_timer_handle_t _timer = nullptr;
+    SemaphoreHandle_t  _lock = nullptr;
+
+    // ---------------- EDGE TIMER ----------------
+
+    // Created lazily: the global instance is constructed before the
+    // esp_timer service is guaranteed to be up.
+    void ensureTimer() {
+        if (_timer) return;
+
+        PwmOutput::begin();
+        _lock = xSemaphoreCreateMutex();
+
+        esp_timer_create_args_t args = {};
+        args.callback = &StimulationSequence::onTimer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = "stim_edge";
+        esp_timer_create(&args, &_timer);
+    }
+
+    // Caller holds _lock. Runs on whichever task starts a sequence, so the
+    // float offsets owned by update() are flagged rather than cleared here;
+    // the generation bump drops offsets posted for the old sequence.
+    void clearSyncOffset() {
+        portENTER_CRITICAL(&_stateMux);
+        _appliedOffsetUs = 0;
+        _offsetStale = true;
+        _offsetPosted = false;
+        _generation++;
+        portEXIT_CRITICAL(&_stateMux);
+    }
+
+    static void onTimer(void* arg) {
+        static_cast<StimulationSequence*>(arg)->fireDueEdges();
+    }
+
+    void fireDueEdges() {
+        xSemaphoreTake(_lock, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        for (;;) {
+            int64_t due;
+            while (_nextEdge < _edgeCount && (due = edgeTimeUs(_nextEdge)) <= now) {
+                if (pulseOverdue(_nextEdge, now)) {
+                    Metrics::count(METRIC_PULSES_SKIPPED);
+                    TRACE_EVENT(TRACE_PULSE_SKIPPED, stimPeriods[_edges[_nextEdge].period].fingerIndex,
+                                due, esp_timer_get_time());
+                    _nextEdge += 2;
+                    continue;
+                }
+                PwmOutput::claim(PwmOutput::Owner::STIMULATION);
+                fireEdge(_edges[_nextEdge]);
+                recordEdge(_edges[_nextEdge], due);
+                _nextEdge++;
+            }
+            if (_nextEdge < _edgeCount || !_hasQueued) break;
+            startQueued();
+        }
+        // Tunes may play again once nothing is left to fire
+        if (_nextEdge >= _edgeCount) PwmOutput::release(PwmOutput::Owner::STIMULATION);
+        armNext();
+        xSemaphoreGive(_lock);
+    }
+
+    // Caller holds _lock
+    void startSequence(int64_t startUs, int64_t tag) {
+        buildEdges();
+        _startUs = startUs;
+        _tag = tag;
+        _nextEdge = 0;
+        setPeriod(0);
+        clearSyncOffset();
+        TRACE_EVENT(TRACE_SEQ_START, 0, startUs, esp_timer_get_time());
+    }
+
+    // Caller holds _lock
+    void startQueued() {
+        memcpy(stimPeriods, _queued, sizeof(stimPeriods));
+        _hasQueued = false;
+        buildEdges();
+        _startUs = _queuedStartUs;
+        _tag = _queuedTag;
+        _nextEdge = 0;
+        setPeriod(0);
+        clearSyncOffset();
+        TRACE_EVENT(TRACE_SEQ_START, 1, _startUs, esp_timer_get_time());
+    }
+
+    // Caller holds _lock
+    void setPeriod(uint8_t period) {
+        bool active = period < NUM_PERIODS && stimPeriods[period].active;
+        portENTER_CRITICAL(&_stateMux);
+        _currentPeriod = period;
+        _periodActive = active;
+        portEXIT_CRITICAL(&_stateMux);
+    }
+
+    int64_t edgeTimeUs(uint8_t i) const {
+        int64_t at = _edges[i].atUs;
+        return _startUs + at + (at * _skewPpb) / 1000000000 + _appliedOffsetUs;
+    }
+
+    // Caller holds _lock
+    void armNext() {
+        if (_nextEdge >= _edgeCount) return;
+
+        int64_t wait = edgeTimeUs(_nextEdge) - esp_timer_get_time();
+        if (wait < 0) wait = 0;
+        esp_timer_stop(_timer);
+        esp_timer_start_once(_timer, (uint64_t)wait);
+    }
+
+    // A PULSE_ON whose PULSE_OFF (always the next edge) is already due
+    // would only give a zero-width pulse, e.g. after the timer task stalled
+    // or a negative offset correction
+    bool pulseOverdue(uint8_t i, int64_t now) const {
+        return _edges[i].kind == EdgeKind::PULSE_ON && i + 1 < _edgeCount &&
+               edgeTimeUs(i + 1) <= now;
+    }
+
+    void recordEdge(const PulseEdge& e, int64_t dueUs) {
+        if (e.kind == EdgeKind::PERIOD_END) return;
+        int64_t now = esp_timer_get_time();
+        Metrics::observe(METRIC_EDGE_LATENESS, now - dueUs);
+        TRACE_EVENT(e.kind == EdgeKind::PULSE_ON ? TRACE_PULSE_ON : TRACE_PULSE_OFF,
+                    stimPeriods[e.period].fingerIndex, dueUs, now);
+    }
+
+    void fireEdge(const PulseEdge& e) {
+        const StimulationPeriod& p = stimPeriods[e.period];
+
+        switch (e.kind) {
+        case EdgeKind::PULSE_ON:
+            startPulse(p);
+            break;
+        case EdgeKind::PULSE_OFF:
+            stopPulse(p);
+            break;
+        case EdgeKind::PERIOD_END:
+            setPeriod(e.period + 1);
+            break;
+        }
+    }
+
+    // Absolute edge offsets are accumulated in integer microseconds so the
+    // float period lengths don't add up rounding error across the sequence.
+    void buildEdges() {
+        uint32_t t = 0;
+        _edgeCount = 0;
+
+        for (uint8_t i = 0; i < NUM_PERIODS; i++) {
+            const StimulationPeriod& p = stimPeriods[i];
+            uint32_t pre   = (uint32_t)lroundf(p.preDelayMs * 1000.0f);
+            uint32_t width = (uint32_t)lroundf(p.pulseWidthMs * 1000.0f);
+            uint32_t post  = (uint32_t)lroundf(p.postDelayMs * 1000.0f);
+
+            if (p.active && width > 0) {
+                _edges[_edgeCount++] = { t + pre, i, EdgeKind::PULSE_ON };
+                _edges[_edgeCount++] = { t + pre + width, i, EdgeKind::PULSE_OFF };
+            }
+
+            t += pre + width + post;
+            _edges[_edgeCount++] = { t, i, EdgeKind::PERIOD_END };
+        }
+    }
 
     // ---------------- SEQUENCE BUILD ----------------
 
-    void buildSequence() {
+    static void buildSequence(SequenceRng& rng, StimulationPeriod* out) {
         // ---- ACTIVE PERIODS (0–11) ----
         for (uint8_t group = 0; group < 3; group++) {
             uint8_t fingers[NUM_FINGERS] = {0, 1, 2, 3};
-            shuffle(fingers, NUM_FINGERS);
+            shuffle(rng, fingers, NUM_FINGERS);
 
             for (uint8_t i = 0; i < NUM_FINGERS; i++) {
-                float pre = randomJitter();
-                float freq = randomFreq();
+                float pre = randomJitter(rng);
+                float freq = randomFreq(rng);
                 uint8_t idx = group * NUM_FINGERS + i;
                 
-                stimPeriods[idx] = {
+                out[idx] = {
                     pre,
                     PULSE_WIDTH_MS,
                     MAX_JITTER_MS - pre,
@@ -140,29 +499,30 @@ private:
 
         // ---- INACTIVE PERIODS (12–19) ----
         for (uint8_t i = 12; i < NUM_PERIODS; i++) {
-            stimPeriods[i] = {
+            out[i] = {
                 TOTAL_TIME_MS,
                 0.0f,
                 0.0f,
                 false,
-                (uint8_t)random(NUM_FINGERS)
+                (uint8_t)rng.below(NUM_FINGERS),
+                0.0f
             };
         }
     }
 
-    float randomFreq() {
+    static float randomFreq(SequenceRng& rng) {
         if(!FREQ_RANDOM_ENABLED) return DEFAULT_FREQ;
-        return random(FREQ_RANDOM_MIN, FREQ_RANDOM_MAX + 1);
+        return rng.range(FREQ_RANDOM_MIN, FREQ_RANDOM_MAX + 1);
     }
 
-    float randomJitter() {
+    static float randomJitter(SequenceRng& rng) {
         if(!JITTER_ENABLED) return 0;
-        return random(0, (int)(MAX_PRE_JITTER_MS * 10)) / 10.0f;
+        return rng.range(0, (int32_t)(MAX_PRE_JITTER_MS * 10)) / 10.0f;
     }
 
-    void shuffle(uint8_t* arr, uint8_t size) {
+    static void shuffle(SequenceRng& rng, uint8_t* arr, uint8_t size) {
         for (int i = size - 1; i > 0; i--) {
-            int j = random(i + 1);
+            int j = rng.below(i + 1);
             uint8_t t = arr[i];
             arr[i] = arr[j];
             arr[j] = t;
@@ -170,10 +530,7 @@ private:
     }
 
     void setPWM (int freq, int index, int dutyCycle) {
-        uint8_t channel = index % 16;
-        ledcSetup(channel, freq, PWM_RESOLUTION);
-        ledcAttachPin(PWM_PINS[index], channel);
-        ledcWrite(channel, dutyCycle);
+        PwmOutput::write(index, freq, dutyCycle);
     }
 
     // ---------------- BUZZER + SYNC CONTROL ----------------
@@ -184,6 +541,14 @@ private:
         }
     }
 
+    // Make sure a restart never leaves a finger stuck on
+    void silenceAll() {
+        for (uint8_t i = 0; i < NUM_FINGERS; i++) {
+            if (_buzzerStates[i]) setPWM(DEFAULT_FREQ, i, DUTYCYCLE_OFF);
+        }
+        clearBuzzers();
+    }
+
     void startPulse(const StimulationPeriod& p) {
         if (!p.active || p.pulseWidthMs <= 0) return;
 
@@ -0,0 +1,184 @@
+// Wire format for SyncPacket (controller -> node sequence)
+#ifndef SYNC_CODEC_H
+#define SYNC_CODEC_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "stimulation_sequence.h"
+#include "ble_sync.h"
+
+// The in-memory SyncPacket holds floats, a bool and padding per period, which
+// is far larger than the information in it and doesn't fit one ESP-NOW frame.
+// On the wire a sequence is packed little-endian as:
+//
+//   [0]      type (MSG_SYNC)
+//   [1]      SYNC_WIRE_VERSION
+//   [2]      period count (NUM_PERIODS)
+//   [3..10]  startTimeUs, controller time
+//   per period, 10 bytes:
+//     u64    bits  0-19 pre delay us
+//            bits 20-39 pulse width us
+//            bits 40-59 post delay us
+//            bits 60-61 finger index
+//            bit  62    active
+//     u16    frequency, whole Hz
+//   [end-2]  CRC-16/CCITT over everything before it
+//
+// 20-bit microsecond fields cover phases up to ~1 s, and generated
+// frequencies are whole Hz, so a 20-period sequence is 213 bytes.
+
+static constexpr uint8_t SYNC_WIRE_VERSION = 1;
+static constexpr uint8_t SYNC_WIRE_HEADER = 11;
+static constexpr uint8_t SYNC_WIRE_PERIOD = 10;
+static constexpr size_t SYNC_WIRE_SIZE = SYNC_WIRE_HEADER + SYNC_WIRE_PERIOD * NUM_PERIODS + 2;
+static constexpr uint32_t SYNC_WIRE_MAX_US = (1UL << 20) - 1;
+static_assert(NUM_FINGERS <= 4, "finger index is packed into 2 bits");
+
+// A SeedPacket is packed as:
+//
+//   [0]      type (MSG_SYNC_SEED)
+//   [1]      SYNC_WIRE_VERSION
+//   [2]      descriptor count, 1..SYNC_SEED_MAX
+//   [3..6]   paramHash
+//   per descriptor, 16 bytes: u32 seed, u32 index, u64 startTimeUs
+//   [end-2]  CRC-16/CCITT over everything before it
+//
+// i.e. 25 bytes for one sequence.
+
+static constexpr uint8_t SEED_WIRE_HEADER = 7;
+static constexpr uint8_t SEED_WIRE_DESC = 16;
+
+constexpr size_t seedWireSize(uint8_t count) {
+  return SEED_WIRE_HEADER + SEED_WIRE_DESC * count + 2;
+}
+
+namespace SyncCodec {
+
+inline uint16_t crc16(const uint8_t *data, size_t len) {
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t b = 0; b < 8; b++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+inline void putLE(uint8_t *out, uint64_t v, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) out[i] = (uint8_t)(v >> (8 * i));
+}
+
+inline uint64_t getLE(const uint8_t *in, uint8_t bytes) {
+  uint64_t v = 0;
+  for (uint8_t i = 0; i < bytes; i++) v |= (uint64_t)in[i] << (8 * i);
+  return v;
+}
+
+// Milliseconds (float) to the 20-bit microsecond field; false if out of range
+inline bool toWireUs(float ms, uint64_t &us) {
+  long v = lroundf(ms * 1000.0f);
+  if (v < 0 || v > (long)SYNC_WIRE_MAX_US) return false;
+  us = (uint64_t)v;
+  return true;
+}
+
+// Returns bytes written, or 0 if the packet doesn't fit the format
+inline size_t encodeSync(const SyncPacket &pkt, uint8_t *out, size_t cap) {
+  if (cap < SYNC_WIRE_SIZE) return 0;
+
+  out[0] = MSG_SYNC;
+  out[1] = SYNC_WIRE_VERSION;
+  out[2] = NUM_PERIODS;
+  putLE(out + 3, pkt.startTimeUs, 8);
+
+  uint8_t *p = out + SYNC_WIRE_HEADER;
+  for (uint8_t i = 0; i < NUM_PERIODS; i++, p += SYNC_WIRE_PERIOD) {
+    const StimulationPeriod &sp = pkt.stimPeriods[i];
+    uint64_t pre, width, post;
+    if (!toWireUs(sp.preDelayMs, pre) || !toWireUs(sp.pulseWidthMs, width) ||
+        !toWireUs(sp.postDelayMs, post) || sp.fingerIndex >= NUM_FINGERS ||
+        sp.frequency < 0.0f || sp.frequency > 65535.0f) {
+      return 0;
+    }
+
+    uint64_t word = pre | (width << 20) | (post << 40) |
+                    ((uint64_t)(sp.fingerIndex & 0x3) << 60) |
+                    ((uint64_t)(sp.active ? 1 : 0) << 62);
+    putLE(p, word, 8);
+    putLE(p + 8, (uint16_t)lroundf(sp.frequency), 2);
+  }
+
+  putLE(p, crc16(out, SYNC_WIRE_SIZE - 2), 2);
+  return SYNC_WIRE_SIZE;
+}
+
+// Rejects wrong size, version, period count or CRC
+inline bool decodeSync(const uint8_t *in, size_t len, SyncPacket &pkt) {
+  if (len != SYNC_WIRE_SIZE) return false;
+  if (in[0] != MSG_SYNC || in[1] != SYNC_WIRE_VERSION || in[2] != NUM_PERIODS) return false;
+  if (crc16(in, SYNC_WIRE_SIZE - 2) != (uint16_t)getLE(in + SYNC_WIRE_SIZE - 2, 2)) return false;
+
+  pkt.type = MSG_SYNC;
+  pkt.startTimeUs = getLE(in + 3, 8);
+
+  const uint8_t *p = in + SYNC_WIRE_HEADER;
+  for (uint8_t i = 0; i < NUM_PERIODS; i++, p += SYNC_WIRE_PERIOD) {
+    uint64_t word = getLE(p, 8);
+    StimulationPeriod &sp = pkt.stimPeriods[i];
+    sp.preDelayMs   = (float)(word & SYNC_WIRE_MAX_US) / 1000.0f;
+    sp.pulseWidthMs = (float)((word >> 20) & SYNC_WIRE_MAX_US) / 1000.0f;
+    sp.postDelayMs  = (float)((word >> 40) & SYNC_WIRE_MAX_US) / 1000.0f;
+    sp.fingerIndex  = (uint8_t)((word >> 60) & 0x3);
+    sp.active       = ((word >> 62) & 0x1) != 0;
+    sp.frequency    = (float)getLE(p + 8, 2);
+  }
+  return true;
+}
+
+// Returns bytes written, or 0 if the packet doesn't fit the format
+inline size_t encodeSeed(const SeedPacket &pkt, uint8_t *out, size_t cap) {
+  if (pkt.count == 0 || pkt.count > SYNC_SEED_MAX) return 0;
+  size_t size = seedWireSize(pkt.count);
+  if (cap < size) return 0;
+
+  out[0] = MSG_SYNC_SEED;
+  out[1] = SYNC_WIRE_VERSION;
+  out[2] = pkt.count;
+  putLE(out + 3, pkt.paramHash, 4);
+
+  uint8_t *p = out + SEED_WIRE_HEADER;
+  for (uint8_t i = 0; i < pkt.count; i++, p += SEED_WIRE_DESC) {
+    putLE(p, pkt.desc[i].seed, 4);
+    putLE(p + 4, pkt.desc[i].index, 4);
+    putLE(p + 8, pkt.desc[i].startTimeUs, 8);
+  }
+
+  putLE(p, crc16(out, size - 2), 2);
+  return size;
+}
+
+// Rejects wrong size, version, count or CRC. The caller checks paramHash.
+inline bool decodeSeed(const uint8_t *in, size_t len, SeedPacket &pkt) {
+  if (len < seedWireSize(1)) return false;
+  if (in[0] != MSG_SYNC_SEED || in[1] != SYNC_WIRE_VERSION) return false;
+  uint8_t count = in[2];
+  if (count == 0 || count > SYNC_SEED_MAX || len != seedWireSize(count)) return false;
+  if (crc16(in, len - 2) != (uint16_t)getLE(in + len - 2, 2)) return false;
+
+  pkt.type = MSG_SYNC_SEED;
+  pkt.count = count;
+  pkt.paramHash = (uint32_t)getLE(in + 3, 4);
+
+  const uint8_t *p = in + SEED_WIRE_HEADER;
+  for (uint8_t i = 0; i < count; i++, p += SEED_WIRE_DESC) {
+    pkt.desc[i].seed = (uint32_t)getLE(p, 4);
+    pkt.desc[i].index = (uint32_t)getLE(p + 4, 4);
+    pkt.desc[i].startTimeUs = getLE(p + 8, 8);
+  }
+  return true;
+}
+
+} // namespace SyncCodec
+
+#endif // SYNC_CODEC_H
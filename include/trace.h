@@ -0,0 +1,151 @@
+// Timing trace: a RAM ring of (event, finger, scheduled us, actual us)
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <Arduino.h>
+#include <atomic>
+#include "config.h"
+
+// Built only with TRACE defined (config.h or -DTRACE); otherwise every
+// TRACE_EVENT() compiles to nothing. The ring is allocated once at boot,
+// in PSRAM when the board has it, and old records are overwritten.
+//
+// Producers are the esp_timer task (pulse edges), the sync task (received
+// frames, offset corrections) and loop() (stalls). Each claims a slot with
+// one atomic add and publishes it by writing the slot's ticket last, so
+// recording never takes a lock and a dump skips slots caught mid-write.
+
+enum TraceEvent : uint8_t {
+  TRACE_PULSE_ON = 1,   // finger; edge due time vs LEDC write
+  TRACE_PULSE_OFF,
+  TRACE_SEQ_START,      // 1 if the timer swapped it in; start time vs when it started
+  TRACE_SYNC_RX,        // message type; radio timestamp vs handled
+  TRACE_SYNC_OFFSET,    // playing start vs where the new clock fit puts it
+  TRACE_LOOP_STALL,     // previous loop() pass vs this one
+  TRACE_PULSE_SKIPPED,  // finger; ON edge due time vs when both edges were found overdue
+};
+
+struct TraceRecord {
+  int64_t  scheduledUs;
+  int64_t  actualUs;
+  uint32_t ticket;      // claim number + 1; 0 while being written
+  uint8_t  event;
+  uint8_t  finger;      // or a small event argument
+};
+
+typedef void (*TraceWriter)(const char *line);
+
+#ifdef TRACE
+
+static_assert((TRACE_SLOTS & (TRACE_SLOTS - 1)) == 0, "TRACE_SLOTS must be a power of two");
+
+struct TraceContext {
+  TraceRecord *slots = nullptr;
+  std::atomic<uint32_t> next{0};
+};
+
+namespace Trace {
+
+inline TraceContext &context() {
+  static TraceContext ctx;
+  return ctx;
+}
+
+inline void begin() {
+  TraceContext &ctx = context();
+  if (ctx.slots) return;
+  size_t bytes = sizeof(TraceRecord) * TRACE_SLOTS;
+  ctx.slots = (TraceRecord *)(psramFound() ? ps_malloc(bytes) : malloc(bytes));
+  if (!ctx.slots) {
+    Serial.println(F("[Trace] buffer allocation failed"));
+    return;
+  }
+  memset(ctx.slots, 0, bytes);
+  Serial.printf("[Trace] %u records in %s\n", (unsigned)TRACE_SLOTS, psramFound() ? "PSRAM" : "RAM");
+}
+
+inline void record(uint8_t event, uint8_t finger, int64_t scheduledUs, int64_t actualUs) {
+  TraceContext &ctx = context();
+  if (!ctx.slots) return;
+  uint32_t n = ctx.next.fetch_add(1, std::memory_order_relaxed);
+  TraceRecord &r = ctx.slots[n & (TRACE_SLOTS - 1)];
+  __atomic_store_n(&r.ticket, 0, __ATOMIC_RELAXED);
+  std::atomic_thread_fence(std::memory_order_release);
+  r.scheduledUs = scheduledUs;
+  r.actualUs = actualUs;
+  r.event = event;
+  r.finger = finger;
+  __atomic_store_n(&r.ticket, n + 1, __ATOMIC_RELEASE);
+}
+
+inline const char *eventName(uint8_t event) {
+  switch (event) {
+  case TRACE_PULSE_ON:       return "pulse_on";
+  case TRACE_PULSE_OFF:      return "pulse_off";
+  case TRACE_SEQ_START:      return "seq_start";
+  case TRACE_SYNC_RX:        return "sync_rx";
+  case TRACE_SYNC_OFFSET:    return "sync_offset";
+  case TRACE_LOOP_STALL:     return "loop_stall";
+  case TRACE_PULSE_SKIPPED:  return "pulse_skipped";
+  default:                   return "?";
+  }
+}
+
+// Oldest to newest, one CSV line each. Recording carries on meanwhile;
+// records overwritten during the dump are skipped.
+inline void dump(TraceWriter out) {
+  TraceContext &ctx = context();
+  char line[96];
+  if (!ctx.slots) {
+    out("[Trace] not started\n");
+    return;
+  }
+
+  uint32_t end = ctx.next.load(std::memory_order_acquire);
+  uint32_t start = end > TRACE_SLOTS ? end - TRACE_SLOTS : 0;
+  snprintf(line, sizeof(line), "[Trace] %u records, %u overwritten\n",
+           (unsigned)(end - start), (unsigned)start);
+  out(line);
+  out("event,finger,scheduled_us,actual_us,late_us\n");
+
+  for (uint32_t n = start; n != end; n++) {
+    const TraceRecord &slot = ctx.slots[n & (TRACE_SLOTS - 1)];
+    if (__atomic_load_n(&slot.ticket, __ATOMIC_ACQUIRE) != n + 1) continue;
+    TraceRecord r = slot;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (__atomic_load_n(&slot.ticket, __ATOMIC_RELAXED) != n + 1) continue;
+
+    snprintf(line, sizeof(line), "%s,%u,%lld,%lld,%lld\n", eventName(r.event), (unsigned)r.finger,
+             (long long)r.scheduledUs, (long long)r.actualUs,
+             (long long)(r.actualUs - r.scheduledUs));
+    out(line);
+  }
+}
+
+inline void clear() {
+  TraceContext &ctx = context();
+  if (!ctx.slots) return;
+  for (uint32_t i = 0; i < TRACE_SLOTS; i++) {
+    __atomic_store_n(&ctx.slots[i].ticket, 0, __ATOMIC_RELAXED);
+  }
+  ctx.next.store(0, std::memory_order_release);
+}
+
+} // namespace Trace
+
+#define TRACE_EVENT(event, finger, scheduledUs, actualUs) \
+  Trace::record((event), (finger), (scheduledUs), (actualUs))
+
+#else
+
+namespace Trace {
+inline void begin() {}
+inline void dump(TraceWriter out) { out("[Trace] not built in (define TRACE)\n"); }
+inline void clear() {}
+} // namespace Trace
+
+#define TRACE_EVENT(event, finger, scheduledUs, actualUs) do {} while (0)
+
+#endif // TRACE
+
+#endif // TRACE_H
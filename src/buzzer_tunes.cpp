@@ -1,43 +1,137 @@
 #include "buzzer_tunes.h"
 #include "config.h"
+#include "pwm_output.h"
 #include <Arduino.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
 // -------------------------
-// Play a single tune
+// Background player
 // -------------------------
-void playTune(const Note *tune, uint8_t count) {
-    randomSeed(count);
-    uint8_t pinIndex = random(4);  // 0 to 3 inclusive
-    uint8_t buzzerPin = PWM_PINS[pinIndex];
-    
-    for (uint8_t i = 0; i < count; i++) {
-        pinIndex = random(4);  // 0 to 3 inclusive
-        buzzerPin = PWM_PINS[pinIndex];
-        
-        if (tune[i].freq > 0.0f) {
-            // Attach PWM to buzzer using channel derived from pinIndex
-            uint32_t freq = (uint32_t)tune[i].freq;
-            uint8_t channel = pinIndex % 16;
-            ledcSetup(channel, freq, PWM_RESOLUTION);
-            ledcAttachPin(buzzerPin, channel);
-            ledcWrite(channel, DUTYCYCLE_ON);
-
-            delay(tune[i].durationMs);
-
-            // Stop note
-            ledcWrite(channel, DUTYCYCLE_OFF);
-            delay(20); // short pause between notes
-        } else {
-            // REST: silence
-            delay(tune[i].durationMs);
+namespace {
+
+struct QueuedTune {
+    const Note *notes;
+    uint8_t count;
+};
+
+struct TunePlayer {
+    esp_timer_handle_t timer = nullptr;
+    SemaphoreHandle_t lock = nullptr;
+    QueuedTune tunes[TUNE_QUEUE_MAX + 1];   // [0] is playing
+    uint8_t count = 0;                      // tunes held, including the one playing
+    uint8_t note = 0;                       // next note of tunes[0]
+    bool sounding = false;                  // a note is on; next comes its gap
+    uint8_t finger = 0;
+};
+
+TunePlayer player;
+
+// Caller holds player.lock
+void dropTunes() {
+    player.count = 0;
+    player.note = 0;
+    player.sounding = false;
+}
+
+// Caller holds player.lock. Switches the next note on or off and returns
+// how long until the step after it; false once every tune has finished.
+bool step(uint32_t &waitMs) {
+    if (player.sounding) {
+        PwmOutput::setDuty(player.finger, DUTYCYCLE_OFF);
+        player.sounding = false;
+        waitMs = TUNE_NOTE_GAP_MS;
+        return true;
+    }
+    while (player.count > 0) {
+        if (player.note >= player.tunes[0].count) {
+            memmove(&player.tunes[0], &player.tunes[1], sizeof(QueuedTune) * (player.count - 1));
+            player.count--;
+            player.note = 0;
+            continue;
         }
+        const Note &n = player.tunes[0].notes[player.note++];
+        if (n.freq > 0.0f) {
+            // Pins are already attached by PwmOutput; only retime the channel
+            player.finger = (uint8_t)(esp_random() % NUM_FINGERS);
+            PwmOutput::setFrequency(player.finger, (uint32_t)n.freq);
+            PwmOutput::setDuty(player.finger, DUTYCYCLE_ON);
+            player.sounding = true;
+        }
+        waitMs = n.durationMs;
+        return true;
     }
-    
-    // Detach PWM pin after playing tune to avoid conflicts
-    for (int ch = 0; ch < 16; ++ch) {
-      // best-effort: detach possible channels that may have been used
-      // there's no direct mapping here so keep as no-op or leave configured
+    return false;
+}
+
+// Runs on the esp_timer task, like the stimulation edges, so it never
+// waits for the lock: if playTune() or stopTune() holds it, the step is
+// retried shortly instead of holding up the edges queued behind it
+void onTimer(void *) {
+    if (xSemaphoreTake(player.lock, 0) != pdTRUE) {
+        esp_timer_start_once(player.timer, TUNE_LOCK_RETRY_US);
+        return;
+    }
+    uint32_t waitMs = 0;
+    if (!PwmOutput::claim(PwmOutput::Owner::TUNE)) {
+        // Stimulation took the fingers and already silenced them
+        dropTunes();
+    } else if (step(waitMs)) {
+        esp_timer_start_once(player.timer, (uint64_t)waitMs * 1000);
+    } else {
+        PwmOutput::release(PwmOutput::Owner::TUNE);
     }
+    xSemaphoreGive(player.lock);
+}
+
+// Created on first use, from setup(), once the esp_timer service is up
+void ensurePlayer() {
+    if (player.timer) return;
+
+    PwmOutput::begin();
+    player.lock = xSemaphoreCreateMutex();
+
+    esp_timer_create_args_t args = {};
+    args.callback = &onTimer;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "tune";
+    esp_timer_create(&args, &player.timer);
+}
+
+} // namespace
+
+bool playTune(const Note *tune, uint8_t count) {
+    if (count == 0) return true;
+    ensurePlayer();
+    xSemaphoreTake(player.lock, portMAX_DELAY);
+    bool ok = PwmOutput::owner() != PwmOutput::Owner::STIMULATION &&
+              player.count < TUNE_QUEUE_MAX + 1;
+    if (ok) {
+        player.tunes[player.count++] = QueuedTune{tune, count};
+        if (player.count == 1) {
+            player.note = 0;
+            esp_timer_start_once(player.timer, 0);
+        }
+    }
+    xSemaphoreGive(player.lock);
+    return ok;
+}
+
+void stopTune() {
+    if (!player.timer) return;
+    xSemaphoreTake(player.lock, portMAX_DELAY);
+    esp_timer_stop(player.timer);
+    if (player.sounding && PwmOutput::owner() == PwmOutput::Owner::TUNE) {
+        PwmOutput::setDuty(player.finger, DUTYCYCLE_OFF);
+    }
+    dropTunes();
+    PwmOutput::release(PwmOutput::Owner::TUNE);
+    xSemaphoreGive(player.lock);
+}
+
+bool isTunePlaying() {
+    return player.count > 0;
 }
 
 // -------------------------
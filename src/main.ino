@@ -1,10 +1,18 @@
 #include <WiFi.h>
 #include "ota.h"
 #include "stimulation_sequence.h"
+#include "pwm_output.h"
 #include "config.h"
 #include "buzzer_tunes.h"
 #include "ble_sync.h"
+#include "clock_sync.h"
+#include "sync_codec.h"
+#include "node_table.h"
+#include "fw_transfer.h"
+#include "metrics.h"
+#include "trace.h"
 #include <deque>
+#include <string>
 
 #ifdef BLUETOOTH
 #include "ble_iphone.h"
@@ -14,34 +22,162 @@ bool lastBleIphoneConnected = false;
 
 // BLE synchronization context
 BleSyncContext bleSyncCtx;
+FwTransferContext fwTransfer;  // node firmware, controller -> nodes
 
 // Synchronization packets defined in ble_sync.h
 SyncPacket packet_0;
 AckPacket ack;
 volatile bool requestSleep = false;
+bool otaDue = false;  // this boot checks for updates, once sync is up
 
 StimulationSequence stim;
-float oneWaySyncDelay = 0.0f;
+
+// Sync state below is shared by loop() and the sync receive task
+// (BleSync's rxTask), which preempts it; hold this while touching it
+SemaphoreHandle_t syncLock = nullptr;
 
 #ifdef NODE
+// Controller/node clock offset estimate
+ClockSyncContext clockSync;
+uint8_t selfAddr[SYNC_ADDR_LEN];  // finds our t4 report in a ping
+
 struct PendingSync {
-  SyncPacket pkt;
-  uint64_t startTimeUs;
+  SyncPacket pkt;            // startTimeUs is in controller time
 };
+// Validated cycles waiting to be handed to stim, ordered by start time.
+// Filled by the sync task and drained by loop().
 std::deque<PendingSync> syncQueue;
+int64_t handedStartUs = -1;  // controller-time start of the last cycle handed to stim
 #endif
 
 #ifdef CONTROLLER
-void sendSyncPacket() {
-  // Send the sequence and include a buffer delay so nodes can schedule playback
-  packet_0.t_send_us = esp_timer_get_time();
-  packet_0.startDelayUs = 200000; // 200ms buffer by default
-  memcpy(&packet_0.stimPeriods, stim.stimPeriods, sizeof(packet_0.stimPeriods));
-  
-  bool sent = BleSync::send(bleSyncCtx, (uint8_t *)&packet_0, sizeof(SyncPacket));
+// Every node we've heard from: clock fit, RTT, last ACK, loss counters
+NodeTableContext nodes;
+bool resendSchedule = false;  // a node joined and should get the schedule now
+
+// Cycles scheduled but not started yet, in start order. Every send repeats
+// all of them, so each cycle reaches the node up to SYNC_LOOKAHEAD times
+// before it plays and a lost packet or short dropout costs nothing.
+std::deque<SequenceDescriptor> upcoming;
+static_assert(SYNC_LOOKAHEAD <= SYNC_SEED_MAX, "upcoming cycles must fit one seed packet");
+int64_t scheduleEndUs = 0;   // end of the last scheduled cycle
+int64_t handedStartUs = -1;  // start of the last cycle handed to stim
+uint32_t sequenceIndex = 0;
+
+// Drop cycles whose start has passed; handed ones are already in stim,
+// and unhanded ones (left over from a disconnect) are too late to play
+void pruneSchedule() {
+  int64_t now = esp_timer_get_time();
+  while (!upcoming.empty() && (int64_t)upcoming.front().startTimeUs <= now) {
+    if ((int64_t)upcoming.front().startTimeUs <= handedStartUs) {
+      NodeTable::onCycleStarted(nodes, upcoming.front().startTimeUs);
+    }
+    upcoming.pop_front();
+  }
+}
+
+// Sequence number of a scheduled cycle, 0 if it's no longer in the schedule
+uint32_t indexForStart(uint64_t startTimeUs) {
+  for (const auto &d : upcoming) {
+    if (d.startTimeUs == startTimeUs) return d.index;
+  }
+  return 0;
+}
+
+// Top up the schedule to SYNC_LOOKAHEAD cycles; true if any were added
+bool scheduleAhead() {
+  pruneSchedule();
+
+  int64_t now = esp_timer_get_time();
+  bool added = false;
+  while (upcoming.size() < SYNC_LOOKAHEAD) {
+    // Cycles run back to back unless we've fallen behind, e.g. after a
+    // disconnect; then give the node time to receive the first one
+    if (scheduleEndUs < now + (int64_t)SYNC_START_DELAY_US) {
+      scheduleEndUs = now + SYNC_START_DELAY_US;
+    }
+
+    SequenceDescriptor d;
+    d.seed = esp_random();
+    d.index = ++sequenceIndex;
+    d.startTimeUs = (uint64_t)scheduleEndUs;
+
+    StimulationPeriod periods[NUM_PERIODS];
+    StimulationSequence::generate(d.seed, periods);
+    scheduleEndUs += StimulationSequence::durationUs(periods);
+
+    upcoming.push_back(d);
+    added = true;
+  }
+  return added;
+}
+
+// Give stim the next cycle as soon as it has room for one
+void handOffSchedule() {
+  if (!stim.isFinished() && stim.hasQueued()) return;
+
+  for (const auto &d : upcoming) {
+    if ((int64_t)d.startTimeUs <= handedStartUs) continue;
+
+    StimulationPeriod periods[NUM_PERIODS];
+    StimulationSequence::generate(d.seed, periods);
+    if (stim.isFinished()) {
+      stim.play(periods, (int64_t)d.startTimeUs);
+    } else {
+      stim.queueNext(periods, (int64_t)d.startTimeUs);
+    }
+    handedStartUs = (int64_t)d.startTimeUs;
+    break;
+  }
+}
+
+TimePingPacket timePing;
+uint8_t pingSeq = 0;
+uint64_t pingT1 = 0;         // send time of the outstanding ping
+
+void sendTimePing() {
+  timePing.type = MSG_TIME_PING;
+  timePing.seq = ++pingSeq;
+  NodeTable::fillPingReports(nodes, timePing);
+  timePing.t1_us = esp_timer_get_time();
+  pingT1 = timePing.t1_us;
+
+  BleSync::send(bleSyncCtx, (uint8_t *)&timePing, timePingSize(timePing.count));
+  NodeTable::onPingSent(nodes);
+}
+
+void sendSchedule() {
+  if (upcoming.empty()) return;
+
+  // Both sides start each cycle at the same controller time
+  uint8_t wire[SYNC_WIRE_SIZE];
+  bool sent = true;
+  if (SYNC_SEND_SEED) {
+    // One frame carries every upcoming cycle; the node rebuilds the periods
+    SeedPacket seedPkt;
+    seedPkt.type = MSG_SYNC_SEED;
+    seedPkt.paramHash = StimulationSequence::paramHash();
+    seedPkt.count = 0;
+    for (const auto &d : upcoming) {
+      if (seedPkt.count >= SYNC_SEED_MAX) break;
+      seedPkt.desc[seedPkt.count++] = d;
+    }
+    size_t wireLen = SyncCodec::encodeSeed(seedPkt, wire, sizeof(wire));
+    sent = wireLen > 0 && BleSync::send(bleSyncCtx, wire, wireLen);
+  } else {
+    // A full sequence fills a frame, so send them one by one
+    for (const auto &d : upcoming) {
+      packet_0.type = MSG_SYNC;
+      packet_0.startTimeUs = d.startTimeUs;
+      StimulationSequence::generate(d.seed, packet_0.stimPeriods);
+      size_t wireLen = SyncCodec::encodeSync(packet_0, wire, sizeof(wire));
+      sent = wireLen > 0 && BleSync::send(bleSyncCtx, wire, wireLen) && sent;
+    }
+  }
   
   if (sent) {
-    Serial.println("Sync Packet Sent via BLE");
+    Serial.print("Sync Packet Sent via BLE, cycles ahead: ");
+    Serial.println((int)upcoming.size());
   } else {
     Serial.println("Failed to send sync packet (not connected)");
   }
@@ -51,61 +187,331 @@ void sendSyncPacket() {
   #endif
 }
 
-void onAckReceive(const uint8_t *data, size_t len) {
-  if (len != sizeof(AckPacket)) return;
-  
-  const AckPacket *ack = (const AckPacket *)data;
+// Caller holds syncLock
+void handleAck(const uint8_t *addr, const uint8_t *data, size_t len, uint64_t t4) {
+  if (len == 0) return;
+
+  bool isNew;
+  NodeInfo *node = NodeTable::add(nodes, addr, millis(), isNew);
+  if (!node) return; // table full of active nodes
+  if (isNew) {
+    Serial.printf("[Nodes] %02X:%02X:%02X:%02X:%02X:%02X joined, %u active\n",
+                  addr[0], addr[1], addr[2], addr[3], addr[4], addr[5],
+                  (unsigned)NodeTable::activeCount(nodes));
+    resendSchedule = true;
+  }
 
-  uint32_t t_now = esp_timer_get_time();
-  uint32_t rtt_us = t_now - ack->t_send_us;
-  float oneWay_us = rtt_us * 0.5f;
+  switch (data[0]) {
+  case MSG_TIME_ACK: {
+    if (len != sizeof(TimeAckPacket)) return;
+    const TimeAckPacket *tack = (const TimeAckPacket *)data;
+    if (tack->seq != pingSeq) return; // late reply to an older ping
+    NodeTable::onTimeAck(*node, tack->seq, pingT1, tack->t2_us, tack->t3_us, t4);
+    break;
+  }
 
-  updateSyncDelay(oneWay_us);
-  Serial.print("ACK received, RTT: ");
-  Serial.print(rtt_us);
-  Serial.println(" us");
-}
+  case MSG_SYNC_ACK: {
+    if (len != sizeof(AckPacket)) return;
+    const AckPacket *sack = (const AckPacket *)data;
+    NodeTable::onSyncAck(*node, sack->startTimeUs, indexForStart(sack->startTimeUs));
+    break;
+  }
 
-void updateSyncDelay(float newEstimate) {
-  constexpr float alpha = 0.1f;
+  case MSG_FW_REQUEST:
+  case MSG_FW_ACK:
+  case MSG_FW_NACK:
+    FwTransfer::onReply(fwTransfer, addr, data, len, millis());
+    break;
+  }
+}
 
-  oneWaySyncDelay =
-      (1.0f - alpha) * oneWaySyncDelay +
-      alpha * newEstimate;
+// First contact: ping and send the schedule without waiting for the loop
+void startSync() {
+  xSemaphoreTake(syncLock, portMAX_DELAY);
+  sendTimePing();
+  scheduleAhead();
+  sendSchedule();
+  xSemaphoreGive(syncLock);
+}
 
-  stim.setSyncOffset(oneWaySyncDelay);  // live update
+// Runs on the sync task; t4 was taken when the radio delivered the frame
+void onAckReceive(const SyncFrame &frame) {
+  TRACE_EVENT(TRACE_SYNC_RX, frame.len ? frame.data[0] : 0, (int64_t)frame.rxUs, esp_timer_get_time());
+  xSemaphoreTake(syncLock, portMAX_DELAY);
+  handleAck(frame.addr, frame.data, frame.len, frame.rxUs);
+  xSemaphoreGive(syncLock);
 }
 #endif
 
 #ifdef NODE
-void onSyncReceive(const uint8_t *data, size_t len) {
-  if (len != sizeof(SyncPacket)) return;
-  
-  const SyncPacket *pkt = (const SyncPacket *)data;
-  uint32_t t_now = esp_timer_get_time();
+void onTimePing(const TimePingPacket *ping, uint64_t t2) {
+  // Finish our previous exchange now that we know its t4
+  const PingReport *prev = nullptr;
+  for (uint8_t i = 0; i < ping->count; i++) {
+    if (memcmp(ping->prev[i].addr, selfAddr, SYNC_ADDR_LEN) == 0) prev = &ping->prev[i];
+  }
+  if (prev && ClockSync::completePing(clockSync, prev->seq, prev->t4_us)) {
+    // Re-map the playing sequence through the refined offset and drift
+    int64_t localStartUs, controllerStartUs;
+    uint32_t generation;
+    stim.schedule(localStartUs, controllerStartUs, generation);
+    stim.setRateCorrection(ClockSync::skewPpm(clockSync));
+    if (generation > 0) {
+      int64_t remappedUs = ClockSync::controllerTimeToLocal(clockSync, controllerStartUs);
+      stim.setSyncOffset((float)(remappedUs - localStartUs), generation);
+      Metrics::observe(METRIC_OFFSET, llabs(remappedUs - localStartUs));
+      TRACE_EVENT(TRACE_SYNC_OFFSET, 0, localStartUs, remappedUs);
+    }
+  } else if (!ClockSync::isValid(clockSync)) {
+    // No complete exchange yet: assume zero flight time so the first
+    // sequence still lands close to the controller's
+    clockSync.offsetUs = (int64_t)(t2 - ping->t1_us);
+  }
+
+  TimeAckPacket tack;
+  tack.type = MSG_TIME_ACK;
+  tack.seq = ping->seq;
+  tack.t2_us = t2;
+  tack.t3_us = esp_timer_get_time();
+  BleSync::send(bleSyncCtx, (uint8_t *)&tack, sizeof(TimeAckPacket));
+
+  ClockSync::rememberPing(clockSync, ping->seq, ping->t1_us, t2, tack.t3_us);
+}
+
+// Insert a cycle by start time. False if it's a duplicate (the controller
+// repeats upcoming cycles), already handed to stim, too late, or the queue
+// is full. Caller holds syncLock.
+bool queueSequence(const SyncPacket &pkt) {
+  int64_t start = (int64_t)pkt.startTimeUs;
+  if (start <= handedStartUs) return false;
+
+  auto it = syncQueue.begin();
+  while (it != syncQueue.end() && (int64_t)it->pkt.startTimeUs < start) ++it;
+  if (it != syncQueue.end() && (int64_t)it->pkt.startTimeUs == start) return false;
+  if (ClockSync::controllerTimeToLocal(clockSync, start) <= esp_timer_get_time()) {
+    Metrics::count(METRIC_LATE_CYCLES);
+    return false;
+  }
+  if (syncQueue.size() >= SYNC_QUEUE_MAX) {
+    Metrics::count(METRIC_QUEUE_OVERRUNS);
+    return false;
+  }
 
-  // Queue the packet for buffered playback
   PendingSync ps;
-  memcpy(&ps.pkt, pkt, sizeof(SyncPacket));
-  ps.startTimeUs = (uint64_t)t_now + (uint64_t)pkt->startDelayUs;
-  syncQueue.push_back(ps);
+  memcpy(&ps.pkt, &pkt, sizeof(SyncPacket));
+  syncQueue.insert(it, ps);
+  return true;
+}
+
+// Give stim the next cycle as soon as it has room for one
+void handOffQueue() {
+  if (!stim.isFinished() && stim.hasQueued()) return;
 
-  // Send ACK back with original controller send timestamp and our recv time
-  ack.t_send_us = pkt->t_send_us;
-  ack.t_recv_us = t_now;
+  xSemaphoreTake(syncLock, portMAX_DELAY);
+  if (syncQueue.empty()) {
+    xSemaphoreGive(syncLock);
+    return;
+  }
+  const SyncPacket &pkt = syncQueue.front().pkt;
+  int64_t controllerStartUs = (int64_t)pkt.startTimeUs;
+  int64_t localStartUs = ClockSync::controllerTimeToLocal(clockSync, controllerStartUs);
+  handedStartUs = controllerStartUs;
+
+  if (localStartUs <= esp_timer_get_time()) {
+    Metrics::count(METRIC_LATE_CYCLES);
+    Serial.println("Dropped buffered sync sequence (start already passed)");
+  } else {
+    stim.setRateCorrection(ClockSync::skewPpm(clockSync));
+    if (stim.isFinished()) {
+      stim.play(pkt.stimPeriods, localStartUs, controllerStartUs);
+    } else {
+      stim.queueNext(pkt.stimPeriods, localStartUs, controllerStartUs);
+    }
+  }
+  syncQueue.pop_front();
+  xSemaphoreGive(syncLock);
+}
+
+void sendSyncAck(uint64_t startTimeUs) {
+  ack.type = MSG_SYNC_ACK;
+  ack.startTimeUs = startTimeUs;
   BleSync::send(bleSyncCtx, (uint8_t *)&ack, sizeof(AckPacket));
+}
+
+// Caller holds syncLock; t_now is when the radio delivered the frame
+void handleSync(const uint8_t *data, size_t len, uint64_t t_now) {
+  if (len == 0) return;
+
+  switch (data[0]) {
+  case MSG_TIME_PING: {
+    // Only the reports that are in use go over the air
+    TimePingPacket ping;
+    if (len < timePingSize(0) || len > sizeof(TimePingPacket)) return;
+    memcpy(&ping, data, len);
+    if (ping.count > SYNC_MAX_NODES || len != timePingSize(ping.count)) return;
+    onTimePing(&ping, t_now);
+    return;
+  }
+
+  case MSG_SYNC: {
+    SyncPacket pkt;
+    if (!SyncCodec::decodeSync(data, len, pkt)) {
+      Serial.println("Sync Packet rejected (bad size, version or CRC)");
+      return;
+    }
+    if (queueSequence(pkt)) {
+      Serial.println("Sync Packet queued for buffered playback");
+    }
+    sendSyncAck(pkt.startTimeUs);
+    break;
+  }
+
+  case MSG_SYNC_SEED: {
+    SeedPacket seedPkt;
+    if (!SyncCodec::decodeSeed(data, len, seedPkt)) {
+      Serial.println("Seed Packet rejected (bad size, version or CRC)");
+      return;
+    }
+    if (seedPkt.paramHash != StimulationSequence::paramHash()) {
+      Serial.println("Seed Packet rejected (stimulation parameters differ from controller)");
+      return;
+    }
+    uint8_t queued = 0;
+    for (uint8_t i = 0; i < seedPkt.count; i++) {
+      SyncPacket pkt;
+      pkt.type = MSG_SYNC;
+      pkt.startTimeUs = seedPkt.desc[i].startTimeUs;
+      StimulationSequence::generate(seedPkt.desc[i].seed, pkt.stimPeriods);
+      if (queueSequence(pkt)) queued++;
+    }
+    if (queued > 0) {
+      Serial.print("Seed Packet regenerated, new cycles queued: ");
+      Serial.println(queued);
+    }
+    sendSyncAck(seedPkt.desc[seedPkt.count - 1].startTimeUs);
+    break;
+  }
 
-  Serial.println("Sync Packet queued for buffered playback");
+  default:
+    return;
+  }
 
   #ifdef POWER_SAVER
   requestSleep = true;
   #endif
 }
+
+// The slot is ours unless a WiFi update is using it or has filled it
+bool fwTransferAllowed() {
+  return !OTA::background().updateInstalled && (!OTA::backgroundStarted() || OTA::background().done);
+}
+
+// Runs on the sync task
+void onSyncReceive(const SyncFrame &frame) {
+  TRACE_EVENT(TRACE_SYNC_RX, frame.len ? frame.data[0] : 0, (int64_t)frame.rxUs, esp_timer_get_time());
+  // Firmware frames only touch fwTransfer, and their flash writes would
+  // hold up loop() if they ran under the lock
+  if (frame.len && FwTransfer::isTransferFrame(frame.data[0])) {
+    FwTransfer::onFrame(fwTransfer, bleSyncCtx, frame.data, frame.len, fwTransferAllowed());
+    return;
+  }
+  xSemaphoreTake(syncLock, portMAX_DELAY);
+  handleSync(frame.data, frame.len, frame.rxUs);
+  xSemaphoreGive(syncLock);
+}
 #endif
 
+// ---- Debug commands, from USB serial or the iPhone UART ----
+
+void serialWrite(const char *line) {
+  Serial.print(line);
+}
+
+#ifdef BLUETOOTH
+void iphoneWrite(const char *line) {
+  BleIphone::write(bleIphoneCtx, std::string(line));
+}
+#endif
+
+// A TRANSPORT line per transport (worst node's probe RTT and loss), the
+// ESP-NOW channel and unicast peers, then one RADIO line per BLE link:
+// peer, MTU, TX PHY, RX PHY
+void printLinkParams(TraceWriter out) {
+  char line[64];
+  for (uint8_t t = 0; t < SYNC_TRANSPORTS; t++) {
+    uint32_t rttUs;
+    uint16_t lossPermille;
+    const char *name = BleSync::transportName((SyncTransport)t);
+    unsigned active = bleSyncCtx.active == t;
+    if (BleSync::transportStats(bleSyncCtx, (SyncTransport)t, rttUs, lossPermille)) {
+      snprintf(line, sizeof(line), "TRANSPORT,%s,%u,%u,%u\n", name, active, (unsigned)rttUs, lossPermille);
+    } else {
+      snprintf(line, sizeof(line), "TRANSPORT,%s,%u,-,-\n", name, active);  // not measured
+    }
+    out(line);
+  }
+  snprintf(line, sizeof(line), "ESPNOW,%u,%u\n", bleSyncCtx.channel, BleSync::EspNow::peerCount(bleSyncCtx));
+  out(line);
+
+  SyncLinkParams links[SYNC_MAX_NODES];
+  uint8_t n = BleSync::linkParams(bleSyncCtx, links);
+  for (uint8_t i = 0; i < n; i++) {
+    const uint8_t *a = links[i].addr;
+    char octets[16] = "-,-";  // data length not reported by this NimBLE
+    if (links[i].txOctets) snprintf(octets, sizeof(octets), "%u,%u", links[i].txOctets, links[i].rxOctets);
+    snprintf(line, sizeof(line), "RADIO,%02X:%02X:%02X:%02X:%02X:%02X,%u,%u,%u,%s\n",
+             a[0], a[1], a[2], a[3], a[4], a[5], links[i].mtu, links[i].txPhy, links[i].rxPhy, octets);
+    out(line);
+  }
+  if (n == 0) out("RADIO,none\n");  // ESP-NOW, or no link yet
+}
+
+void handleCommand(const std::string &cmd, TraceWriter out) {
+  if (cmd == "trace") {
+    Trace::dump(out);
+  } else if (cmd == "trace clear") {
+    Trace::clear();
+    out("[Trace] cleared\n");
+  } else if (cmd == "metrics") {
+    Metrics::dump(out);
+  } else if (cmd == "metrics reset") {
+    Metrics::reset();
+    out("[Metrics] reset\n");
+  } else if (cmd == "link") {
+    Metrics::summary(out);
+  } else if (cmd == "radio") {
+    printLinkParams(out);
+  } else {
+    out("Commands: link, metrics, metrics reset, radio, trace, trace clear\n");
+  }
+}
+
+void pollSerialCommands() {
+  static std::string line;
+  while (Serial.available() > 0) {
+    char c = (char)Serial.read();
+    if (c == '\n' || c == '\r') {
+      if (!line.empty()) handleCommand(line, serialWrite);
+      line.clear();
+    } else if (line.size() < 64) {
+      line += c;
+    }
+  }
+}
+
+// Pulses are running in step with the other side
+bool syncEstablished() {
+  #ifdef CONTROLLER
+  return stim.generation() > 0 && NodeTable::activeCount(nodes) > 0;
+  #else
+  return stim.generation() > 0;
+  #endif
+}
+
 void setupBLE() {
   // Initialize BLE
-  BleSync::init(bleSyncCtx);
+  syncLock = xSemaphoreCreateMutex();
+  BleSync::init(bleSyncCtx, OTA::espNowChannel());
   
   #ifdef CONTROLLER
   // Controller acts as BLE client
@@ -117,15 +523,16 @@ void setupBLE() {
   #ifdef NODE
   // Node acts as BLE server
   Serial.println("Starting BLE in NODE mode (server)");
+  BleSync::localAddress(selfAddr);
+  FwTransfer::begin(fwTransfer);
   BleSync::setReceiveCallback(onSyncReceive);
   BleSync::startServer(bleSyncCtx);
   #endif
   
-  Serial.print("BLE Device Address: ");
-  #if defined(USE_ESPNOW)
   Serial.print("WiFi MAC Address: ");
   Serial.println(WiFi.macAddress());
-  #else
+  #if defined(USE_BLE_SYNC)
+  Serial.print("BLE Device Address: ");
   Serial.println(NimBLEDevice::getAddress().toString().c_str());
   #endif
 }
@@ -139,12 +546,10 @@ void testPWMOutputs() {
     Serial.print(" PWM PIN: ");
     Serial.println(PWM_PINS[i]);
     delay(500);
-    uint8_t channel = i % 16;
-    ledcSetup(channel, DEFAULT_FREQ, PWM_RESOLUTION);
-    ledcAttachPin(PWM_PINS[i], channel);
-    ledcWrite(channel, DUTYCYCLE_ON);
+    PwmOutput::setFrequency(i, DEFAULT_FREQ);
+    PwmOutput::setDuty(i, DUTYCYCLE_ON);
     delay(500);
-    ledcWrite(channel, DUTYCYCLE_OFF);
+    PwmOutput::setDuty(i, DUTYCYCLE_OFF);
     delay(1000);
   }
   delay(5000);
@@ -155,9 +560,16 @@ void setup() {
   Serial.begin(SERIAL_BAUD);
   delay(1500);
 
+  // Attach all PWM pins once; edges after this are duty-only writes
+  PwmOutput::begin();
+  Trace::begin();
+  Metrics::reset();
+
   //testPWMOutputs();
 
-  OTA::otaCheck();
+  // The update check waits for sync in loop() so it never delays the
+  // first pulse; some boots skip it (OTA_CHECK_EVERY_BOOTS)
+  otaDue = OTA::bootCheckDue();
 
   setupBLE();
 
@@ -166,14 +578,14 @@ void setup() {
   #ifdef BLUETOOTH
   // Initialize BLE for iPhone
   BleIphone::init(bleIphoneCtx);
-  BleIphone::start(bleIphoneCtx);
+  BleIphone::start(bleIphoneCtx, bleSyncCtx);
   #endif
+  BleSync::advertise(bleSyncCtx);  // every service is on the server now
 
   #ifdef CONTROLLER
   //Start new pattern
   //playMario();
   Serial.println("Controller: Waiting for BLE connection to NODE...");
-  stim.begin(analogRead(0)); // Seed the random number generator with a random value
   #endif
 
   #ifdef NODE
@@ -184,80 +596,130 @@ void setup() {
 
 // main loop
 void loop() {
-  // Update BLE connection status (controller will auto-reconnect)
+  // Time from one pass to the next, so early returns are counted too
+  static int64_t lastLoopUs = 0;
+  int64_t loopUs = esp_timer_get_time();
+  if (lastLoopUs) {
+    Metrics::observe(METRIC_LOOP_TIME, loopUs - lastLoopUs);
+    if (loopUs - lastLoopUs > TRACE_LOOP_STALL_US) {
+      TRACE_EVENT(TRACE_LOOP_STALL, 0, lastLoopUs, loopUs);
+    }
+  }
+  lastLoopUs = loopUs;
+
+  pollSerialCommands();
+
+  // Link probes, or a node's search for the controller's channel; the BLE
+  // link task reconnects on its own
   BleSync::update(bleSyncCtx);
   
   #ifdef CONTROLLER
-  // Try to connect if not connected
+  // Start the pattern whenever a link comes (back) up
   static bool hasConnected = false;
   if (!BleSync::isConnected(bleSyncCtx)) {
     if (hasConnected) {
-      Serial.println("Connection lost, attempting to reconnect...");
-    }
-    static uint32_t lastConnectAttempt = 0;
-    if (millis() - lastConnectAttempt > 5000) {
-      lastConnectAttempt = millis();
-      if (BleSync::scanAndConnect(bleSyncCtx, 5)) {
-        hasConnected = true;
-        Serial.println("Connected! Starting pattern...");
-        stim.begin(analogRead(0));
-        sendSyncPacket();
-      }
+      hasConnected = false;
+      Serial.println("Connection lost, reconnecting in the background...");
     }
     return; // Don't run stimulation if not connected
   } else if (!hasConnected) {
     hasConnected = true;
-    Serial.println("Initial connection established");
-    sendSyncPacket();
+    Serial.println("Connected! Starting pattern...");
+    startSync();
   }
+
+  xSemaphoreTake(syncLock, portMAX_DELAY);
+
+  // A node that just connected gets a ping and the schedule right away
+  // rather than waiting for the next cycle to be added
+  static uint32_t lastJoins = 0;
+  if (bleSyncCtx.joins != lastJoins) {
+    lastJoins = bleSyncCtx.joins;
+    sendTimePing();
+    resendSchedule = true;
+  }
+  NodeTable::expire(nodes, millis());
+
+  // Keep SYNC_LOOKAHEAD cycles scheduled and sent ahead of playback
+  if (scheduleAhead() || resendSchedule) {
+    resendSchedule = false;
+    sendSchedule();
+  }
+  handOffSchedule();
+
+  // Keep the nodes' clock estimates fresh; once drift is tracked the
+  // model holds between pings and they can be sent much less often
+  static uint32_t lastTimePing = 0;
+  if (millis() - lastTimePing >= NodeTable::pingIntervalMs(nodes)) {
+    lastTimePing = millis();
+    sendTimePing();
+  }
+
+  // Hand the node image on, between the sync traffic above
+  FwTransfer::service(fwTransfer, bleSyncCtx, millis());
+
+  xSemaphoreGive(syncLock);
   #endif
   
   stim.update();
 
 #ifdef NODE
-  // Process pending buffered syncs
-  if (!syncQueue.empty()) {
-    uint64_t now = esp_timer_get_time();
-    while (!syncQueue.empty() && syncQueue.front().startTimeUs <= now) {
-      // Start the queued sequence
-      auto ready = syncQueue.front();
-      memcpy(&stim.stimPeriods, ready.pkt.stimPeriods, sizeof(stim.stimPeriods));
-      stim.reset();
-      syncQueue.pop_front();
-      Serial.println("Starting buffered sync sequence");
-    }
-  }
+  // Feed validated cycles from the queue to stim one ahead of playback
+  handOffQueue();
+  // Check a firmware image the controller finished sending
+  FwTransfer::update(fwTransfer, bleSyncCtx);
 #endif
 
-  if (stim.isFinished()) {
-      #ifdef CONTROLLER
-      if (BleSync::isConnected(bleSyncCtx)) {
-        Serial.println("Sequence complete");
-        Serial.println("Begin New Pattern:");
-        stim.begin(analogRead(0));
-        sendSyncPacket();
-      }
-      #endif
-  }
-
-  if (!stim.isActive()) {
-    #ifdef BLUETOOTH
-    // Handle iPhone BLE connection status
-    bool bleIphoneConnected = BleIphone::isConnected(bleIphoneCtx);
-    if (bleIphoneConnected && !lastBleIphoneConnected) {
-      Serial.println(F("[MASTER] iPhone connected via BLE"));
-      BleIphone::write(bleIphoneCtx, std::string("ROLE:MASTER\n"));
-    }
-    lastBleIphoneConnected = bleIphoneConnected;
-
-    // Process iPhone messages
-    auto iphoneLines = BleIphone::readLines(bleIphoneCtx);
-    for (const auto &ln : iphoneLines) {
-      Serial.print(F("[BLE iPhone] Received: "));
-      Serial.println(ln.c_str());
-      // Add iPhone command handling here if needed
-    }
+  static uint32_t lastGeneration = 0;
+  if (stim.generation() != lastGeneration) {
+    lastGeneration = stim.generation();
+    #ifdef CONTROLLER
+    Serial.println("Sequence complete");
+    PwmOutput::printEdgeStats();
+    xSemaphoreTake(syncLock, portMAX_DELAY);
+    NodeTable::print(nodes);
+    xSemaphoreGive(syncLock);
+    Serial.println("Begin New Pattern:");
     #endif
+    #ifdef NODE
+    Serial.println("Starting buffered sync sequence");
+    PwmOutput::printEdgeStats();
+    #endif
+    if (BleSync::droppedFrames(bleSyncCtx) > 0) {
+      Serial.printf("[Sync] rx frames dropped: %u\n", (unsigned)BleSync::droppedFrames(bleSyncCtx));
+    }
+  }
+
+  // Edges run off the timer, so commands are answered mid-stimulation too
+  #ifdef BLUETOOTH
+  // Handle iPhone BLE connection status
+  bool bleIphoneConnected = BleIphone::isConnected(bleIphoneCtx);
+  if (bleIphoneConnected && !lastBleIphoneConnected) {
+    Serial.println(F("[MASTER] iPhone connected via BLE"));
+    BleIphone::write(bleIphoneCtx, std::string("ROLE:MASTER\n"));
+  }
+  lastBleIphoneConnected = bleIphoneConnected;
+
+  // Process iPhone messages
+  auto iphoneLines = BleIphone::readLines(bleIphoneCtx);
+  for (const auto &ln : iphoneLines) {
+    Serial.print(F("[BLE iPhone] Received: "));
+    Serial.println(ln.c_str());
+    handleCommand(ln, iphoneWrite);
+  }
+  #endif
+
+  // A controller runs the background task every boot: it also checks the
+  // node image it passes on. A node skips its own WiFi check while
+  // getting an image from the controller.
+  #ifdef CONTROLLER
+  bool backgroundWanted = true;
+  #else
+  bool backgroundWanted = otaDue && FwTransfer::idle(fwTransfer);
+  #endif
+  if (backgroundWanted && !OTA::backgroundStarted() &&
+      (syncEstablished() || millis() > OTA_START_FALLBACK_MS)) {
+    OTA::startBackgroundCheck(otaDue);
   }
 
   #ifdef POWER_SAVER
@@ -0,0 +1,274 @@
+#!/usr/bin/env python3
+"""Make, apply and inspect delta patches between two firmware images.
+
+    tools/ota_delta.py make  controller_v19.bin controller_v20.bin controller_19_20.cmdp
+    tools/ota_delta.py apply controller_v19.bin controller_19_20.cmdp out.bin
+    tools/ota_delta.py info  controller_19_20.cmdp
+
+The device rebuilds the new image from the one it is running
+(include/ota_delta.h). Matching is bsdiff-style: exact matches found
+through a block index are stretched over nearby bytes that mostly agree,
+so code that only moved, and whose pointers shifted, becomes a byte-wise
+difference that is mostly zeros. Those zeros are run-length coded, which
+keeps the patch small without a decompressor on the device.
+
+Format, little-endian, lengths as LEB128 varints:
+    "CMDP" u8 version=1, u32 old_size, u32 new_size,
+    old_sha256[32], new_sha256[32], then ops until END:
+    0x00 END
+    0x01 ADD    from, len, then (same, diff, diff bytes) runs covering len:
+                `same` bytes copied from old[from..], `diff` bytes each
+                added (mod 256) to the old byte at the same place
+    0x02 INSERT len, bytes
+"""
+import argparse
+import hashlib
+import struct
+import sys
+
+MAGIC = b"CMDP"
+VERSION = 1
+OP_END, OP_ADD, OP_INSERT = 0, 1, 2
+BLOCK = 16          # exact match needed to anchor a region
+INDEX_STEP = 4      # old offsets indexed (anchors are found within this of any alignment)
+CANDIDATES = 8      # old offsets tried per block
+
+
+def varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def read_varint(data, pos):
+    v = shift = 0
+    while True:
+        b = data[pos]
+        pos += 1
+        v |= (b & 0x7F) << shift
+        shift += 7
+        if not b & 0x80:
+            return v, pos
+
+
+def find_matches(old, new):
+    """Exact matches (new_pos, old_pos, length), in new order, not overlapping."""
+    index = {}
+    for p in range(0, len(old) - BLOCK + 1, INDEX_STEP):
+        lst = index.setdefault(old[p:p + BLOCK], [])
+        if len(lst) < CANDIDATES:
+            lst.append(p)
+
+    matches = []
+    scan, last_off = 0, 0
+    while scan <= len(new) - BLOCK:
+        cands = index.get(new[scan:scan + BLOCK])
+        if not cands:
+            scan += 1
+            continue
+        best_p, best_len = -1, 0
+        for p in cands:
+            n = BLOCK
+            while scan + n < len(new) and p + n < len(old) and new[scan + n] == old[p + n]:
+                n += 1
+            # Prefer staying at the previous offset; it merges into one ADD
+            if n > best_len or (n == best_len and p - scan == last_off):
+                best_p, best_len = p, n
+        # Stretch back over bytes the index step skipped
+        while (scan > 0 and best_p > 0 and (not matches or scan > matches[-1][0] + matches[-1][2])
+               and new[scan - 1] == old[best_p - 1]):
+            scan, best_p, best_len = scan - 1, best_p - 1, best_len + 1
+        matches.append((scan, best_p, best_len))
+        last_off = best_p - scan
+        scan += best_len
+    return matches
+
+
+def fuzzy_forward(old, new, new_pos, old_pos, limit):
+    """Bytes past new_pos worth treating as a difference against old_pos."""
+    best, score, best_score = 0, 0, 0
+    for i in range(limit):
+        if old_pos + i >= len(old):
+            break
+        score += 1 if new[new_pos + i] == old[old_pos + i] else -1
+        if score > best_score:
+            best, best_score = i + 1, score
+    return best
+
+
+def fuzzy_backward(old, new, new_end, old_end, limit):
+    best, score, best_score = 0, 0, 0
+    for i in range(1, limit + 1):
+        if old_end - i < 0:
+            break
+        score += 1 if new[new_end - i] == old[old_end - i] else -1
+        if score > best_score:
+            best, best_score = i, score
+    return best
+
+
+def segments(old, new):
+    """Cover new with (new_pos, length, old_pos or None for literal bytes)."""
+    matches = find_matches(old, new)
+    segs = []
+    pos = 0
+    prev = None  # (new_end, old_end) of the last region against old
+    for i, (mn, mo, ml) in enumerate(matches):
+        gap = mn - pos
+        fwd = fuzzy_forward(old, new, pos, prev[1], gap) if prev and gap else 0
+        back = fuzzy_backward(old, new, mn, mo, gap - fwd) if gap - fwd > 0 else 0
+        if fwd:
+            segs.append((pos, fwd, prev[1]))
+        if gap - fwd - back:
+            segs.append((pos + fwd, gap - fwd - back, None))
+        segs.append((mn - back, ml + back, mo - back))
+        pos = mn + ml
+        prev = (pos, mo + ml)
+    tail = len(new) - pos
+    if tail:
+        fwd = fuzzy_forward(old, new, pos, prev[1], tail) if prev else 0
+        if fwd:
+            segs.append((pos, fwd, prev[1]))
+        if tail - fwd:
+            segs.append((pos + fwd, tail - fwd, None))
+
+    # Merge neighbours that continue at the same old offset
+    merged = []
+    for s in segs:
+        if merged:
+            p = merged[-1]
+            if p[0] + p[1] == s[0]:
+                if p[2] is None and s[2] is None:
+                    merged[-1] = (p[0], p[1] + s[1], None)
+                    continue
+                if p[2] is not None and s[2] is not None and p[2] + p[1] == s[2]:
+                    merged[-1] = (p[0], p[1] + s[1], p[2])
+                    continue
+        merged.append(s)
+    return merged
+
+
+def encode_add(old, new, new_pos, length, old_pos):
+    out = bytearray([OP_ADD]) + varint(old_pos) + varint(length)
+    i = 0
+    while i < length:
+        same = 0
+        while i + same < length and new[new_pos + i + same] == old[old_pos + i + same]:
+            same += 1
+        i += same
+        diff = bytearray()
+        # End the difference at the first run of 4 equal bytes
+        while i < length:
+            j = 0
+            while j < 4 and i + j < length and new[new_pos + i + j] == old[old_pos + i + j]:
+                j += 1
+            if j == 4 or (j and i + j == length):
+                break
+            diff.append((new[new_pos + i] - old[old_pos + i]) & 0xFF)
+            i += 1
+        out += varint(same) + varint(len(diff)) + diff
+    return out
+
+
+def make(old, new):
+    out = bytearray(MAGIC) + struct.pack("<BII", VERSION, len(old), len(new))
+    out += hashlib.sha256(old).digest() + hashlib.sha256(new).digest()
+    for new_pos, length, old_pos in segments(old, new):
+        if old_pos is None:
+            out += bytes([OP_INSERT]) + varint(length) + new[new_pos:new_pos + length]
+        else:
+            out += encode_add(old, new, new_pos, length, old_pos)
+    out.append(OP_END)
+    return bytes(out)
+
+
+def parse_header(patch):
+    if patch[:4] != MAGIC:
+        raise ValueError("not a CMDP patch")
+    version, old_size, new_size = struct.unpack_from("<BII", patch, 4)
+    if version != VERSION:
+        raise ValueError("unsupported patch version %d" % version)
+    old_sha = patch[13:45]
+    new_sha = patch[45:77]
+    return old_size, new_size, old_sha, new_sha, 77
+
+
+def apply(old, patch):
+    old_size, new_size, old_sha, new_sha, pos = parse_header(patch)
+    if len(old) < old_size or hashlib.sha256(old[:old_size]).digest() != old_sha:
+        raise ValueError("patch was made from a different image")
+    new = bytearray()
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_INSERT:
+            n, pos = read_varint(patch, pos)
+            new += patch[pos:pos + n]
+            pos += n
+        elif op == OP_ADD:
+            src, pos = read_varint(patch, pos)
+            n, pos = read_varint(patch, pos)
+            done = 0
+            while done < n:
+                same, pos = read_varint(patch, pos)
+                diff, pos = read_varint(patch, pos)
+                new += old[src + done:src + done + same]
+                done += same
+                for k in range(diff):
+                    new.append((old[src + done + k] + patch[pos + k]) & 0xFF)
+                pos += diff
+                done += diff
+        else:
+            raise ValueError("bad op %d at %d" % (op, pos - 1))
+    if len(new) != new_size or hashlib.sha256(new).digest() != new_sha:
+        raise ValueError("patched image doesn't match")
+    return bytes(new)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    sub = ap.add_subparsers(dest="cmd", required=True)
+    m = sub.add_parser("make", help="write a patch from OLD to NEW")
+    m.add_argument("old")
+    m.add_argument("new")
+    m.add_argument("patch")
+    a = sub.add_parser("apply", help="rebuild NEW from OLD and a patch")
+    a.add_argument("old")
+    a.add_argument("patch")
+    a.add_argument("new")
+    i = sub.add_parser("info", help="print a patch's header")
+    i.add_argument("patch")
+    args = ap.parse_args()
+
+    if args.cmd == "make":
+        old = open(args.old, "rb").read()
+        new = open(args.new, "rb").read()
+        patch = make(old, new)
+        if apply(old, patch) != new:
+            sys.exit("patch doesn't round-trip")
+        open(args.patch, "wb").write(patch)
+        print("%s: %d bytes (%.1f%% of %d), sha256 of new image %s"
+              % (args.patch, len(patch), 100.0 * len(patch) / len(new), len(new),
+                 hashlib.sha256(new).hexdigest()))
+    elif args.cmd == "apply":
+        new = apply(open(args.old, "rb").read(), open(args.patch, "rb").read())
+        open(args.new, "wb").write(new)
+        print("%s: %d bytes" % (args.new, len(new)))
+    else:
+        patch = open(args.patch, "rb").read()
+        old_size, new_size, old_sha, new_sha, _ = parse_header(patch)
+        print("old %d bytes sha256 %s" % (old_size, old_sha.hex()))
+        print("new %d bytes sha256 %s" % (new_size, new_sha.hex()))
+        print("patch %d bytes" % len(patch))
+
+
+if __name__ == "__main__":
+    main()
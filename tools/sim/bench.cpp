@@ -0,0 +1,271 @@
+// cmco_bench: sweep the simulation over link conditions and report sync
+// accuracy per point, as CSV or JSON, for comparing firmware versions
+//
+// Every comma-separated value of every swept option is combined with every
+// other, and each combination runs once per seed. Each run is forked off so
+// it starts from fresh firmware globals, and runs go --jobs at a time.
+#include "sim.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+struct Point {
+  uint32_t latencyUs;
+  uint32_t jitterUs;
+  Sim::Jitter jitter;
+  double loss;
+  double driftPpm;
+  uint32_t seed;
+};
+
+// Sent from the child back to the parent as raw bytes
+struct Result {
+  uint32_t matched;
+  uint32_t unmatched;
+  double p50Us;
+  double p99Us;
+  double maxUs;
+  double offsetP99Us;
+  int64_t convergenceUs;
+  uint32_t cycles;          // controller cycles started
+  uint32_t nodeCyclesMin;   // fewest cycles any node started
+  uint32_t frames;          // frames sent by all boards
+};
+
+struct Run {
+  Point point;
+  Result result;
+  bool ok;
+  pid_t pid;
+  int fd;
+};
+
+template <class T>
+std::vector<T> parseList(const char *s, T (*conv)(const char *)) {
+  std::vector<T> out;
+  std::string item;
+  for (const char *p = s;; p++) {
+    if (*p == ',' || *p == 0) {
+      if (!item.empty()) out.push_back(conv(item.c_str()));
+      item.clear();
+      if (*p == 0) break;
+    } else {
+      item += *p;
+    }
+  }
+  return out;
+}
+
+uint32_t toU32(const char *s) { return (uint32_t)strtoul(s, nullptr, 0); }
+double toDouble(const char *s) { return atof(s); }
+Sim::Jitter toJitter(const char *s) { return strcmp(s, "uniform") ? Sim::Jitter::EXPONENTIAL : Sim::Jitter::UNIFORM; }
+
+const char *jitterName(Sim::Jitter j) {
+  return j == Sim::Jitter::UNIFORM ? "uniform" : "exp";
+}
+
+Result runPoint(const Sim::Options &opt, double warmupS, uint32_t convergeUs) {
+  Sim::World world(opt);
+  world.run();
+
+  Result r = {};
+  uint64_t from = (uint64_t)(warmupS * 1e6) + opt.maxBootSkewUs;
+  Sim::Alignment a = Sim::edgeAlignment(world, from);
+  r.matched = a.matched;
+  r.unmatched = a.unmatched;
+  r.p50Us = a.error.p50;
+  r.p99Us = a.error.p99;
+  r.maxUs = a.error.max;
+
+  std::vector<double> offsets;
+  for (Sim::Device *d : world.devices()) {
+    for (const Sim::OffsetSample &s : d->offsets) {
+      if (s.trueUs >= from) offsets.push_back((double)s.errorUs);
+    }
+  }
+  r.offsetP99Us = Sim::summarize(offsets).p99;
+  r.convergenceUs = Sim::convergenceUs(world, convergeUs);
+
+  r.nodeCyclesMin = UINT32_MAX;
+  for (Sim::Device *d : world.devices()) {
+    r.frames += d->framesSent;
+    if (d == world.controller()) r.cycles = d->fw->cycles();
+    else r.nodeCyclesMin = std::min(r.nodeCyclesMin, d->fw->cycles());
+  }
+  return r;
+}
+
+bool readAll(int fd, void *buf, size_t len) {
+  uint8_t *p = (uint8_t *)buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+void finish(Run &run) {
+  run.ok = readAll(run.fd, &run.result, sizeof(Result));
+  close(run.fd);
+  int status = 0;
+  waitpid(run.pid, &status, 0);
+  run.ok = run.ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void usage() {
+  printf("usage: cmco_bench [options]   (swept options take comma-separated lists)\n"
+         "  --latency-us LIST  fixed one-way radio delay (default 1000,2000,5000)\n"
+         "  --jitter-us LIST   random delay: uniform width or exponential mean (default 200,1000)\n"
+         "  --jitter LIST      uniform,exp (default uniform,exp)\n"
+         "  --loss LIST        frame loss probability (default 0,0.05,0.2)\n"
+         "  --drift-ppm LIST   node clocks drift up to +-PPM (default 10,40)\n"
+         "  --seeds N          runs per point, seeds 1..N (default 1)\n"
+         "  --nodes N          nodes besides the controller (default 2)\n"
+         "  --seconds S        simulated time per run (default 60)\n"
+         "  --warmup S         ignore edges before this (default 8)\n"
+         "  --converge-us US   offset error that counts as converged (default 500)\n"
+         "  --jobs N           runs at a time (default: online CPUs)\n"
+         "  --format csv|json  (default csv)\n"
+         "  --label TEXT       tag every row, e.g. the firmware version\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<uint32_t> latencies = {1000, 2000, 5000};
+  std::vector<uint32_t> jitters = {200, 1000};
+  std::vector<Sim::Jitter> kinds = {Sim::Jitter::UNIFORM, Sim::Jitter::EXPONENTIAL};
+  std::vector<double> losses = {0.0, 0.05, 0.2};
+  std::vector<double> drifts = {10.0, 40.0};
+  uint32_t seeds = 1;
+  Sim::Options base;
+  base.nodes = 2;
+  base.seconds = 60.0;
+  double warmup = 8.0;
+  uint32_t convergeUs = 500;
+  long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  bool json = false;
+  std::string label;
+
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (!strcmp(a, "--help") || !v) {
+      usage();
+      return strcmp(a, "--help") ? 2 : 0;
+    }
+    if (!strcmp(a, "--latency-us")) latencies = parseList(v, toU32);
+    else if (!strcmp(a, "--jitter-us")) jitters = parseList(v, toU32);
+    else if (!strcmp(a, "--jitter")) kinds = parseList(v, toJitter);
+    else if (!strcmp(a, "--loss")) losses = parseList(v, toDouble);
+    else if (!strcmp(a, "--drift-ppm")) drifts = parseList(v, toDouble);
+    else if (!strcmp(a, "--seeds")) seeds = toU32(v);
+    else if (!strcmp(a, "--nodes")) base.nodes = (uint8_t)toU32(v);
+    else if (!strcmp(a, "--seconds")) base.seconds = atof(v);
+    else if (!strcmp(a, "--warmup")) warmup = atof(v);
+    else if (!strcmp(a, "--converge-us")) convergeUs = toU32(v);
+    else if (!strcmp(a, "--jobs")) jobs = atol(v);
+    else if (!strcmp(a, "--format")) json = !strcmp(v, "json");
+    else if (!strcmp(a, "--label")) label = v;
+    else {
+      usage();
+      return 2;
+    }
+    i++;
+  }
+  if (jobs < 1) jobs = 1;
+
+  std::vector<Run> runs;
+  for (uint32_t lat : latencies)
+    for (uint32_t jit : jitters)
+      for (Sim::Jitter kind : kinds)
+        for (double loss : losses)
+          for (double drift : drifts)
+            for (uint32_t seed = 1; seed <= seeds; seed++) {
+              Run r = {};
+              r.point = Point{lat, jit, kind, loss, drift, seed};
+              runs.push_back(r);
+            }
+
+  // Fork each run; keep at most `jobs` in flight
+  fflush(stdout);
+  size_t done = 0;
+  for (size_t i = 0; i < runs.size(); i++) {
+    if ((long)(i - done) >= jobs) finish(runs[done++]);
+
+    Run &run = runs[i];
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return 1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return 1;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      Sim::Options opt = base;
+      opt.link.latencyUs = run.point.latencyUs;
+      opt.link.jitterUs = run.point.jitterUs;
+      opt.link.jitter = run.point.jitter;
+      opt.link.loss = run.point.loss;
+      opt.driftPpm = run.point.driftPpm;
+      opt.seed = run.point.seed;
+      Result r = runPoint(opt, warmup, convergeUs);
+      bool ok = write(fds[1], &r, sizeof(r)) == (ssize_t)sizeof(r);
+      _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    run.pid = pid;
+    run.fd = fds[0];
+  }
+  while (done < runs.size()) finish(runs[done++]);
+
+  int failed = 0;
+  if (json) printf("[\n");
+  else printf("label,latency_us,jitter_us,jitter,loss,drift_ppm,seed,ok,edges_matched,edges_unmatched,"
+              "align_p50_us,align_p99_us,align_max_us,offset_p99_us,convergence_s,cycles,"
+              "node_cycles_min,packets_per_cycle\n");
+  for (size_t i = 0; i < runs.size(); i++) {
+    const Run &run = runs[i];
+    const Point &p = run.point;
+    const Result &r = run.result;
+    if (!run.ok) failed++;
+    double conv = r.convergenceUs < 0 ? -1.0 : r.convergenceUs / 1e6;
+    double ppc = r.cycles ? (double)r.frames / r.cycles : 0.0;
+    if (json) {
+      printf("  {\"label\": \"%s\", \"latency_us\": %u, \"jitter_us\": %u, \"jitter\": \"%s\", "
+             "\"loss\": %g, \"drift_ppm\": %g, \"seed\": %u, \"ok\": %s, "
+             "\"edges_matched\": %u, \"edges_unmatched\": %u, "
+             "\"align_p50_us\": %.1f, \"align_p99_us\": %.1f, \"align_max_us\": %.1f, "
+             "\"offset_p99_us\": %.1f, \"convergence_s\": %.3f, \"cycles\": %u, "
+             "\"node_cycles_min\": %u, \"packets_per_cycle\": %.2f}%s\n",
+             label.c_str(), p.latencyUs, p.jitterUs, jitterName(p.jitter), p.loss, p.driftPpm, p.seed,
+             run.ok ? "true" : "false", r.matched, r.unmatched, r.p50Us, r.p99Us, r.maxUs,
+             r.offsetP99Us, conv, r.cycles, r.nodeCyclesMin, ppc,
+             i + 1 < runs.size() ? "," : "");
+    } else {
+      printf("%s,%u,%u,%s,%g,%g,%u,%d,%u,%u,%.1f,%.1f,%.1f,%.1f,%.3f,%u,%u,%.2f\n",
+             label.c_str(), p.latencyUs, p.jitterUs, jitterName(p.jitter), p.loss, p.driftPpm, p.seed,
+             run.ok ? 1 : 0, r.matched, r.unmatched, r.p50Us, r.p99Us, r.maxUs,
+             r.offsetP99Us, conv, r.cycles, r.nodeCyclesMin, ppc);
+    }
+  }
+  if (json) printf("]\n");
+
+  if (failed) fprintf(stderr, "cmco_bench: %d of %zu runs failed\n", failed, runs.size());
+  return failed ? 1 : 0;
+}
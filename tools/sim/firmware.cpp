@@ -0,0 +1,105 @@
+// One simulated board's copy of the firmware.
+//
+// Built once per board with -DSIM_NS=<name> and -DCONTROLLER or -DNODE, so
+// every board gets its own globals. The shims and standard headers are
+// included here first, outside the namespace; their include guards then
+// keep the firmware's own #includes from pulling them into SIM_NS.
+#include "Arduino.h"
+#include "WiFi.h"
+#include "WiFiClientSecure.h"
+#include "HTTPClient.h"
+#include "Update.h"
+#include "ArduinoJson.h"
+#include "Preferences.h"
+#include "esp_wifi.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "esp_now.h"
+#include "NimBLEDevice.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "sim.h"
+
+#ifndef SIM_NS
+#error "build each firmware copy with -DSIM_NS=<name>"
+#endif
+
+namespace SIM_NS {
+#include "main.ino"
+#include "buzzer_tunes.cpp"
+}
+
+#define SIM_STR2(x) #x
+#define SIM_STR(x) SIM_STR2(x)
+
+namespace {
+
+uint32_t cycles() {
+  return SIM_NS::stim.generation();
+}
+
+#ifdef NODE
+bool offsetEstimate(int64_t localUs, int64_t &offsetUs) {
+  if (!SIM_NS::ClockSync::isValid(SIM_NS::clockSync)) return false;
+  offsetUs = SIM_NS::ClockSync::offsetAt(SIM_NS::clockSync, localUs);
+  return true;
+}
+#endif
+
+#ifdef CONTROLLER
+// Stands in for OTA::updateNodeImage(): random bytes in the inactive slot,
+// recorded the same way, one version ahead of the nodes
+void seedNodeImage(uint32_t bytes) {
+  using namespace SIM_NS;
+  OTA::NodeImage image;
+  image.part = OtaPartition::target();
+  image.version = FW_VERSION + 1;
+  image.size = bytes;
+
+  OtaWriteContext writer;
+  OtaPartition::begin(writer, image.part, 0);
+  uint8_t buf[256];
+  for (uint32_t at = 0; at < bytes; at += sizeof(buf)) {
+    for (uint8_t &b : buf) b = (uint8_t)esp_random();
+    OtaPartition::write(writer, buf, std::min((uint32_t)sizeof(buf), bytes - at));
+  }
+  OtaPartition::flush(writer);
+  OtaPartition::end(writer);
+  OtaPartition::sha256(image.part, image.size, image.sha256);
+  OTA::saveNodeImage(image);
+}
+#endif
+
+struct Registrar {
+  Registrar() {
+    Sim::Firmware fw;
+    fw.ns = SIM_STR(SIM_NS);
+#ifdef CONTROLLER
+    fw.controller = true;
+    fw.offsetEstimate = nullptr;
+    fw.seedNodeImage = seedNodeImage;
+#else
+    fw.controller = false;
+    fw.offsetEstimate = offsetEstimate;
+    fw.seedNodeImage = nullptr;
+#endif
+    fw.setup = SIM_NS::setup;
+    fw.loop = SIM_NS::loop;
+    fw.cycles = cycles;
+    Sim::firmwares().push_back(fw);
+  }
+} registrar;
+
+} // namespace
@@ -0,0 +1,646 @@
+// Bodies of the shims in shims/, on top of the simulation in sim.cpp
+#include "Arduino.h"
+#include "WiFi.h"
+#include "Preferences.h"
+#include "esp_wifi.h"
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "Update.h"
+#include "esp_now.h"
+#include "sim.h"
+
+#include <cstdarg>
+#include <deque>
+#include <map>
+
+using Sim::current;
+using Sim::world;
+
+SimSerial Serial;
+EspClass ESP;
+SimWiFi WiFi;
+UpdateClass Update;
+
+// ---------------- Time and randomness ----------------
+
+uint32_t millis() {
+  return (uint32_t)(current().localNow() / 1000);
+}
+
+uint32_t micros() {
+  return (uint32_t)current().localNow();
+}
+
+void delay(uint32_t ms) {
+  world().delayLocal(current(), (uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(uint32_t us) {
+  world().delayLocal(current(), us);
+}
+
+uint32_t esp_random() {
+  return current().rng();
+}
+
+long random(long max) {
+  return max <= 0 ? 0 : (long)(current().userRng() % (unsigned long)max);
+}
+
+long random(long min, long max) {
+  return max <= min ? min : min + random(max - min);
+}
+
+void randomSeed(unsigned long seed) {
+  if (seed != 0) current().userRng.seed(seed);
+}
+
+void esp_sleep_enable_timer_wakeup(uint64_t) {}
+void esp_light_sleep_start() {}
+
+void EspClass::restart() {
+  fprintf(stderr, "sim: %s restarted\n", current().name.c_str());
+  abort();
+}
+
+// ---------------- LEDC ----------------
+
+uint32_t ledcSetup(uint8_t channel, uint32_t freq, uint8_t) {
+  if (channel >= 16) return 0;
+  current().freq[channel] = freq;
+  return freq;
+}
+
+void ledcAttachPin(uint8_t, uint8_t) {}
+
+void ledcWrite(uint8_t channel, uint32_t duty) {
+  if (channel >= 16) return;
+  Sim::Device &d = current();
+  if (d.duty[channel] == duty) return;
+  d.duty[channel] = duty;
+  d.edges.push_back(Sim::Edge{world().now(), d.localNow(), channel, duty});
+}
+
+uint32_t ledcWriteTone(uint8_t channel, uint32_t freq) {
+  ledcSetup(channel, freq, 10);
+  ledcWrite(channel, freq ? 512 : 0);
+  return freq;
+}
+
+// ---------------- Serial ----------------
+
+size_t SimSerial::print(const char *s) {
+  world().log(current(), s);
+  return strlen(s);
+}
+
+size_t SimSerial::print(char c) {
+  world().log(current(), std::string(1, c));
+  return 1;
+}
+
+size_t SimSerial::print(long long v, int base) {
+  if (v < 0 && base == DEC) return print("-") + print((unsigned long long)-v, base);
+  return print((unsigned long long)v, base);
+}
+
+size_t SimSerial::print(unsigned long long v, int base) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), base == HEX ? "%llX" : "%llu", v);
+  return print(buf);
+}
+
+size_t SimSerial::print(double v, int digits) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.*f", digits, v);
+  return print(buf);
+}
+
+size_t SimSerial::printf(const char *fmt, ...) {
+  char buf[512];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  print(buf);
+  return n < 0 ? 0 : (size_t)n;
+}
+
+int SimSerial::available() {
+  return (int)current().serialIn.size();
+}
+
+int SimSerial::read() {
+  std::string &in = current().serialIn;
+  if (in.empty()) return -1;
+  int c = (uint8_t)in[0];
+  in.erase(0, 1);
+  return c;
+}
+
+size_t SimSerial::write(const uint8_t *data, size_t len) {
+  world().log(current(), std::string((const char *)data, len));
+  return len;
+}
+
+// ---------------- WiFi ----------------
+
+bool SimWiFi::mode(int) {
+  return true;
+}
+
+bool SimWiFi::disconnect(bool, bool) {
+  return true;
+}
+
+String SimWiFi::macAddress() {
+  const uint8_t *m = current().mac;
+  char buf[18];
+  snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X", m[0], m[1], m[2], m[3], m[4], m[5]);
+  return String(buf);
+}
+
+uint8_t *SimWiFi::macAddress(uint8_t *mac) {
+  memcpy(mac, current().mac, 6);
+  return mac;
+}
+
+int32_t SimWiFi::channel() {
+  return current().channel;
+}
+
+esp_err_t esp_wifi_set_channel(uint8_t primary, wifi_second_chan_t) {
+  current().channel = primary;
+  return ESP_OK;
+}
+
+esp_err_t esp_wifi_get_channel(uint8_t *primary, wifi_second_chan_t *second) {
+  *primary = current().channel;
+  *second = WIFI_SECOND_CHAN_NONE;
+  return ESP_OK;
+}
+
+// ---------------- OTA slots ----------------
+
+// Two app slots per board, held in Device::flash. Flash semantics are
+// kept: erase sets bytes to 0xFF and a write can only clear bits.
+static const esp_partition_t g_slots[2] = {
+  {0x010000, SIM_SLOT_BYTES, "app0"},
+  {0x1F0000, SIM_SLOT_BYTES, "app1"},
+};
+
+static std::vector<uint8_t> *slotFlash(const esp_partition_t *part, size_t offset, size_t size) {
+  if (part != &g_slots[0] && part != &g_slots[1]) return nullptr;
+  if (offset > part->size || size > part->size - offset) return nullptr;
+  std::vector<uint8_t> &flash = current().flash[part - g_slots];
+  if (flash.empty()) flash.assign(part->size, 0xFF);
+  return &flash;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *) {
+  return &g_slots[1 - current().runningSlot];
+}
+
+const esp_partition_t *esp_ota_get_running_partition() {
+  return &g_slots[current().runningSlot];
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *part) {
+  if (part != &g_slots[0] && part != &g_slots[1]) return ESP_FAIL;
+  current().bootSlot = (int8_t)(part - g_slots);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size) {
+  std::vector<uint8_t> *flash = slotFlash(part, offset, size);
+  if (!flash || offset % 4096 || size % 4096) return ESP_FAIL;
+  std::fill(flash->begin() + offset, flash->begin() + offset + size, 0xFF);
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size) {
+  std::vector<uint8_t> *flash = slotFlash(part, offset, size);
+  if (!flash) return ESP_FAIL;
+  for (size_t i = 0; i < size; i++) (*flash)[offset + i] &= ((const uint8_t *)src)[i];
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size) {
+  std::vector<uint8_t> *flash = slotFlash(part, offset, size);
+  if (!flash) return ESP_FAIL;
+  memcpy(dst, flash->data() + offset, size);
+  return ESP_OK;
+}
+
+// ---------------- SHA-256 ----------------
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256Block(mbedtls_sha256_context *ctx, const uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t v[8];
+  memcpy(v, ctx->state, sizeof(v));
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = v[7] + (rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25)) +
+                  ((v[4] & v[5]) ^ (~v[4] & v[6])) + SHA256_K[i] + w[i];
+    uint32_t t2 = (rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22)) +
+                  ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+    memmove(v + 1, v, 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + t2;
+  }
+  for (int i = 0; i < 8; i++) ctx->state[i] += v[i];
+}
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *) {}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  if (is224) return -1;
+  memcpy(ctx->state, init, sizeof(init));
+  ctx->total = 0;
+  return 0;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    ctx->buffer[ctx->total++ % 64] = input[i];
+    if (ctx->total % 64 == 0) sha256Block(ctx, ctx->buffer);
+  }
+  return 0;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32]) {
+  uint64_t bits = ctx->total * 8;
+  uint8_t pad = 0x80;
+  mbedtls_sha256_update_ret(ctx, &pad, 1);
+  pad = 0;
+  while (ctx->total % 64 != 56) mbedtls_sha256_update_ret(ctx, &pad, 1);
+  for (int i = 7; i >= 0; i--) {
+    uint8_t b = (uint8_t)(bits >> (i * 8));
+    mbedtls_sha256_update_ret(ctx, &b, 1);
+  }
+  for (int i = 0; i < 32; i++) output[i] = (uint8_t)(ctx->state[i / 4] >> (24 - (i % 4) * 8));
+  return 0;
+}
+
+// ---------------- Preferences ----------------
+
+bool Preferences::begin(const char *name, bool readOnly) {
+  _ns = std::string(name) + "/";
+  _readOnly = readOnly;
+  return true;
+}
+
+bool Preferences::clear() {
+  if (_ns.empty() || _readOnly) return false;
+  std::map<std::string, std::string> &nvs = current().nvs;
+  for (auto it = nvs.begin(); it != nvs.end();) {
+    it = it->first.compare(0, _ns.size(), _ns) == 0 ? nvs.erase(it) : std::next(it);
+  }
+  return true;
+}
+
+bool Preferences::remove(const char *key) {
+  if (_ns.empty() || _readOnly) return false;
+  return current().nvs.erase(_ns + key) > 0;
+}
+
+bool Preferences::isKey(const char *key) {
+  return !_ns.empty() && current().nvs.count(_ns + key) > 0;
+}
+
+size_t Preferences::putBytes(const char *key, const void *value, size_t len) {
+  if (_ns.empty() || _readOnly) return 0;
+  current().nvs[_ns + key] = std::string((const char *)value, len);
+  return len;
+}
+
+size_t Preferences::getBytesLength(const char *key) {
+  if (_ns.empty()) return 0;
+  auto it = current().nvs.find(_ns + key);
+  return it == current().nvs.end() ? 0 : it->second.size();
+}
+
+size_t Preferences::getBytes(const char *key, void *buf, size_t maxLen) {
+  size_t len = getBytesLength(key);
+  if (len == 0 || len > maxLen) return 0;
+  memcpy(buf, current().nvs[_ns + key].data(), len);
+  return len;
+}
+
+String Preferences::getString(const char *key, const String &def) {
+  if (!isKey(key)) return def;
+  return String(current().nvs[_ns + key]);
+}
+
+// ---------------- esp_timer ----------------
+
+// A timer's callback runs as an event of its own on the board that made it
+struct esp_timer {
+  Sim::Device *dev;
+  esp_timer_cb_t cb;
+  void *arg;
+  bool armed;
+  bool deleted;
+  uint64_t gen;       // bumped on every start/stop; stale events drop out
+  uint64_t periodUs;
+};
+
+int64_t esp_timer_get_time() {
+  return current().localNow();
+}
+
+int esp_timer_create(const esp_timer_create_args_t *args, esp_timer_handle_t *out) {
+  esp_timer *t = new esp_timer();
+  t->dev = &current();
+  t->cb = args->callback;
+  t->arg = args->arg;
+  *out = t;
+  return ESP_OK;
+}
+
+static void armTimer(esp_timer *t, uint64_t timeoutUs) {
+  uint64_t gen = t->gen;
+  uint64_t when = t->dev->trueAt(t->dev->localNow() + (int64_t)timeoutUs);
+  world().at(when, t->dev, [t, gen]() {
+    if (t->gen != gen || !t->armed || t->deleted) return;
+    if (t->periodUs) {
+      armTimer(t, t->periodUs);
+    } else {
+      t->armed = false;
+    }
+    t->cb(t->arg);
+  });
+}
+
+int esp_timer_start_once(esp_timer_handle_t t, uint64_t timeoutUs) {
+  if (t->armed) return ESP_ERR_INVALID_STATE;
+  t->armed = true;
+  t->periodUs = 0;
+  t->gen++;
+  armTimer(t, timeoutUs);
+  return ESP_OK;
+}
+
+int esp_timer_start_periodic(esp_timer_handle_t t, uint64_t periodUs) {
+  if (t->armed) return ESP_ERR_INVALID_STATE;
+  t->armed = true;
+  t->periodUs = periodUs;
+  t->gen++;
+  armTimer(t, periodUs);
+  return ESP_OK;
+}
+
+int esp_timer_stop(esp_timer_handle_t t) {
+  if (!t->armed) return ESP_ERR_INVALID_STATE;
+  t->armed = false;
+  t->gen++;
+  return ESP_OK;
+}
+
+int esp_timer_delete(esp_timer_handle_t t) {
+  // Pending events still point here, so the timer is retired, not freed
+  t->armed = false;
+  t->deleted = true;
+  t->gen++;
+  return ESP_OK;
+}
+
+// ---------------- FreeRTOS ----------------
+
+struct SimTask {
+  Sim::Task *task = nullptr;
+  Sim::Device *dev = nullptr;
+  uint32_t notify = 0;
+  bool waiting = false;
+  uint64_t waitGen = 0;
+};
+
+struct SimMutex {
+  bool held = false;
+  std::deque<SimTask *> waiters;
+};
+
+static std::map<Sim::Task *, SimTask *> &taskHandles() {
+  static std::map<Sim::Task *, SimTask *> handles;
+  return handles;
+}
+
+static SimTask *selfTask() {
+  Sim::Task *t = world().currentTask();
+  if (!t) return nullptr;
+  auto it = taskHandles().find(t);
+  return it == taskHandles().end() ? nullptr : it->second;
+}
+
+static void wakeTask(SimTask *st, uint64_t afterUs) {
+  Sim::Task *t = st->task;
+  world().at(world().now() + afterUs, st->dev, [t]() { world().resume(t); });
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t,
+                                   void *arg, UBaseType_t, TaskHandle_t *handle,
+                                   BaseType_t) {
+  SimTask *st = new SimTask();
+  st->dev = &current();
+  st->task = world().createTask(current(), fn, arg, name);
+  taskHandles()[st->task] = st;
+  if (handle) *handle = st;
+  return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack,
+                       void *arg, UBaseType_t priority, TaskHandle_t *handle) {
+  return xTaskCreatePinnedToCore(fn, name, stack, arg, priority, handle, 0);
+}
+
+void vTaskDelete(TaskHandle_t task) {
+  if (!task || task == selfTask()) {
+    // Never resumed again
+    world().block();
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  world().delayLocal(current(), (uint64_t)ticks * 1000);
+}
+
+TickType_t xTaskGetTickCount() {
+  return millis();
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  task->notify++;
+  if (task->waiting) {
+    task->waiting = false;
+    task->waitGen++;
+    wakeTask(task, world().options().taskWakeUs);
+  }
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken) {
+  xTaskNotifyGive(task);
+  if (woken) *woken = pdTRUE;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+  SimTask *self = selfTask();
+  if (!self) {
+    fprintf(stderr, "sim: ulTaskNotifyTake outside a task\n");
+    abort();
+  }
+  if (self->notify == 0 && ticks != 0) {
+    self->waiting = true;
+    if (ticks != portMAX_DELAY) {
+      uint64_t gen = self->waitGen;
+      uint64_t when = self->dev->trueAt(self->dev->localNow() + (int64_t)ticks * 1000);
+      world().at(when, self->dev, [self, gen]() {
+        if (!self->waiting || self->waitGen != gen) return;
+        self->waiting = false;
+        self->waitGen++;
+        world().resume(self->task);
+      });
+    }
+    world().block();
+  }
+  uint32_t value = self->notify;
+  if (clear) {
+    self->notify = 0;
+  } else if (value) {
+    self->notify--;
+  }
+  return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new SimMutex();
+}
+
+// A mutex that starts out taken. Only the BLE build uses one, and the sim
+// never runs that, so a take's timeout isn't modelled.
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  SimMutex *m = new SimMutex();
+  m->held = true;
+  return m;
+}
+
+// Time stands still while code runs, so a mutex can only be held across a
+// point where its holder blocked: a task waits its turn, anything else
+// (loop, a timer) would wait forever and is reported as a deadlock. A
+// zero timeout is a try and never waits.
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t ticks) {
+  if (!m->held) {
+    m->held = true;
+    return pdTRUE;
+  }
+  if (ticks == 0) return pdFALSE;
+  SimTask *self = selfTask();
+  if (!self) {
+    fprintf(stderr, "sim: %s: mutex deadlock outside a task\n", current().name.c_str());
+    abort();
+  }
+  m->waiters.push_back(self);
+  world().block();
+  // Ownership was handed over by xSemaphoreGive
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m) {
+  if (!m->waiters.empty()) {
+    SimTask *next = m->waiters.front();
+    m->waiters.pop_front();
+    wakeTask(next, 0);
+    return pdTRUE;
+  }
+  m->held = false;
+  return pdTRUE;
+}
+
+// ---------------- ESP-NOW ----------------
+
+esp_err_t esp_now_init() {
+  current().espnowReady = true;
+  return ESP_OK;
+}
+
+esp_err_t esp_now_deinit() {
+  Sim::Device &d = current();
+  d.espnowReady = false;
+  d.peers.clear();
+  return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  current().recvCb = cb;
+  return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb) {
+  current().sendCb = [cb](const uint8_t *mac, bool ok) {
+    cb(mac, ok ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+  };
+  return ESP_OK;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *mac) {
+  for (const auto &p : current().peers) {
+    if (memcmp(p.data(), mac, 6) == 0) return true;
+  }
+  return false;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer) {
+  Sim::Device &d = current();
+  if (!d.espnowReady) return ESP_ERR_ESPNOW_NOT_INIT;
+  if (esp_now_is_peer_exist(peer->peer_addr)) return ESP_ERR_ESPNOW_EXIST;
+  d.peers.push_back(std::vector<uint8_t>(peer->peer_addr, peer->peer_addr + 6));
+  return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *mac) {
+  auto &peers = current().peers;
+  for (auto it = peers.begin(); it != peers.end(); ++it) {
+    if (memcmp(it->data(), mac, 6) == 0) {
+      peers.erase(it);
+      return ESP_OK;
+    }
+  }
+  return ESP_ERR_ESPNOW_NOT_FOUND;
+}
+
+esp_err_t esp_now_send(const uint8_t *mac, const uint8_t *data, size_t len) {
+  Sim::Device &d = current();
+  if (!d.espnowReady) return ESP_ERR_ESPNOW_NOT_INIT;
+  if (len == 0 || len > ESP_NOW_MAX_DATA_LEN) return ESP_ERR_ESPNOW_ARG;
+  if (!esp_now_is_peer_exist(mac)) return ESP_ERR_ESPNOW_NOT_FOUND;
+  world().transmit(d, mac, data, len);
+  return ESP_OK;
+}
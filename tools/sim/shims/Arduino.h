@@ -0,0 +1,95 @@
+// Host shim of the Arduino-ESP32 core, just what the firmware uses
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <algorithm>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define ESP_ERR_INVALID_STATE 0x103
+
+#define F(x) (x)
+#define IRAM_ATTR
+#define DEC 10
+#define HEX 16
+
+// Time, on the current board's own clock
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+uint32_t esp_random();
+
+// LEDC: every duty change is recorded as an edge
+uint32_t ledcSetup(uint8_t channel, uint32_t freq, uint8_t resolution);
+void ledcAttachPin(uint8_t pin, uint8_t channel);
+void ledcWrite(uint8_t channel, uint32_t duty);
+uint32_t ledcWriteTone(uint8_t channel, uint32_t freq);
+
+inline bool psramFound() { return false; }
+inline void *ps_malloc(size_t size) { return malloc(size); }
+
+void esp_sleep_enable_timer_wakeup(uint64_t us);
+void esp_light_sleep_start();
+
+class String : public std::string {
+ public:
+  String() {}
+  String(const char *s) : std::string(s ? s : "") {}
+  String(const std::string &s) : std::string(s) {}
+  String(int v) : std::string(std::to_string(v)) {}
+  bool equals(const char *o) const { return *this == o; }
+  bool startsWith(const char *p) const { return rfind(p, 0) == 0; }
+  bool isEmpty() const { return empty(); }
+  int toInt() const { return atoi(c_str()); }
+};
+
+class SimSerial {
+ public:
+  void begin(unsigned long) {}
+  size_t print(const char *s);
+  size_t print(const std::string &s) { return print(s.c_str()); }
+  size_t print(char c);
+  size_t print(int v, int base = DEC) { return print((long long)v, base); }
+  size_t print(unsigned v, int base = DEC) { return print((unsigned long long)v, base); }
+  size_t print(long v, int base = DEC) { return print((long long)v, base); }
+  size_t print(unsigned long v, int base = DEC) { return print((unsigned long long)v, base); }
+  size_t print(long long v, int base = DEC);
+  size_t print(unsigned long long v, int base = DEC);
+  size_t print(double v, int digits = 2);
+  size_t println() { return print("\n"); }
+  template <class T> size_t println(const T &v) { return print(v) + println(); }
+  template <class T> size_t println(const T &v, int fmt) { return print(v, fmt) + println(); }
+  size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  size_t write(const uint8_t *data, size_t len);
+  int available();
+  int read();
+  operator bool() const { return true; }
+};
+extern SimSerial Serial;
+
+class EspClass {
+ public:
+  void restart();
+  uint32_t getFreeHeap() { return 200000; }
+};
+extern EspClass ESP;
+
+#endif // SIM_ARDUINO_H
@@ -0,0 +1,25 @@
+// Host shim of the bits of ArduinoJson the OTA check uses
+#ifndef SIM_ARDUINO_JSON_H
+#define SIM_ARDUINO_JSON_H
+
+#include "Arduino.h"
+
+struct JsonVariant {
+  JsonVariant operator[](const char *) const { return JsonVariant(); }
+  template <class T> T operator|(T fallback) const { return fallback; }
+};
+
+template <size_t N>
+struct StaticJsonDocument {
+  JsonVariant operator[](const char *) const { return JsonVariant(); }
+};
+
+struct DeserializationError {
+  explicit operator bool() const { return true; }
+  const char *c_str() const { return "sim"; }
+};
+
+template <class Doc, class Stream>
+DeserializationError deserializeJson(Doc &, Stream &) { return DeserializationError(); }
+
+#endif // SIM_ARDUINO_JSON_H
@@ -0,0 +1,29 @@
+// Host shim: every request fails
+#ifndef SIM_HTTP_CLIENT_H
+#define SIM_HTTP_CLIENT_H
+
+#include "WiFiClientSecure.h"
+
+#define HTTP_CODE_OK 200
+#define HTTP_CODE_PARTIAL_CONTENT 206
+
+class HTTPClient {
+ public:
+  void setTimeout(uint32_t) {}
+  bool begin(WiFiClient &, const String &) { return false; }
+  bool begin(WiFiClient &, const char *) { return false; }
+  int GET() { return -1; }
+  void end() {}
+  int getSize() { return -1; }
+  WiFiClient *getStreamPtr() { return &_client; }
+  WiFiClient &getStream() { return _client; }
+  void addHeader(const String &, const String &) {}
+  void collectHeaders(const char **, size_t) {}
+  String header(const char *) { return String(); }
+  void setReuse(bool) {}
+
+ private:
+  WiFiClient _client;
+};
+
+#endif // SIM_HTTP_CLIENT_H
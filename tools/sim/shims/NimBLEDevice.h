@@ -0,0 +1,309 @@
+// Host shim of the NimBLE-Arduino 1.x surface the sync link uses. There is
+// no BLE radio model: this only lets the dual-transport firmware compile
+// (the fw_ble_* targets), every call does nothing and no link ever comes up.
+#ifndef SIM_NIMBLE_DEVICE_H
+#define SIM_NIMBLE_DEVICE_H
+
+#include "Arduino.h"
+#include <string>
+#include <vector>
+
+#define ESP_PWR_LVL_P9 9
+
+#define BLE_GAP_LE_PHY_1M 1
+#define BLE_GAP_LE_PHY_2M 2
+#define BLE_GAP_LE_PHY_CODED 3
+#define BLE_GAP_LE_PHY_1M_MASK 0x01
+#define BLE_GAP_LE_PHY_2M_MASK 0x02
+#define BLE_GAP_LE_PHY_CODED_MASK 0x04
+#define BLE_GAP_LE_PHY_CODED_ANY 0
+
+// ---------------- Host ----------------
+
+struct os_mbuf {
+  uint16_t len;
+  uint8_t *data;
+};
+#define OS_MBUF_PKTLEN(om) ((om)->len)
+
+inline int os_mbuf_copydata(const os_mbuf *om, int off, int len, void *dst) {
+  if (off + len > om->len) return -1;
+  memcpy(dst, om->data + off, len);
+  return 0;
+}
+
+#define BLE_GAP_EVENT_CONNECT 0
+#define BLE_GAP_EVENT_DISCONNECT 1
+#define BLE_GAP_EVENT_NOTIFY_RX 12
+#define BLE_GAP_EVENT_MTU 15
+#define BLE_GAP_EVENT_PHY_UPDATE_COMPLETE 20
+#define BLE_GAP_EVENT_DATA_LEN_CHG 34
+
+struct ble_gap_conn_desc {
+  uint16_t conn_handle;
+};
+
+struct ble_gap_event {
+  uint8_t type;
+  union {
+    struct {
+      int status;
+      uint16_t conn_handle;
+    } connect;
+    struct {
+      int reason;
+      ble_gap_conn_desc conn;
+    } disconnect;
+    struct {
+      os_mbuf *om;
+      uint16_t attr_handle;
+      uint16_t conn_handle;
+      uint8_t indication;
+    } notify_rx;
+    struct {
+      uint16_t conn_handle;
+      uint16_t channel_id;
+      uint16_t value;
+    } mtu;
+    struct {
+      int status;
+      uint16_t conn_handle;
+      uint8_t tx_phy;
+      uint8_t rx_phy;
+    } phy_updated;
+    struct {
+      uint16_t conn_handle;
+      uint16_t max_tx_octets;
+      uint16_t max_tx_time;
+      uint16_t max_rx_octets;
+      uint16_t max_rx_time;
+    } data_len_chg;
+  };
+};
+
+inline int ble_gap_set_data_len(uint16_t, uint16_t, uint16_t) { return 0; }
+
+typedef int gap_event_handler(ble_gap_event *event, void *arg);
+
+struct ble_gatt_error {
+  uint16_t status;
+  uint16_t att_handle;
+};
+
+struct ble_gatt_attr {
+  uint16_t handle;
+  uint16_t offset;
+  os_mbuf *om;
+};
+
+typedef int ble_gatt_attr_fn(uint16_t conn_handle, const ble_gatt_error *error, ble_gatt_attr *attr, void *arg);
+
+inline int ble_gattc_write_flat(uint16_t, uint16_t, const void *, uint16_t, ble_gatt_attr_fn *, void *) {
+  return -1;
+}
+
+inline int ble_gattc_write_no_rsp_flat(uint16_t, uint16_t, const void *, uint16_t) { return -1; }
+
+namespace NIMBLE_PROPERTY {
+enum { READ = 0x02, WRITE_NR = 0x04, WRITE = 0x08, NOTIFY = 0x10 };
+}
+
+class NimBLEUUID {
+ public:
+  NimBLEUUID() {}
+  NimBLEUUID(const char *) {}
+  NimBLEUUID(uint16_t) {}
+};
+
+class NimBLEAddress {
+ public:
+  NimBLEAddress() {}
+  NimBLEAddress(const std::string &, uint8_t = 0) {}
+  NimBLEAddress(const uint64_t &addr, uint8_t type = 0) : _type(type) { memcpy(_addr, &addr, 6); }
+  operator uint64_t() const {
+    uint64_t v = 0;
+    memcpy(&v, _addr, 6);
+    return v;
+  }
+  bool operator==(const NimBLEAddress &o) const { return memcmp(_addr, o._addr, 6) == 0; }
+  const uint8_t *getNative() const { return _addr; }
+  uint8_t getType() const { return _type; }
+  std::string toString() const { return "00:00:00:00:00:00"; }
+
+ private:
+  uint8_t _addr[6] = {0};
+  uint8_t _type = 0;
+};
+
+// ---------------- Server ----------------
+
+class NimBLECharacteristic;
+
+class NimBLECharacteristicCallbacks {
+ public:
+  virtual ~NimBLECharacteristicCallbacks() {}
+  virtual void onWrite(NimBLECharacteristic *) {}
+  virtual void onSubscribe(NimBLECharacteristic *, ble_gap_conn_desc *, uint16_t) {}
+};
+
+class NimBLECharacteristic {
+ public:
+  void setCallbacks(NimBLECharacteristicCallbacks *) {}
+  std::string getValue() { return ""; }
+  void setValue(const uint8_t *, size_t) {}
+  void setValue(const std::string &) {}
+  void notify(bool = true) {}
+  uint16_t getHandle() { return 0; }
+};
+
+class NimBLEService {
+ public:
+  NimBLECharacteristic *createCharacteristic(const char *, uint32_t, uint16_t = 512) { return &_chr; }
+  bool start() { return true; }
+
+ private:
+  NimBLECharacteristic _chr;
+};
+
+class NimBLEServer;
+
+class NimBLEServerCallbacks {
+ public:
+  virtual ~NimBLEServerCallbacks() {}
+  virtual void onConnect(NimBLEServer *) {}
+  virtual void onConnect(NimBLEServer *, ble_gap_conn_desc *) {}
+  virtual void onDisconnect(NimBLEServer *) {}
+  virtual void onDisconnect(NimBLEServer *, ble_gap_conn_desc *) {}
+};
+
+class NimBLEServer {
+ public:
+  void setCallbacks(NimBLEServerCallbacks *, bool = true) {}
+  NimBLEService *createService(const char *) { return &_service; }
+  size_t getConnectedCount() { return 0; }
+  std::vector<uint16_t> getPeerDevices() { return std::vector<uint16_t>(); }
+  uint16_t getPeerMTU(uint16_t) { return 23; }
+
+ private:
+  NimBLEService _service;
+};
+
+#define BLE_HS_ADV_F_DISC_GEN 0x02
+#define BLE_HS_ADV_F_BREDR_UNSUP 0x04
+
+class NimBLEAdvertisementData {
+ public:
+  void setFlags(uint8_t) {}
+  void setName(const std::string &) {}
+  void setCompleteServices(const NimBLEUUID &) {}
+};
+
+class NimBLEAdvertising {
+ public:
+  void addServiceUUID(const char *) {}
+  void setMinInterval(uint16_t) {}
+  void setMaxInterval(uint16_t) {}
+  void setAdvertisementData(NimBLEAdvertisementData &) {}
+  void setScanResponseData(NimBLEAdvertisementData &) {}
+  bool start(uint32_t = 0) { return true; }
+};
+
+// ---------------- Client ----------------
+
+class NimBLEAdvertisedDevice {
+ public:
+  NimBLEAddress getAddress() { return NimBLEAddress(); }
+  bool isAdvertisingService(const NimBLEUUID &) { return false; }
+};
+
+class NimBLEAdvertisedDeviceCallbacks {
+ public:
+  virtual ~NimBLEAdvertisedDeviceCallbacks() {}
+  virtual void onResult(NimBLEAdvertisedDevice *) {}
+};
+
+class NimBLEScanResults {};
+
+class NimBLEScan {
+ public:
+  void setAdvertisedDeviceCallbacks(NimBLEAdvertisedDeviceCallbacks *, bool = false) {}
+  void setMaxResults(uint8_t) {}
+  void setInterval(uint16_t) {}
+  void setWindow(uint16_t) {}
+  void setActiveScan(bool) {}
+  bool start(uint32_t, void (*)(NimBLEScanResults), bool = false) { return false; }
+  bool stop() { return true; }
+};
+
+class NimBLEClient;
+class NimBLERemoteService;
+class NimBLERemoteCharacteristic;
+
+class NimBLERemoteDescriptor {
+ public:
+  uint16_t getHandle() { return 0; }
+};
+
+class NimBLERemoteCharacteristic {
+ public:
+  NimBLERemoteDescriptor *getDescriptor(const NimBLEUUID &) { return nullptr; }
+  NimBLERemoteService *getRemoteService() { return nullptr; }
+  uint16_t getHandle() { return 0; }
+};
+
+class NimBLERemoteService {
+ public:
+  NimBLERemoteCharacteristic *getCharacteristic(const char *) { return nullptr; }
+  NimBLEClient *getClient() { return nullptr; }
+};
+
+class NimBLEClientCallbacks {
+ public:
+  virtual ~NimBLEClientCallbacks() {}
+  virtual void onConnect(NimBLEClient *) {}
+  virtual void onDisconnect(NimBLEClient *) {}
+};
+
+class NimBLEClient {
+ public:
+  void setClientCallbacks(NimBLEClientCallbacks *, bool = true) {}
+  void setConnectionParams(uint16_t, uint16_t, uint16_t, uint16_t, uint16_t = 16, uint16_t = 16) {}
+  void setConnectTimeout(uint32_t) {}
+  bool connect(const NimBLEAddress &, bool = true) { return false; }
+  int disconnect(uint8_t = 0x13) { return 0; }
+  bool isConnected() { return false; }
+  NimBLERemoteService *getService(const char *) { return nullptr; }
+  void updateConnParams(uint16_t, uint16_t, uint16_t, uint16_t) {}
+  NimBLEAddress getPeerAddress() { return NimBLEAddress(); }
+  uint16_t getMTU() { return 23; }
+  uint16_t getConnId() { return 0; }
+};
+
+// ---------------- Device ----------------
+
+class NimBLEDevice {
+ public:
+  static void init(const std::string &) {}
+  static void setPower(int) {}
+  static bool setMTU(uint16_t) { return true; }
+  static NimBLEAddress getAddress() { return NimBLEAddress(); }
+  static NimBLEServer *createServer() {
+    static NimBLEServer server;
+    return &server;
+  }
+  static NimBLEAdvertising *getAdvertising() {
+    static NimBLEAdvertising advertising;
+    return &advertising;
+  }
+  static NimBLEScan *getScan() {
+    static NimBLEScan scan;
+    return &scan;
+  }
+  static NimBLEClient *createClient() { return new NimBLEClient(); }
+  static bool setCustomGapHandler(gap_event_handler *) { return true; }
+};
+
+inline int ble_gap_set_prefered_le_phy(uint16_t, uint8_t, uint8_t, uint16_t) { return 0; }
+
+
+#endif // SIM_NIMBLE_DEVICE_H
@@ -0,0 +1,46 @@
+// Host shim of the NVS key-value store; each board keeps its own, in memory
+#ifndef SIM_PREFERENCES_H
+#define SIM_PREFERENCES_H
+
+#include "Arduino.h"
+
+class Preferences {
+ public:
+  bool begin(const char *name, bool readOnly = false);
+  void end() { _ns.clear(); }
+  bool clear();
+  bool remove(const char *key);
+  bool isKey(const char *key);
+
+  size_t putBytes(const char *key, const void *value, size_t len);
+  size_t getBytes(const char *key, void *buf, size_t maxLen);
+  size_t getBytesLength(const char *key);
+
+  size_t putString(const char *key, const String &value) { return putBytes(key, value.data(), value.size()); }
+  String getString(const char *key, const String &def = String());
+
+  size_t putBool(const char *key, bool v) { return put(key, v); }
+  bool getBool(const char *key, bool def = false) { return get(key, def); }
+  size_t putUChar(const char *key, uint8_t v) { return put(key, v); }
+  uint8_t getUChar(const char *key, uint8_t def = 0) { return get(key, def); }
+  size_t putUShort(const char *key, uint16_t v) { return put(key, v); }
+  uint16_t getUShort(const char *key, uint16_t def = 0) { return get(key, def); }
+  size_t putInt(const char *key, int32_t v) { return put(key, v); }
+  int32_t getInt(const char *key, int32_t def = 0) { return get(key, def); }
+  size_t putUInt(const char *key, uint32_t v) { return put(key, v); }
+  uint32_t getUInt(const char *key, uint32_t def = 0) { return get(key, def); }
+  size_t putULong64(const char *key, uint64_t v) { return put(key, v); }
+  uint64_t getULong64(const char *key, uint64_t def = 0) { return get(key, def); }
+
+ private:
+  template <class T> size_t put(const char *key, T v) { return putBytes(key, &v, sizeof(v)); }
+  template <class T> T get(const char *key, T def) {
+    T v;
+    return getBytesLength(key) == sizeof(T) && getBytes(key, &v, sizeof(v)) == sizeof(T) ? v : def;
+  }
+
+  std::string _ns;
+  bool _readOnly = false;
+};
+
+#endif // SIM_PREFERENCES_H
@@ -0,0 +1,21 @@
+// Host shim: flashing always fails
+#ifndef SIM_UPDATE_H
+#define SIM_UPDATE_H
+
+#include "WiFiClientSecure.h"
+
+#define UPDATE_SIZE_UNKNOWN 0xFFFFFFFF
+
+class UpdateClass {
+ public:
+  bool begin(size_t, int = 0) { return false; }
+  size_t write(uint8_t *, size_t len) { return len; }
+  size_t writeStream(WiFiClient &) { return 0; }
+  bool end(bool = false) { return false; }
+  int getError() { return 0; }
+  void abort() {}
+  bool isRunning() { return false; }
+};
+extern UpdateClass Update;
+
+#endif // SIM_UPDATE_H
@@ -0,0 +1,44 @@
+// Host shim of the WiFi class: no access points, so OTA falls through
+#ifndef SIM_WIFI_H
+#define SIM_WIFI_H
+
+#include "Arduino.h"
+
+#define WIFI_OFF 0
+#define WIFI_STA 1
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+
+typedef enum { WIFI_AUTH_OPEN = 0, WIFI_AUTH_WPA2_PSK = 3 } wifi_auth_mode_t;
+
+struct IPAddress {
+  String toString() const { return "0.0.0.0"; }
+};
+
+class SimWiFi {
+ public:
+  bool mode(int m);
+  bool disconnect(bool wifiOff = false, bool eraseAp = false);
+  String macAddress();
+  uint8_t *macAddress(uint8_t *mac);
+  int scanNetworks() { return 0; }
+  String SSID() { return ""; }
+  uint8_t *BSSID() { return _bssid; }
+  String SSID(int) { return ""; }
+  int encryptionType(int) { return WIFI_AUTH_OPEN; }
+  int32_t RSSI() { return 0; }
+  int32_t channel();
+  int begin(const char *, const char * = nullptr, int32_t = 0, const uint8_t * = nullptr, bool = true) {
+    return WL_DISCONNECTED;
+  }
+  int status() { return WL_DISCONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+  void setAutoReconnect(bool) {}
+  void persistent(bool) {}
+
+ private:
+  uint8_t _bssid[6] = {0};
+};
+extern SimWiFi WiFi;
+
+#endif // SIM_WIFI_H
@@ -0,0 +1,24 @@
+// Host shim: network clients that never connect
+#ifndef SIM_WIFI_CLIENT_SECURE_H
+#define SIM_WIFI_CLIENT_SECURE_H
+
+#include "WiFi.h"
+
+class WiFiClient {
+ public:
+  int available() { return 0; }
+  int read() { return -1; }
+  int read(uint8_t *, size_t) { return 0; }
+  size_t readBytes(uint8_t *, size_t) { return 0; }
+  bool connected() { return false; }
+  void setTimeout(int) {}
+  void stop() {}
+};
+
+class WiFiClientSecure : public WiFiClient {
+ public:
+  void setInsecure() {}
+  void setCACert(const char *) {}
+};
+
+#endif // SIM_WIFI_CLIENT_SECURE_H
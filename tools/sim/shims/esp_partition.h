@@ -0,0 +1,19 @@
+// Host shim of the partition table: two app slots in memory (Device::flash)
+#ifndef SIM_ESP_PARTITION_H
+#define SIM_ESP_PARTITION_H
+
+#include "Arduino.h"
+
+static constexpr uint32_t SIM_SLOT_BYTES = 0x1E0000;  // app0/app1 of the 4 MB OTA layout
+
+typedef struct {
+  uint32_t address;
+  uint32_t size;
+  char label[17];
+} esp_partition_t;
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *part, size_t offset, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *part, size_t offset, const void *src, size_t size);
+esp_err_t esp_partition_read(const esp_partition_t *part, size_t offset, void *dst, size_t size);
+
+#endif // SIM_ESP_PARTITION_H
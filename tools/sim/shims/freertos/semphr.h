@@ -0,0 +1,14 @@
+// Host shim of FreeRTOS mutexes and binary semaphores
+#ifndef SIM_FREERTOS_SEMPHR_H
+#define SIM_FREERTOS_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+typedef struct SimMutex *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateBinary();
+BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t m);
+
+#endif // SIM_FREERTOS_SEMPHR_H
@@ -0,0 +1,20 @@
+// Host shim of mbedtls SHA-256 (the 2.x _ret API), a plain software digest
+#ifndef SIM_MBEDTLS_SHA256_H
+#define SIM_MBEDTLS_SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t total;        // bytes hashed so far
+  uint8_t buffer[64];
+} mbedtls_sha256_context;
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx);
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx);
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224);
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t len);
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32]);
+
+#endif // SIM_MBEDTLS_SHA256_H
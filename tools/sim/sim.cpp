@@ -0,0 +1,374 @@
+// Host simulation of controller and node boards
+#include "sim.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ucontext.h>
+
+namespace Sim {
+
+// A FreeRTOS task, run as a coroutine on its own stack. It only gives the
+// CPU back where FreeRTOS would block it (notify wait, delay, mutex).
+struct Task {
+  Device *dev = nullptr;
+  void (*fn)(void *) = nullptr;
+  void *arg = nullptr;
+  std::string name;
+  ucontext_t ctx;
+  ucontext_t caller;
+  std::vector<char> stack;
+  bool done = false;
+};
+
+static constexpr size_t TASK_STACK = 256 * 1024;
+
+static World *g_world = nullptr;
+static Device *g_current = nullptr;
+
+std::vector<Firmware> &firmwares() {
+  static std::vector<Firmware> list;
+  return list;
+}
+
+Device &current() {
+  if (!g_current) {
+    fprintf(stderr, "sim: firmware code ran outside a board context\n");
+    abort();
+  }
+  return *g_current;
+}
+
+World &world() {
+  return *g_world;
+}
+
+bool hasCurrent() {
+  return g_current != nullptr;
+}
+
+Context::Context(Device *dev) : _prev(g_current) {
+  g_current = dev;
+}
+
+Context::~Context() {
+  g_current = _prev;
+}
+
+// ---------------- Clocks ----------------
+
+int64_t Device::localAt(uint64_t trueUs) const {
+  double elapsed = (double)((int64_t)trueUs - (int64_t)bootTrueUs);
+  return (int64_t)std::floor(elapsed * (1.0 + driftPpm * 1e-6));
+}
+
+uint64_t Device::trueAt(int64_t localUs) const {
+  // Earliest true time at which the local clock reads localUs
+  double elapsed = std::ceil((double)localUs / (1.0 + driftPpm * 1e-6));
+  uint64_t t = bootTrueUs + (uint64_t)std::max(0.0, elapsed);
+  while (localAt(t) < localUs) t++;
+  return t;
+}
+
+int64_t Device::localNow() const {
+  return localAt(g_world->now());
+}
+
+// ---------------- World ----------------
+
+// Arduino's loopTask: setup() once, then loop() forever. Each pass is
+// charged loopUs so time moves on between passes.
+static void loopTaskMain(void *arg) {
+  Device *d = (Device *)arg;
+  d->fw->setup();
+  for (;;) {
+    d->fw->loop();
+    g_world->delayLocal(*d, g_world->options().loopUs);
+  }
+}
+
+World::World(const Options &opt) : _opt(opt), _rng(opt.seed) {
+  g_world = this;
+
+  const Firmware *ctrl = nullptr;
+  std::vector<const Firmware *> nodeFw;
+  for (const Firmware &fw : firmwares()) {
+    if (fw.controller && !ctrl) ctrl = &fw;
+    if (!fw.controller) nodeFw.push_back(&fw);
+  }
+  if (!ctrl || nodeFw.size() < opt.nodes) {
+    fprintf(stderr, "sim: need 1 controller and %u node firmwares, have %zu\n",
+            (unsigned)opt.nodes, nodeFw.size());
+    exit(2);
+  }
+
+  std::uniform_real_distribution<double> drift(-opt.driftPpm, opt.driftPpm);
+  std::uniform_int_distribution<uint32_t> boot(0, opt.maxBootSkewUs);
+  for (uint8_t i = 0; i <= opt.nodes; i++) {
+    Device *d = new Device();
+    d->fw = i == 0 ? ctrl : nodeFw[i - 1];
+    d->name = i == 0 ? "ctrl" : "node" + std::to_string(i);
+    const uint8_t mac[6] = {0x24, 0x0A, 0xC4, 0x51, 0x00, i};
+    memcpy(d->mac, mac, 6);
+    // The controller is the reference clock; nodes drift against it
+    d->driftPpm = i == 0 ? 0.0 : drift(_rng);
+    d->bootTrueUs = boot(_rng);
+    d->rng.seed(opt.seed * 7919u + i);
+    _devices.push_back(d);
+  }
+
+  for (Device *d : _devices) {
+    at(d->bootTrueUs, d, [this, d]() {
+      d->booted = true;
+      createTask(*d, loopTaskMain, d, "loopTask");
+    });
+  }
+  if (_opt.probeUs) at(_opt.probeUs, nullptr, [this]() { probeOffsets(); });
+}
+
+World::~World() {
+  for (Task *t : _tasks) delete t;
+  for (Device *d : _devices) delete d;
+  g_world = nullptr;
+}
+
+void World::at(uint64_t trueUs, Device *dev, std::function<void()> fn) {
+  _events.push(Event{std::max(trueUs, _now), _seq++, dev, std::move(fn)});
+}
+
+void World::run() {
+  runUntil((uint64_t)(_opt.seconds * 1e6) + _opt.maxBootSkewUs);
+}
+
+void World::runUntil(uint64_t trueUs) {
+  while (!_events.empty() && _events.top().at <= trueUs) {
+    Event ev = _events.top();
+    _events.pop();
+    if (ev.at > _now) _now = ev.at;
+    Context c(ev.dev);
+    ev.fn();
+  }
+  if (trueUs > _now) _now = trueUs;
+}
+
+void World::delayLocal(Device &dev, uint64_t us) {
+  if (!_task) {
+    fprintf(stderr, "sim: %s: delay outside a task (timer or radio callback)\n", dev.name.c_str());
+    abort();
+  }
+  // The task sleeps and lets everything else run
+  Task *t = _task;
+  at(dev.trueAt(dev.localNow() + (int64_t)us), t->dev, [this, t]() { resume(t); });
+  block();
+}
+
+void World::probeOffsets() {
+  Device *ctrl = controller();
+  for (Device *d : _devices) {
+    if (d == ctrl || !d->booted || !d->fw->offsetEstimate) continue;
+    int64_t local = d->localAt(_now);
+    int64_t estimate;
+    if (!d->fw->offsetEstimate(local, estimate)) continue;
+    int64_t truth = local - ctrl->localAt(_now);
+    d->offsets.push_back(OffsetSample{_now, estimate - truth});
+  }
+  at(_now + _opt.probeUs, nullptr, [this]() { probeOffsets(); });
+}
+
+// ---------------- Tasks ----------------
+
+static void taskEntry(uint32_t lo, uint32_t hi) {
+  Task *t = (Task *)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+  t->fn(t->arg);
+  t->done = true;
+  // FreeRTOS tasks must not return; park it for good
+  swapcontext(&t->ctx, &t->caller);
+}
+
+Task *World::createTask(Device &dev, void (*fn)(void *), void *arg, const char *name) {
+  Task *t = new Task();
+  t->dev = &dev;
+  t->fn = fn;
+  t->arg = arg;
+  t->name = name ? name : "";
+  t->stack.resize(TASK_STACK);
+  getcontext(&t->ctx);
+  t->ctx.uc_stack.ss_sp = t->stack.data();
+  t->ctx.uc_stack.ss_size = t->stack.size();
+  t->ctx.uc_link = nullptr;
+  uintptr_t p = (uintptr_t)t;
+  makecontext(&t->ctx, (void (*)())taskEntry, 2, (uint32_t)(p & 0xFFFFFFFFu), (uint32_t)(p >> 32));
+  _tasks.push_back(t);
+
+  at(_now, &dev, [this, t]() { resume(t); });
+  return t;
+}
+
+void World::resume(Task *task) {
+  if (task->done || task == _task) return;
+  Task *prev = _task;
+  _task = task;
+  {
+    Context c(task->dev);
+    swapcontext(&task->caller, &task->ctx);
+  }
+  _task = prev;
+}
+
+void World::block() {
+  Task *t = _task;
+  if (!t) {
+    fprintf(stderr, "sim: blocking call outside a task\n");
+    abort();
+  }
+  swapcontext(&t->ctx, &t->caller);
+}
+
+// ---------------- Radio ----------------
+
+uint32_t World::sampleLatency() {
+  const LinkModel &l = _opt.link;
+  double extra = 0.0;
+  if (l.jitterUs > 0) {
+    if (l.jitter == Jitter::UNIFORM) {
+      extra = std::uniform_real_distribution<double>(0.0, l.jitterUs)(_rng);
+    } else {
+      extra = std::exponential_distribution<double>(1.0 / l.jitterUs)(_rng);
+    }
+  }
+  return l.latencyUs + (uint32_t)extra;
+}
+
+bool World::transmit(Device &src, const uint8_t *dest, const uint8_t *data, size_t len) {
+  static const uint8_t broadcast[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+  bool isBroadcast = memcmp(dest, broadcast, 6) == 0;
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+
+  src.framesSent++;
+  bool delivered = false;
+  uint32_t lastLatency = _opt.link.latencyUs;
+  for (Device *d : _devices) {
+    if (d == &src || !d->booted || !d->espnowReady || !d->recvCb) continue;
+    if (d->channel != src.channel) continue;
+    if (!isBroadcast && memcmp(dest, d->mac, 6) != 0) continue;
+    if (coin(_rng) < _opt.link.loss) {
+      d->framesLost++;
+      continue;
+    }
+
+    // A radio sends its frames one after another, so however the delay
+    // varies they arrive in the order they were sent
+    uint64_t &last = _lastArrival[std::make_pair(&src, d)];
+    uint64_t arrival = std::max(_now + sampleLatency(), last);
+    last = arrival;
+    lastLatency = (uint32_t)(arrival - _now);
+    std::vector<uint8_t> frame(data, data + len);
+    std::vector<uint8_t> from(src.mac, src.mac + 6);
+    at(arrival, d, [d, frame, from]() {
+      d->framesReceived++;
+      d->recvCb(from.data(), frame.data(), (int)frame.size());
+    });
+    delivered = true;
+  }
+
+  // Unicast is acknowledged by the receiver, and the ACK can be lost too
+  bool ok = isBroadcast || (delivered && coin(_rng) >= _opt.link.loss);
+  if (src.sendCb) {
+    std::vector<uint8_t> to(dest, dest + 6);
+    Device *s = &src;
+    at(_now + lastLatency + _opt.link.latencyUs, s, [s, to, ok]() {
+      s->sendCb(to.data(), ok);
+    });
+  }
+  return ok;
+}
+
+// ---------------- Serial ----------------
+
+void World::log(Device &dev, const std::string &text) {
+  for (char c : text) {
+    if (c == '\r') continue;
+    if (c != '\n') {
+      dev.line += c;
+      continue;
+    }
+    if (_opt.verbose) {
+      printf("%12.6f %-6s %s\n", _now / 1e6, dev.name.c_str(), dev.line.c_str());
+    }
+    dev.line.clear();
+  }
+}
+
+// ---------------- Analysis ----------------
+
+Stats summarize(std::vector<double> values) {
+  Stats s;
+  if (values.empty()) return s;
+  for (double &v : values) v = std::fabs(v);
+  std::sort(values.begin(), values.end());
+  s.count = values.size();
+  double sum = 0.0;
+  for (double v : values) sum += v;
+  s.mean = sum / values.size();
+  s.p50 = values[(values.size() - 1) / 2];
+  s.p99 = values[(size_t)std::ceil(0.99 * values.size()) - 1];
+  s.max = values.back();
+  return s;
+}
+
+Alignment edgeAlignment(World &world, uint64_t fromTrueUs, uint32_t windowUs) {
+  Alignment a;
+  Device *ctrl = world.controller();
+  // Controller ON edges per channel, already in time order
+  std::vector<uint64_t> on[16];
+  for (const Edge &c : ctrl->edges) {
+    if (c.duty != 0) on[c.channel].push_back(c.trueUs);
+  }
+
+  std::vector<double> errors;
+  for (Device *d : world.devices()) {
+    if (d == ctrl) continue;
+    for (const Edge &e : d->edges) {
+      if (e.trueUs < fromTrueUs || e.duty == 0) continue;
+      const std::vector<uint64_t> &ref = on[e.channel];
+      int64_t best = INT64_MAX;
+      auto it = std::lower_bound(ref.begin(), ref.end(), e.trueUs);
+      if (it != ref.end()) best = (int64_t)e.trueUs - (int64_t)*it;
+      if (it != ref.begin()) {
+        int64_t before = (int64_t)e.trueUs - (int64_t)*(it - 1);
+        if (std::llabs(before) < std::llabs(best)) best = before;
+      }
+      if (best != INT64_MAX && std::llabs(best) <= windowUs) {
+        errors.push_back((double)best);
+        a.matched++;
+      } else {
+        a.unmatched++;
+      }
+    }
+  }
+  a.error = summarize(errors);
+  return a;
+}
+
+int64_t convergenceUs(World &world, uint32_t thresholdUs) {
+  Device *ctrl = world.controller();
+  int64_t slowest = 0;
+  for (Device *d : world.devices()) {
+    if (d == ctrl) continue;
+    if (d->offsets.empty()) return -1;
+    // Converged after the last sample that was still off
+    uint64_t since = 0;
+    for (const OffsetSample &s : d->offsets) {
+      if (std::llabs(s.errorUs) > (int64_t)thresholdUs) since = 0;
+      else if (since == 0) since = s.trueUs;
+    }
+    if (since == 0) return -1;
+    uint64_t bothUp = std::max(d->bootTrueUs, ctrl->bootTrueUs);
+    slowest = std::max(slowest, (int64_t)since - (int64_t)bothUp);
+  }
+  return slowest;
+}
+
+} // namespace Sim
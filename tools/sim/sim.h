@@ -0,0 +1,214 @@
+// Host simulation of controller and node boards
+#ifndef SIM_H
+#define SIM_H
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <utility>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+// Every simulated board runs the real firmware (src/main.ino compiled once
+// per board, see firmware.cpp) against the shims in shims/. Time is virtual
+// and only moves when the event queue says so, so a run is deterministic
+// for a given seed and as fast as the host allows.
+//
+// "True" time is the simulation's reference clock. Each board sees its own
+// local clock, which started at a random boot time and runs fast or slow
+// by driftPpm, exactly what the clock sync has to undo.
+
+namespace Sim {
+
+enum class Jitter { UNIFORM, EXPONENTIAL };
+
+// One-way radio link between any two boards
+struct LinkModel {
+  uint32_t latencyUs = 2000;   // fixed part of the one-way delay
+  uint32_t jitterUs = 500;     // random part: uniform width or exponential mean
+  Jitter   jitter = Jitter::EXPONENTIAL;
+  double   loss = 0.0;         // probability a frame is lost
+};
+
+struct Edge {
+  uint64_t trueUs;
+  int64_t  localUs;
+  uint8_t  channel;
+  uint32_t duty;
+};
+
+// Firmware offset estimate vs the truth, sampled on a node
+struct OffsetSample {
+  uint64_t trueUs;
+  int64_t  errorUs;  // estimated minus true (node - controller)
+};
+
+struct Task;
+
+// Firmware entry points of one compiled copy (firmware.cpp registers them)
+struct Firmware {
+  const char *ns;
+  bool controller;
+  void (*setup)();
+  void (*loop)();
+  // Node only: the firmware's own offset estimate at a local time, and
+  // whether it has one yet
+  bool (*offsetEstimate)(int64_t localUs, int64_t &offsetUs);
+  // Stimulation cycles started so far
+  uint32_t (*cycles)();
+  // Controller only: put a node image of this many bytes in the inactive
+  // slot, as if downloaded, for the nodes to fetch over the sync link
+  void (*seedNodeImage)(uint32_t bytes);
+};
+
+std::vector<Firmware> &firmwares();
+
+struct Device {
+  std::string name;
+  const Firmware *fw = nullptr;
+  uint8_t mac[6] = {0};
+  double  driftPpm = 0.0;
+  uint64_t bootTrueUs = 0;       // true time the board powered on
+
+  // Radio
+  bool espnowReady = false;
+  uint8_t channel = 1;
+  void (*recvCb)(const uint8_t *, const uint8_t *, int) = nullptr;
+  std::function<void(const uint8_t *, bool)> sendCb;  // (dest, delivered)
+  std::vector<std::vector<uint8_t>> peers;
+  uint32_t framesSent = 0;
+  uint32_t framesReceived = 0;
+  uint32_t framesLost = 0;
+
+  // LEDC
+  uint32_t duty[16] = {0};
+  uint32_t freq[16] = {0};
+  std::vector<Edge> edges;
+  std::vector<OffsetSample> offsets;
+
+  // Scheduling
+  bool booted = false;
+  std::mt19937 rng;              // esp_random()
+  std::minstd_rand userRng;      // random(), reseeded by randomSeed()
+  std::string line;              // Serial output not yet terminated
+  std::string serialIn;          // typed into Serial, not read yet
+  std::map<std::string, std::string> nvs;  // Preferences, by "namespace/key"
+  std::vector<uint8_t> flash[2];           // app0/app1, allocated on first use
+  uint8_t runningSlot = 0;
+  int8_t bootSlot = -1;          // slot set to boot next, -1 if unchanged
+
+  int64_t localAt(uint64_t trueUs) const;
+  uint64_t trueAt(int64_t localUs) const;
+  int64_t localNow() const;
+};
+
+struct Options {
+  uint8_t  nodes = 1;
+  double   seconds = 30.0;
+  uint32_t seed = 1;
+  LinkModel link;
+  double   driftPpm = 20.0;      // nodes drift up to +-this vs the controller
+  uint32_t loopUs = 500;         // time one pass of loop() takes
+  uint32_t taskWakeUs = 20;      // notify -> task running
+  uint32_t maxBootSkewUs = 2000000;
+  uint32_t probeUs = 100000;     // offset estimate sampling period (0 = off)
+  bool     verbose = false;
+};
+
+class World {
+ public:
+  explicit World(const Options &opt);
+  ~World();
+
+  void run();
+  void runUntil(uint64_t trueUs);
+  uint64_t now() const { return _now; }
+
+  // Queue fn to run at trueUs on dev (nullptr: no device context)
+  void at(uint64_t trueUs, Device *dev, std::function<void()> fn);
+
+  // Radio: deliver a frame from src to every board it reaches
+  bool transmit(Device &src, const uint8_t *dest, const uint8_t *data, size_t len);
+
+  void log(Device &dev, const std::string &text);
+
+  std::vector<Device *> &devices() { return _devices; }
+  Device *controller() { return _devices.empty() ? nullptr : _devices[0]; }
+  const Options &options() const { return _opt; }
+
+  // Shim support
+  void delayLocal(Device &dev, uint64_t us);
+  Task *createTask(Device &dev, void (*fn)(void *), void *arg, const char *name);
+  void resume(Task *task);
+  void block();
+  Task *currentTask() const { return _task; }
+
+ private:
+  struct Event {
+    uint64_t at;
+    uint64_t seq;
+    Device *dev;
+    std::function<void()> fn;
+    bool operator>(const Event &o) const { return at != o.at ? at > o.at : seq > o.seq; }
+  };
+
+  uint32_t sampleLatency();
+  void probeOffsets();
+
+  Options _opt;
+  uint64_t _now = 0;
+  uint64_t _seq = 0;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> _events;
+  std::vector<Device *> _devices;
+  std::vector<Task *> _tasks;
+  std::map<std::pair<Device *, Device *>, uint64_t> _lastArrival;  // per link, keeps frames in order
+  Task *_task = nullptr;
+  std::mt19937 _rng;
+};
+
+// Distribution of absolute errors
+struct Stats {
+  size_t count = 0;
+  double mean = 0.0;
+  double p50 = 0.0;
+  double p99 = 0.0;
+  double max = 0.0;
+};
+
+Stats summarize(std::vector<double> values);
+
+// How far each node's pulse ON edges land from the controller's matching
+// edge (same channel, nearest within windowUs), from fromTrueUs on
+struct Alignment {
+  Stats error;
+  uint32_t matched = 0;
+  uint32_t unmatched = 0;
+};
+
+Alignment edgeAlignment(World &world, uint64_t fromTrueUs, uint32_t windowUs = 50000);
+
+// Time from when a node and the controller are both up until its offset
+// estimate is within thresholdUs for good; the slowest node counts. -1 if
+// some node never gets there.
+int64_t convergenceUs(World &world, uint32_t thresholdUs);
+
+// The board whose code is running right now, and the world it lives in
+Device &current();
+World &world();
+bool hasCurrent();
+
+// Makes dev current for the lifetime of the guard
+class Context {
+ public:
+  explicit Context(Device *dev);
+  ~Context();
+ private:
+  Device *_prev;
+};
+
+} // namespace Sim
+
+#endif // SIM_H
@@ -0,0 +1,139 @@
+// cmco_sim: run a controller and its nodes on the host and report how well
+// their pulses line up
+#include "sim.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static void usage() {
+  printf("usage: cmco_sim [options]\n"
+         "  --nodes N          nodes besides the controller (default 1)\n"
+         "  --seconds S        simulated run time (default 30)\n"
+         "  --seed N           random seed (default 1)\n"
+         "  --latency-us US    fixed one-way radio delay (default 2000)\n"
+         "  --jitter-us US     random delay: uniform width or exponential mean (default 500)\n"
+         "  --jitter KIND      uniform | exp (default exp)\n"
+         "  --loss P           frame loss probability (default 0)\n"
+         "  --drift-ppm PPM    node clocks drift up to +-PPM (default 20)\n"
+         "  --loop-us US       loop() period (default 500)\n"
+         "  --warmup S         ignore edges before this (default 8)\n"
+         "  --check US         exit 1 unless edges align within US at p99\n"
+         "  --type S:BOARD:TEXT  type TEXT and Enter into BOARD's Serial at S seconds\n"
+         "  --node-image BYTES give the controller newer node firmware of BYTES to pass on\n"
+         "  --verbose          print every board's Serial output\n");
+}
+
+int main(int argc, char **argv) {
+  Sim::Options opt;
+  double warmup = 8.0;
+  double checkUs = -1.0;
+  std::vector<std::string> typed;
+  uint32_t nodeImageBytes = 0;
+
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+    bool used = true;
+    if (!strcmp(a, "--verbose")) {
+      opt.verbose = true;
+      continue;
+    }
+    if (!strcmp(a, "--help") || !v) {
+      usage();
+      return strcmp(a, "--help") ? 2 : 0;
+    }
+    if (!strcmp(a, "--nodes")) opt.nodes = (uint8_t)atoi(v);
+    else if (!strcmp(a, "--seconds")) opt.seconds = atof(v);
+    else if (!strcmp(a, "--seed")) opt.seed = (uint32_t)strtoul(v, nullptr, 0);
+    else if (!strcmp(a, "--latency-us")) opt.link.latencyUs = (uint32_t)atoi(v);
+    else if (!strcmp(a, "--jitter-us")) opt.link.jitterUs = (uint32_t)atoi(v);
+    else if (!strcmp(a, "--jitter")) opt.link.jitter = strcmp(v, "uniform") ? Sim::Jitter::EXPONENTIAL : Sim::Jitter::UNIFORM;
+    else if (!strcmp(a, "--loss")) opt.link.loss = atof(v);
+    else if (!strcmp(a, "--drift-ppm")) opt.driftPpm = atof(v);
+    else if (!strcmp(a, "--loop-us")) opt.loopUs = (uint32_t)atoi(v);
+    else if (!strcmp(a, "--warmup")) warmup = atof(v);
+    else if (!strcmp(a, "--check")) checkUs = atof(v);
+    else if (!strcmp(a, "--type")) typed.push_back(v);
+    else if (!strcmp(a, "--node-image")) nodeImageBytes = (uint32_t)strtoul(v, nullptr, 0);
+    else used = false;
+    if (!used) {
+      usage();
+      return 2;
+    }
+    i++;
+  }
+
+  Sim::World world(opt);
+  for (const std::string &t : typed) {
+    size_t a = t.find(':');
+    size_t b = a == std::string::npos ? a : t.find(':', a + 1);
+    Sim::Device *dev = nullptr;
+    for (Sim::Device *d : world.devices()) {
+      if (b != std::string::npos && d->name == t.substr(a + 1, b - a - 1)) dev = d;
+    }
+    if (!dev) {
+      fprintf(stderr, "--type %s: expected SECONDS:BOARD:TEXT with a board name like ctrl or node1\n", t.c_str());
+      return 2;
+    }
+    std::string text = t.substr(b + 1) + "\n";
+    world.at((uint64_t)(atof(t.c_str()) * 1e6), dev, [dev, text]() { dev->serialIn += text; });
+  }
+  if (nodeImageBytes) {
+    Sim::Device *ctrl = world.controller();
+    Sim::Context guard(ctrl);
+    ctrl->fw->seedNodeImage(nodeImageBytes);
+  }
+  world.run();
+
+  printf("%-6s %9s %8s %8s %8s %8s\n", "board", "drift", "edges", "sent", "recv", "lost");
+  for (Sim::Device *d : world.devices()) {
+    printf("%-6s %7.2f %2s %8zu %8u %8u %8u\n", d->name.c_str(), d->driftPpm, "ppm",
+           d->edges.size(), (unsigned)d->framesSent, (unsigned)d->framesReceived,
+           (unsigned)d->framesLost);
+  }
+
+  uint64_t from = (uint64_t)(warmup * 1e6) + opt.maxBootSkewUs;
+  Sim::Alignment a = Sim::edgeAlignment(world, from);
+  printf("\nON edge alignment vs controller (after %.1f s): %u matched, %u unmatched\n",
+         warmup, (unsigned)a.matched, (unsigned)a.unmatched);
+  printf("  mean %.1f us  p50 %.1f us  p99 %.1f us  max %.1f us\n",
+         a.error.mean, a.error.p50, a.error.p99, a.error.max);
+
+  std::vector<double> offsets;
+  for (Sim::Device *d : world.devices()) {
+    for (const Sim::OffsetSample &s : d->offsets) {
+      if (s.trueUs >= from) offsets.push_back((double)s.errorUs);
+    }
+  }
+  Sim::Stats o = Sim::summarize(offsets);
+  printf("Node offset estimate error: %zu samples\n", o.count);
+  printf("  mean %.1f us  p50 %.1f us  p99 %.1f us  max %.1f us\n",
+         o.mean, o.p50, o.p99, o.max);
+
+  // A node has the image once the slot it boots next holds the same bytes
+  bool fwOk = true;
+  if (nodeImageBytes) {
+    Sim::Device *ctrl = world.controller();
+    const std::vector<uint8_t> &image = ctrl->flash[1 - ctrl->runningSlot];
+    printf("\nNode firmware transfer (%u bytes):\n", (unsigned)nodeImageBytes);
+    for (Sim::Device *d : world.devices()) {
+      if (d == ctrl) continue;
+      bool installed = d->bootSlot >= 0 && d->flash[d->bootSlot].size() >= nodeImageBytes &&
+                       std::equal(image.begin(), image.begin() + nodeImageBytes, d->flash[d->bootSlot].begin());
+      printf("  %-6s %s\n", d->name.c_str(), installed ? "installed" : "not installed");
+      fwOk = fwOk && installed;
+    }
+  }
+
+  if (checkUs >= 0.0) {
+    bool ok = a.matched > 0 && a.unmatched == 0 && a.error.p99 <= checkUs && fwOk;
+    printf("\ncheck (p99 <= %.0f us, every edge matched%s): %s\n", checkUs,
+           nodeImageBytes ? ", node firmware installed" : "", ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+  }
+  return 0;
+}